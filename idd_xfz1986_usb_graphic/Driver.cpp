@@ -24,6 +24,9 @@ using namespace Microsoft::IndirectDisp;
 using namespace Microsoft::WRL;
 
 void scale_for_320x240(uint32_t * dst, uint32_t * src, int line, int len);
+long long get_perf_us(void);
+UINT64 perf_us_to_qpc(long long us);
+NTSTATUS usb_send_msg_async(urb_itm_t * urb, WDFUSBPIPE pipe, WDFREQUEST Request, PUCHAR msg, int tsize);
 NTSTATUS
 idd_usbdisp_evt_device_prepareHardware(
 	WDFDEVICE Device,
@@ -333,10 +336,29 @@ HRESULT Direct3DDevice::Init()
 
 #pragma region SwapChainProcessor
 
-SwapChainProcessor::SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, shared_ptr<Direct3DDevice> Device, WDFDEVICE  WdfDevice, HANDLE NewFrameEvent)
-    : m_hSwapChain(hSwapChain), m_Device(Device), mp_WdfDevice(WdfDevice), m_hAvailableBufferEvent(NewFrameEvent)
+//a URB with a transfer buffer of msg_size bytes; _aligned_free() releases both
+static urb_itm_t * urb_alloc(int msg_size)
+{
+    urb_itm_t * urb = (urb_itm_t *)_aligned_malloc(sizeof(urb_itm_t) + msg_size, MEMORY_ALLOCATION_ALIGNMENT);
+
+    if(urb) {
+        urb->urb_msg = (uint8_t *)(urb + 1);
+        urb->urb_msg_size = msg_size;
+    }
+    return urb;
+}
+
+SwapChainProcessor::SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, shared_ptr<Direct3DDevice> Device, WDFDEVICE  WdfDevice, HANDLE NewFrameEvent, IDDCX_MONITOR hMonitor)
+    : m_hSwapChain(hSwapChain), m_hMonitor(hMonitor), m_Device(Device), mp_WdfDevice(WdfDevice), m_hAvailableBufferEvent(NewFrameEvent)
 {
     m_hTerminateEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    m_hUrbFreeEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    m_hEncodeEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    m_hSendEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    m_hFrameFreeEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    m_hPipeStopEvent.Attach(CreateEvent(nullptr, TRUE, FALSE, nullptr));
+    m_hCursorEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
+    m_hCursorFreeEvent.Attach(CreateEvent(nullptr, FALSE, FALSE, nullptr));
 
     // Immediately create and run the swap-chain processing thread, passing 'this' as the thread parameter
     m_hThread.Attach(CreateThread(nullptr, 0, RunThread, this, 0, nullptr));
@@ -373,14 +395,58 @@ void SwapChainProcessor::Run()
 
 
     LOG("init urb list\n");
-    jpg_quality = 6; //default
+    jpg_quality = JPG_QUALITY_DEFAULT;
+    jpg_subsampling = TJE_SUBSAMPLING_444;
+    // tables are built once here, every frame reuses them
+    jpg_encoder = tje_encoder_create();
+    if(jpg_encoder) {
+        tje_encoder_set_optimize_huffman(jpg_encoder, JPG_OPTIMIZE_HUFFMAN);
+        tje_encoder_set_abbreviated(jpg_encoder, JPG_ABBREVIATED_STREAMS);
+        tje_encoder_set_dct(jpg_encoder, JPG_ACCURATE_DCT ? TJE_DCT_ISLOW : TJE_DCT_FAST);
+    }
+    jpg_tables_quality = -1;
+    jpg_tables_age = 0;
+    memset(&jpg_stat, 0, sizeof(jpg_stat));
+    memset(&frame_stat, 0, sizeof(frame_stat));
+    memset(&staging_desc, 0, sizeof(staging_desc));
+    dirty_clear(&dirty_pending);
+    dirty_clear(&dirty_lost);
+    tile_diff_init(&tile_diff, fb_buf, DISP_MAX_HEIGHT * DISP_MAX_WIDTH);
+    fb_width = 0;
+    fb_height = 0;
+    last_present = (UINT64)-1;
+    last_full_us = 0;
+    memset(&frame_lat, 0, sizeof(frame_lat));
+    InitializeSRWLock(&report_lock);
+    sent_trace_open = 0;
+
+    // one slice per core, encoded on the process thread pool
+    jpg_slices = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    if(jpg_slices > JPG_MAX_SLICES)
+        jpg_slices = JPG_MAX_SLICES;
+    jpg_work = NULL;
+    memset(&jpg_job, 0, sizeof(jpg_job));
+    for(i = 0; i < jpg_slices; i++) {
+        jpg_job.buf[i] = (uint8_t *)malloc(JPEG_MAX_SIZE);
+        if(NULL == jpg_job.buf[i]) {
+            jpg_slices = i;
+            break;
+        }
+    }
+    if(jpg_slices > 1) {
+        jpg_work = CreateThreadpoolWork(JpgSliceWork, &jpg_job, NULL);
+        if(NULL == jpg_work) {
+            LOG("jpeg slice work create NG\n");
+            jpg_slices = 1;
+        }
+    }
+    LOG("jpeg slices:%d\n", jpg_slices);
 #define JPG_QUALITY_SIZE_HIGH (100*1024)
     target_quaility_size = JPG_QUALITY_SIZE_HIGH;
     // Insert into the list.
-#define MAX_URB_SIZE 2
+    urb_count = 0;
     for(i = 1; i <= MAX_URB_SIZE; i++) {
-        purb = (urb_itm_t *)_aligned_malloc(sizeof(urb_itm_t),
-                                            MEMORY_ALLOCATION_ALIGNMENT);
+        purb = urb_alloc(DISP_MAX_HEIGHT * DISP_MAX_WIDTH * 4);
         if(NULL == purb) {
             LOG("Memory allocation failed.\n");
             break;
@@ -393,27 +459,38 @@ void SwapChainProcessor::Run()
 
         if(!NT_SUCCESS(status)) {
             LOG("create request NG\n");
+            _aligned_free(purb);
             break;//return status;
         }
         purb->id = i;
 		purb->max_ep_out_size = pDeviceContext->max_out_pkg_size;
         purb->urb_list = &urb_list;
+        purb->free_event = m_hUrbFreeEvent.Get();
+        memset(&purb->trace, 0, sizeof(purb->trace));
         InterlockedPushEntrySList(&urb_list,
                                   &(purb->node));
         curr_urb = purb;
+        urbs[urb_count++] = purb;
     }
 
 
-    RunCore();
+    if(!jpg_encoder) {
+        LOG("jpeg encoder create NG\n");
+    } else {
+        if(start_pipe())
+            RunCore();
+        stop_pipe();
+    }
 
     // Always delete the swap-chain object when swap-chain processing loop terminates in order to kick the system to
     // provide a new swap-chain if necessary.
     WdfObjectDelete((WDFOBJECT)m_hSwapChain);
-    for(i = 1; i <= MAX_URB_SIZE; i++) {
+    //every URB is back in the list here, stop_pipe() waited for those on the bus
+    for(i = 0; i < urb_count; i++) {
 
         PSLIST_ENTRY 	pentry = InterlockedPopEntrySList(&urb_list);
 
-        if(NULL == purb) {
+        if(NULL == pentry) {
             LOG("List is empty.\n");
             break;
         }
@@ -434,6 +511,18 @@ void SwapChainProcessor::Run()
 
     m_hSwapChain = nullptr;
 
+    if(jpg_work) {
+        WaitForThreadpoolWorkCallbacks(jpg_work, TRUE);
+        CloseThreadpoolWork(jpg_work);
+        jpg_work = NULL;
+    }
+    for(i = 0; i < JPG_MAX_SLICES; i++) {
+        free(jpg_job.buf[i]);
+        jpg_job.buf[i] = NULL;
+    }
+    tje_encoder_destroy(jpg_encoder);
+    jpg_encoder = NULL;
+
     AvRevertMmThreadCharacteristics(AvTaskHandle);
 }
 
@@ -455,25 +544,51 @@ void SwapChainProcessor::RunCore()
     if(FAILED(hr)) {
         return;
     }
+    if(cursor_urb)
+        setup_hw_cursor();
+
+    static const readback_ops_t readback_ops = { ReadbackCopy, ReadbackMap, ReadbackFrame, ReadbackUnmap };
+    readback_init(&readback, &readback_ops, this, STAGING_RING_SIZE, READBACK_LAG);
 
     // Acquire and release buffers in a loop
     for(;;) {
         ComPtr<IDXGIResource> AcquiredBuffer;
-        int line_width = 0;
         // Ask for the next buffer from the producer
         IDARG_OUT_RELEASEANDACQUIREBUFFER Buffer = {};
         hr = IddCxSwapChainReleaseAndAcquireBuffer(m_hSwapChain, &Buffer);
 
         // AcquireBuffer immediately returns STATUS_PENDING if no buffer is yet available
         if(hr == E_PENDING) {
-            // We must wait for a new buffer
+            int frame_free = 0 != pipe_ring_count(&frame_free_ring);
+            int keepalive = 0 == keepalive_wait_ms();
+            // no newer frame to overlap with, send the ones still in the readback ring. while
+            // the encode thread holds every frame they stay there, not read back
+            if(readback.pending && frame_free) {
+                readback_poll(&readback, 1);
+                continue;
+            }
+            // rectangles that found no free frame go out from fb_buf once one is back, and so
+            // does the keep-alive frame of a static screen
+            if((dirty_pending.count || keepalive) && frame_free)
+                send_dirty_rects(fb_buf, fb_width);
+            // We must wait for a new buffer, or for a frame of the encoder when something waits for one
             HANDLE WaitHandles [] = {
                 m_hAvailableBufferEvent,
-                m_hTerminateEvent.Get()
+                m_hTerminateEvent.Get(),
+                m_hFrameFreeEvent.Get()
             };
-            DWORD WaitResult = WaitForMultipleObjects(ARRAYSIZE(WaitHandles), WaitHandles, FALSE, 16);
-            if(WaitResult == WAIT_OBJECT_0 || WaitResult == WAIT_TIMEOUT) {
-                // We have a new buffer, so try the AcquireBuffer again
+            DWORD WaitCount = 2;
+            DWORD WaitMs;
+            if(readback.pending || dirty_pending.count || keepalive) {
+                WaitCount = ARRAYSIZE(WaitHandles);
+                WaitMs = 16;
+            } else {
+                // nothing to send: the loop only wakes for a new buffer or the keep-alive
+                WaitMs = (DWORD)keepalive_wait_ms();
+            }
+            DWORD WaitResult = WaitForMultipleObjects(WaitCount, WaitHandles, FALSE, WaitMs);
+            if(WaitResult == WAIT_OBJECT_0 || WaitResult == WAIT_TIMEOUT || WaitResult == WAIT_OBJECT_0 + 2) {
+                // We have a new buffer or a free frame, so try the AcquireBuffer again
                 continue;
             } else if(WaitResult == WAIT_OBJECT_0 + 1) {
                 // We need to terminate
@@ -499,88 +614,62 @@ void SwapChainProcessor::RunCore()
             //LOG("-dxgi fid:%d dirty:%d\n",Buffer.MetaData.PresentationFrameNumber,Buffer.MetaData.DirtyRectCount);
 
 #define RESET_OBJECT(obj) { if(obj) obj->Release(); obj = NULL; }
+            long long t_frame = get_perf_us();
+            long long t = t_frame;
             ID3D11Texture2D *hAcquiredDesktopImage = NULL;
             hr = AcquiredBuffer->QueryInterface(__uuidof(ID3D11Texture2D), reinterpret_cast<void **>(&hAcquiredDesktopImage));
             if(FAILED(hr)) {
                 LOG("dxgi 2d NG\n");
                 goto next;
             }
+            // the same presentation again has nothing new in it, not even worth the GPU copy
+            if(Buffer.MetaData.PresentationFrameNumber == last_present) {
+                frame_stat.repeated++;
+                RESET_OBJECT(hAcquiredDesktopImage);
+                goto next;
+            }
+            last_present = Buffer.MetaData.PresentationFrameNumber;
+            memset(&frame_trace, 0, sizeof(frame_trace));
+            frame_trace.present = (UINT)Buffer.MetaData.PresentationFrameNumber;
+            frame_trace.ts[FRAME_TS_ACQUIRE] = t_frame;
 
             // copy old description
             //
             D3D11_TEXTURE2D_DESC frameDescriptor;
             hAcquiredDesktopImage->GetDesc(&frameDescriptor);
+            collect_dirty_rects(&Buffer.MetaData, frameDescriptor.Width, frameDescriptor.Height);
 
 
             //
-            // create a new staging buffer for cpu accessable, or only GPU can access
+            // staging buffer for cpu access, only GPU can access the acquired one
             //
-            ID3D11Texture2D *hNewDesktopImage = NULL;
-            frameDescriptor.Usage = D3D11_USAGE_STAGING;
-            frameDescriptor.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-            frameDescriptor.BindFlags = 0;
-            frameDescriptor.MiscFlags = 0;
-            frameDescriptor.MipLevels = 1;
-            frameDescriptor.ArraySize = 1;
-            frameDescriptor.SampleDesc.Count = 1;
-            hr = m_Device->Device->CreateTexture2D(&frameDescriptor, NULL, &hNewDesktopImage);
-            if(FAILED(hr)) {
+            if(!prepare_staging_ring(&frameDescriptor)) {
                 RESET_OBJECT(hAcquiredDesktopImage);
-
-                LOG("dxgi create 2d NG\n");
-                goto next;
-            }
-
-            //
-            // copy next staging buffer to new staging buffer
-            //
-            m_Device->DeviceContext->CopyResource(hNewDesktopImage, hAcquiredDesktopImage);
-
-
-            //
-            // create staging buffer for map bits
-            //
-            IDXGISurface *hStagingSurf = NULL;
-            hr = hNewDesktopImage->QueryInterface(__uuidof(IDXGISurface), (void **)(&hStagingSurf));
-            RESET_OBJECT(hNewDesktopImage);//release it
-            if(FAILED(hr)) {
-                LOG("dxgi surf NG\n");
                 goto next;
             }
+            t = put_stage_time(FRAME_STAGE_STAGING, t);
 
             //
-            // copy bits to user space
+            // queue the copy of this frame, then read back and send the previous ones
+            // whose copy is done; the wait for the GPU is left to the next frame.
+            // with every frame held by the encode thread nothing could be sent: the copy replaces
+            // the newest frame not read back yet, and only the latest one is read back once a
+            // frame is free
             //
-            DXGI_MAPPED_RECT mappedRect;
-            hr = hStagingSurf->Map(&mappedRect, DXGI_MAP_READ);
-            if(SUCCEEDED(hr)) {
-#if 0
-                if(640 == frameDescriptor.Width) {
-                    scale_for_320x240((uint32_t *)this->fb_buf, (uint32_t *)mappedRect.pBits, mappedRect.Pitch / 4, frameDescriptor.Width * frameDescriptor.Height);
-                    line_width = mappedRect.Pitch / 8;
-                } else
-#endif
-				{
-                    memcpy(this->fb_buf, mappedRect.pBits, frameDescriptor.Width * frameDescriptor.Height * 4);
-                    line_width = mappedRect.Pitch / 4;
+            if(0 == pipe_ring_count(&frame_free_ring)) {
+                if(!readback_replace(&readback, hAcquiredDesktopImage, Buffer.MetaData.PresentationFrameNumber)) {
+                    LOG("readback replace NG\n");
                 }
-
-                hStagingSurf->Unmap();
+                put_stage_time(FRAME_STAGE_COPY, t);
             } else {
-
-                LOG("dxgi map NG %x\n", hr);
-            }
-			
-            //issue urb
-            {
-                auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(this->mp_WdfDevice);
-                PSLIST_ENTRY 	pentry =  InterlockedPopEntrySList(&urb_list);
-                urb_itm_t* purb = (urb_itm_t*)pentry;
-                if(NULL != purb)
-                    usb_send_jpeg_image(purb, pContext->BulkWritePipe, purb->msg, purb->urb_msg, (pixel_type_t *)fb_buf, 0, 0, frameDescriptor.Width-1, frameDescriptor.Height-1, line_width);
+                if(!readback_push(&readback, hAcquiredDesktopImage, Buffer.MetaData.PresentationFrameNumber)) {
+                    LOG("readback push NG\n");
+                }
+                put_stage_time(FRAME_STAGE_COPY, t);
+                readback_poll(&readback, 0);
             }
-            RESET_OBJECT(hStagingSurf);
             RESET_OBJECT(hAcquiredDesktopImage);
+            put_stage_time(FRAME_STAGE_TOTAL, t_frame);
 next:
 
             AcquiredBuffer.Reset();
@@ -600,6 +689,575 @@ next:
             break;
         }
     }
+    release_staging_ring();
+}
+
+//the ring is (re)created for the description of the acquired buffer when the mode or format
+//changed, after the frames still pending in it are sent
+int SwapChainProcessor::prepare_staging_ring(const D3D11_TEXTURE2D_DESC * src_desc)
+{
+    if(staging_ring[0] && staging_desc.Width == src_desc->Width && staging_desc.Height == src_desc->Height &&
+       staging_desc.Format == src_desc->Format)
+        return 1;
+
+    D3D11_TEXTURE2D_DESC desc = *src_desc;
+    int i;
+
+    readback_poll(&readback, 1);
+    release_staging_ring();
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    desc.BindFlags = 0;
+    desc.MiscFlags = 0;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.SampleDesc.Count = 1;
+    desc.SampleDesc.Quality = 0;
+    for(i = 0; i < STAGING_RING_SIZE; i++) {
+        HRESULT hr = m_Device->Device->CreateTexture2D(&desc, NULL, staging_ring[i].GetAddressOf());
+        if(FAILED(hr)) {
+            LOG("dxgi create 2d NG %x\n", hr);
+            release_staging_ring();
+            return 0;
+        }
+        frame_stat.staging_created++;
+    }
+    LOG("staging ring %dx%d fmt:%d\n", desc.Width, desc.Height, desc.Format);
+    staging_desc = desc;
+    // nothing of the old mode is left to send, the first frame of the new one goes out whole
+    dirty_clear(&dirty_pending);
+    dirty_clear(&dirty_lost);
+    dirty_clear(&frame_dirty);
+    tile_diff_reset(&tile_diff);
+    dirty_add(&frame_dirty, 0, 0, desc.Width, desc.Height, desc.Width, desc.Height);
+    return 1;
+}
+
+//the dirty rectangles and move destinations of the acquired frame into frame_dirty. the whole
+//frame when IddCx reports neither, or more than DIRTY_QUERY_MAX
+void SwapChainProcessor::collect_dirty_rects(const IDDCX_METADATA * meta, int width, int height)
+{
+    UINT i;
+
+    dirty_clear(&frame_dirty);
+    if((0 == meta->DirtyRectCount && 0 == meta->MoveRegionCount) ||
+       meta->DirtyRectCount > DIRTY_QUERY_MAX || meta->MoveRegionCount > DIRTY_QUERY_MAX)
+        goto full;
+
+    if(meta->DirtyRectCount) {
+        IDARG_IN_GETDIRTYRECTS in = {};
+        IDARG_OUT_GETDIRTYRECTS out = {};
+        in.DirtyRectInCount = meta->DirtyRectCount;
+        in.pDirtyRects = dirty_query;
+        if(FAILED(IddCxSwapChainGetDirtyRects(m_hSwapChain, &in, &out)))
+            goto full;
+        for(i = 0; i < out.DirtyRectOutCount; i++)
+            dirty_add(&frame_dirty, dirty_query[i].left, dirty_query[i].top, dirty_query[i].right, dirty_query[i].bottom, width, height);
+    }
+    //moved content is not in the dirty rects, its destination has to be sent as well
+    if(meta->MoveRegionCount) {
+        IDARG_IN_GETMOVEREGIONS in = {};
+        IDARG_OUT_GETMOVEREGIONS out = {};
+        in.MoveRegionInCount = meta->MoveRegionCount;
+        in.pMoveRegions = move_query;
+        if(FAILED(IddCxSwapChainGetMoveRegions(m_hSwapChain, &in, &out)))
+            goto full;
+        for(i = 0; i < out.MoveRegionOutCount; i++) {
+            const RECT * r = &move_query[i].DestRect;
+            dirty_add(&frame_dirty, r->left, r->top, r->right, r->bottom, width, height);
+        }
+    }
+    //LOG("-dirty %d rects %d moves -> %d\n", meta->DirtyRectCount, meta->MoveRegionCount, frame_dirty.count);
+    return;
+
+full:
+    dirty_clear(&frame_dirty);
+    dirty_add(&frame_dirty, 0, 0, width, height, width, height);
+}
+
+//hand the pending dirty rectangles to the encode thread, one bitblt per frame, copied from src:
+//the mapped frame or fb_buf. the ones that find no free frame stay pending and are merged with
+//those of the next frame. returns the number of bitblts queued
+int SwapChainProcessor::send_dirty_rects(const uint8_t * src, int line_width)
+{
+    int sent = 0;
+
+    if(dirty_pending.count > 1 && dirty_area(&dirty_pending) * 100 >= (long)fb_width * fb_height * DIRTY_FULL_PERCENT) {
+        dirty_clear(&dirty_pending);
+        dirty_add(&dirty_pending, 0, 0, fb_width, fb_height, fb_width, fb_height);
+    }
+    if(0 == keepalive_wait_ms() && dirty_area(&dirty_pending) < (long)fb_width * fb_height) {
+        dirty_clear(&dirty_pending);
+        dirty_add(&dirty_pending, 0, 0, fb_width, fb_height, fb_width, fb_height);
+        frame_stat.keepalive++;
+    }
+    while(dirty_pending.count) {
+        const dirty_rect_t * r = &dirty_pending.r[0];
+        pipe_frame_t * f = (pipe_frame_t *)pipe_ring_pop(&frame_free_ring);
+        int bytes = (r->right - r->left) * 4;
+        int y;
+
+        if(NULL == f)
+            break;
+        //the encoder works on a copy: src is unmapped, or fb_buf overwritten, by the next frame
+        for(y = r->top; y < r->bottom; y++)
+            memcpy(f->pixels + (y - r->top) * bytes, src + (y * line_width + r->left) * 4, bytes);
+        f->x = r->left;
+        f->y = r->top;
+        f->right = r->right - 1;
+        f->bottom = r->bottom - 1;
+        f->t_queued = get_perf_us();
+        if(0 == r->left && 0 == r->top && fb_width == r->right && fb_height == r->bottom)
+            last_full_us = f->t_queued;
+        f->trace = sent_trace;
+        f->trace.report = 0;
+        dirty_remove(&dirty_pending, 0);
+        if(0 == dirty_pending.count && sent_trace_open) {
+            f->trace.report = 1;
+            sent_trace_open = 0;
+        }
+        pipe_ring_push(&encode_ring, f);
+        SetEvent(m_hEncodeEvent.Get());
+        sent++;
+    }
+    return sent;
+}
+
+//ms until the keep-alive frame is due, 0 when it is. a frame must be saved in fb_buf to send one
+long SwapChainProcessor::keepalive_wait_ms(void)
+{
+    long long left;
+
+    if(0 == KEEPALIVE_MS || 0 == tile_diff.width)
+        return IDLE_WAIT_MS;
+    left = KEEPALIVE_MS - (get_perf_us() - last_full_us) / 1000;
+    if(left <= 0)
+        return 0;
+    return left < IDLE_WAIT_MS ? (long)left : IDLE_WAIT_MS;
+}
+
+int SwapChainProcessor::ReadbackCopy(void * ctx, int slot, void * src, int replace)
+{
+    SwapChainProcessor * p = (SwapChainProcessor *)ctx;
+
+    p->m_Device->DeviceContext->CopyResource(p->staging_ring[slot].Get(), (ID3D11Texture2D *)src);
+    // a replaced frame is never read back, what changed in it goes out with this one
+    if(replace) {
+        p->report_frame_stat(&p->slot_trace[slot], IDDCX_FRAME_STATUS_DROPPED);
+        dirty_merge(&p->slot_dirty[slot], &p->frame_dirty, p->staging_desc.Width, p->staging_desc.Height);
+    } else {
+        p->slot_dirty[slot] = p->frame_dirty;
+    }
+    dirty_merge(&p->slot_dirty[slot], &p->dirty_lost, p->staging_desc.Width, p->staging_desc.Height);
+    dirty_clear(&p->dirty_lost);
+    // start it on the GPU now, not when the slot is mapped
+    p->m_Device->DeviceContext->Flush();
+    p->slot_trace[slot] = p->frame_trace;
+    p->slot_trace[slot].ts[FRAME_TS_COPY] = get_perf_us();
+    return 1;
+}
+
+int SwapChainProcessor::ReadbackMap(void * ctx, int slot, int wait)
+{
+    SwapChainProcessor * p = (SwapChainProcessor *)ctx;
+    long long t = get_perf_us();
+    HRESULT hr = p->m_Device->DeviceContext->Map(p->staging_ring[slot].Get(), 0, D3D11_MAP_READ,
+                                                 wait ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT, &p->staging_mapped);
+
+    if(DXGI_ERROR_WAS_STILL_DRAWING == hr)
+        return READBACK_MAP_BUSY;
+    p->slot_trace[slot].ts[FRAME_TS_MAP] = p->put_stage_time(FRAME_STAGE_MAP, t);
+    if(FAILED(hr)) {
+        LOG("dxgi map NG %x\n", hr);
+        dirty_merge(&p->dirty_lost, &p->slot_dirty[slot], p->staging_desc.Width, p->staging_desc.Height);
+        p->report_frame_stat(&p->slot_trace[slot], IDDCX_FRAME_STATUS_DROPPED);
+        return READBACK_MAP_FAIL;
+    }
+    return READBACK_MAP_OK;
+}
+
+//one frame is back in CPU memory: bring fb_buf up to date and hand what changed to the encode
+//thread, copied out of the mapped staging texture with its own pitch
+void SwapChainProcessor::ReadbackFrame(void * ctx, int slot, unsigned int seq)
+{
+    SwapChainProcessor * p = (SwapChainProcessor *)ctx;
+    const uint8_t * src = (const uint8_t *)p->staging_mapped.pData;
+    int pitch = p->staging_mapped.RowPitch;
+    int width = p->staging_desc.Width;
+    int height = p->staging_desc.Height;
+    long long t = get_perf_us();
+
+    //LOG("-readback slot:%d fid:%d\n", slot, seq);
+    p->fb_width = width;
+    p->fb_height = height;
+#if TILE_DIFF
+    //an identical frame ends here: no tile changed, nothing to encode or send
+    if(0 == tile_diff_frame(&p->tile_diff, src, pitch, width, height, &p->slot_dirty[slot], &p->frame_changed))
+        p->frame_stat.unchanged++;
+    t = p->put_stage_time(FRAME_STAGE_DIFF, t);
+    dirty_merge(&p->dirty_pending, &p->frame_changed, width, height);
+#else
+    tile_diff_copy(&p->tile_diff, src, pitch, width, height, &p->slot_dirty[slot]);
+    t = p->put_stage_time(FRAME_STAGE_READ, t);
+    dirty_merge(&p->dirty_pending, &p->slot_dirty[slot], width, height);
+#endif
+    p->slot_trace[slot].ts[FRAME_TS_DIFF] = t;
+    //a frame whose rectangles all wait behind this one's is never sent on its own
+    if(p->sent_trace_open)
+        p->report_frame_stat(&p->sent_trace, IDDCX_FRAME_STATUS_DROPPED);
+    p->sent_trace = p->slot_trace[slot];
+    p->sent_trace_open = 1;
+    //nothing sent while something changed: the map and diff were done for a busy link
+    if(!p->send_dirty_rects(src, pitch / 4) && p->dirty_pending.count)
+        p->frame_stat.wasted++;
+    //nothing changed: the device shows this frame already
+    if(p->sent_trace_open && 0 == p->dirty_pending.count) {
+        p->report_frame_stat(&p->sent_trace, IDDCX_FRAME_STATUS_COMPLETED);
+        p->sent_trace_open = 0;
+    }
+    p->put_stage_time(FRAME_STAGE_SEND, t);
+}
+
+void SwapChainProcessor::ReadbackUnmap(void * ctx, int slot)
+{
+    SwapChainProcessor * p = (SwapChainProcessor *)ctx;
+
+    p->m_Device->DeviceContext->Unmap(p->staging_ring[slot].Get(), 0);
+}
+
+void SwapChainProcessor::release_staging_ring(void)
+{
+    int i;
+
+    for(i = 0; i < STAGING_RING_SIZE; i++)
+        staging_ring[i].Reset();
+    memset(&staging_desc, 0, sizeof(staging_desc));
+}
+
+//the encoder and the transmitter get threads of their own. frames go round between the swap-chain
+//and the encode thread, URBs from the encode to the transmit thread and back through urb_list
+int SwapChainProcessor::start_pipe(void)
+{
+    int i;
+
+    memset(pipe_frames, 0, sizeof(pipe_frames));
+    InitializeSListHead(&cursor_urb_list);
+    cursor_urb = NULL;
+    cursor_pending = 0;
+    cursor_shape_id = (UINT)-1;
+    memset(&cursor_stat, 0, sizeof(cursor_stat));
+    pipe_ring_init(&encode_ring, encode_slots, PIPE_RING_SIZE);
+    pipe_ring_init(&frame_free_ring, frame_free_slots, PIPE_RING_SIZE);
+    pipe_ring_init(&send_ring, send_slots, PIPE_RING_SIZE);
+    ResetEvent(m_hPipeStopEvent.Get());
+    for(i = 0; i < PIPE_FRAMES; i++) {
+        pipe_frames[i].pixels = (uint8_t *)_aligned_malloc(DISP_MAX_HEIGHT * DISP_MAX_WIDTH * 4, 16);
+        if(NULL == pipe_frames[i].pixels) {
+            LOG("pipe frame alloc NG\n");
+            return 0;
+        }
+        pipe_ring_push(&frame_free_ring, &pipe_frames[i]);
+    }
+    //the pointer gets a URB of its own, so it never waits for one behind the frames. it is sized
+    //for the largest sprite and the packet header bytes inserted into it
+    if(HW_CURSOR) {
+        auto* pDeviceContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+        int ep_size = pDeviceContext->max_out_pkg_size > 1 ? pDeviceContext->max_out_pkg_size : 2;
+        cursor_urb = urb_alloc(CURSOR_MSG_BYTES + CURSOR_MSG_BYTES / (ep_size - 1) + 2);
+        if(cursor_urb && !NT_SUCCESS(WdfRequestCreate(WDF_NO_OBJECT_ATTRIBUTES, NULL, &cursor_urb->Request))) {
+            _aligned_free(cursor_urb);
+            cursor_urb = NULL;
+        }
+        if(NULL == cursor_urb) {
+            //the OS keeps drawing the pointer into the desktop image
+            LOG("cursor urb NG\n");
+        } else {
+            cursor_urb->id = 0;
+            cursor_urb->max_ep_out_size = pDeviceContext->max_out_pkg_size;
+            cursor_urb->urb_list = &cursor_urb_list;
+            cursor_urb->free_event = m_hCursorFreeEvent.Get();
+            cursor_urb->wdfMemory = NULL;
+            cursor_urb->t_queued = 0;
+            memset(&cursor_urb->trace, 0, sizeof(cursor_urb->trace));
+            InterlockedPushEntrySList(&cursor_urb_list, &(cursor_urb->node));
+        }
+    }
+    m_hEncodeThread.Attach(CreateThread(nullptr, 0, EncodeThread, this, 0, nullptr));
+    m_hSendThread.Attach(CreateThread(nullptr, 0, SendThread, this, 0, nullptr));
+    if(!m_hEncodeThread.IsValid() || !m_hSendThread.IsValid()) {
+        LOG("pipe thread create NG\n");
+        return 0;
+    }
+    return 1;
+}
+
+//ends the encode and transmit threads; what they had queued is dropped and its URBs go back to urb_list
+void SwapChainProcessor::stop_pipe(void)
+{
+    urb_itm_t * purb;
+    int i;
+
+    SetEvent(m_hPipeStopEvent.Get());
+    if(m_hEncodeThread.IsValid())
+        WaitForSingleObject(m_hEncodeThread.Get(), INFINITE);
+    if(m_hSendThread.IsValid())
+        WaitForSingleObject(m_hSendThread.Get(), INFINITE);
+    m_hEncodeThread.Close();
+    m_hSendThread.Close();
+    //both threads are gone, this one may take their side of the rings
+    while(NULL != (purb = (urb_itm_t *)pipe_ring_pop(&send_ring)))
+        InterlockedPushEntrySList(&urb_list, &(purb->node));
+    //URBs still on the bus come back through the completion routine before they may be freed;
+    //those the device has not taken within a second are cancelled
+    urb_itm_t * back[MAX_URB_SIZE];
+    int n = 0;
+    while(n < urb_count) {
+        purb = (urb_itm_t *)InterlockedPopEntrySList(&urb_list);
+        if(purb) {
+            back[n++] = purb;
+            continue;
+        }
+        if(WAIT_TIMEOUT != WaitForSingleObject(m_hUrbFreeEvent.Get(), 1000))
+            continue;
+        for(i = 0; i < urb_count; i++) {
+            int j = 0;
+            while(j < n && back[j] != urbs[i])
+                j++;
+            if(j == n)
+                WdfRequestCancelSentRequest(urbs[i]->Request);
+        }
+    }
+    for(i = 0; i < n; i++)
+        InterlockedPushEntrySList(&urb_list, &(back[i]->node));
+    for(i = 0; i < PIPE_FRAMES; i++) {
+        _aligned_free(pipe_frames[i].pixels);
+        pipe_frames[i].pixels = NULL;
+    }
+    //the cursor URB may still be on the bus, the completion routine has to give it back first
+    if(cursor_urb) {
+        while(NULL == InterlockedPopEntrySList(&cursor_urb_list)) {
+            if(WAIT_TIMEOUT == WaitForSingleObject(m_hCursorFreeEvent.Get(), 1000))
+                WdfRequestCancelSentRequest(cursor_urb->Request);
+        }
+        WdfObjectDelete(cursor_urb->Request);
+        _aligned_free(cursor_urb);
+        cursor_urb = NULL;
+    }
+}
+
+DWORD CALLBACK SwapChainProcessor::EncodeThread(LPVOID Argument)
+{
+    reinterpret_cast<SwapChainProcessor*>(Argument)->RunEncode();
+    return 0;
+}
+
+DWORD CALLBACK SwapChainProcessor::SendThread(LPVOID Argument)
+{
+    reinterpret_cast<SwapChainProcessor*>(Argument)->RunSend();
+    return 0;
+}
+
+//NULL once the pipe is stopping
+urb_itm_t * SwapChainProcessor::pop_free_urb(void)
+{
+    HANDLE WaitHandles [] = {
+        m_hUrbFreeEvent.Get(),
+        m_hPipeStopEvent.Get()
+    };
+
+    for(;;) {
+        report_done_urbs();
+        urb_itm_t * purb = (urb_itm_t *)InterlockedPopEntrySList(&urb_list);
+        if(purb)
+            return purb;
+        if(WAIT_OBJECT_0 != WaitForMultipleObjects(ARRAYSIZE(WaitHandles), WaitHandles, FALSE, INFINITE))
+            return NULL;
+    }
+}
+
+void SwapChainProcessor::queue_send_urb(urb_itm_t * urb)
+{
+    urb->t_queued = get_perf_us();
+    pipe_ring_push(&send_ring, urb);
+    SetEvent(m_hSendEvent.Get());
+}
+
+//encode stage: each frame from the swap-chain thread becomes a JPEG bitblt in a free URB, handed on
+//to the transmit thread. quality, tables and encoder statistics are only touched here
+void SwapChainProcessor::RunEncode()
+{
+    DWORD AvTask = 0;
+    HANDLE AvTaskHandle = AvSetMmThreadCharacteristicsW(L"Distribution", &AvTask);
+    HANDLE WaitHandles [] = {
+        m_hEncodeEvent.Get(),
+        m_hPipeStopEvent.Get(),
+        m_hUrbFreeEvent.Get()
+    };
+
+    for(;;) {
+        pipe_frame_t * f = (pipe_frame_t *)pipe_ring_pop(&encode_ring);
+        if(NULL == f) {
+            //while idle a completed URB wakes the thread to report its frame
+            report_done_urbs();
+            DWORD WaitResult = WaitForMultipleObjects(ARRAYSIZE(WaitHandles), WaitHandles, FALSE, INFINITE);
+            if(WaitResult != WAIT_OBJECT_0 && WaitResult != WAIT_OBJECT_0 + 2)
+                break;
+            continue;
+        }
+        int width = f->right - f->x + 1;
+        int height = f->bottom - f->y + 1;
+        //the wait for a URB is the link holding the encoder back, it counts as time in the ring
+        urb_itm_t * purb = pop_free_urb();
+        if(NULL == purb)
+            break;
+        long long t = get_perf_us();
+        f->trace.ts[FRAME_TS_ENCODE] = t;
+        choose_jpeg_quality(f->pixels, width, height, width * 4);
+        //abbreviated streams: the device must hold the tables for this quality before the frame goes out
+        if(JPG_ABBREVIATED_STREAMS &&
+           (jpg_tables_quality != jpg_quality || (JPG_OPTIMIZE_HUFFMAN && jpg_tables_age >= JPG_TABLES_REFRESH_FRAMES))) {
+            if(usb_encode_jpeg_tables(purb) > 0) {
+                purb->trace.report = 0;
+                queue_send_urb(purb);
+                purb = pop_free_urb();
+                if(NULL == purb)
+                    break;
+            }
+        }
+        if(usb_encode_jpeg_image(purb, f->pixels, width * 4, f->x, f->y, f->right, f->bottom) > 0) {
+            f->trace.ts[FRAME_TS_ENCODED] = get_perf_us();
+            purb->trace = f->trace;
+            queue_send_urb(purb);
+        } else {
+            if(f->trace.report)
+                report_frame_stat(&f->trace, IDDCX_FRAME_STATUS_DROPPED);
+            purb->trace.report = 0;
+            InterlockedPushEntrySList(&urb_list, &(purb->node));
+        }
+        pipe_ring_done(&encode_ring, (long)(t - f->t_queued), (long)(get_perf_us() - t));
+        //the pixels are encoded, the swap-chain thread may fill the frame again
+        pipe_ring_push(&frame_free_ring, f);
+        SetEvent(m_hFrameFreeEvent.Get());
+        if(PIPE_STAT_ITEMS && encode_ring.items >= PIPE_STAT_ITEMS)
+            log_pipe_stat("encode", &encode_ring);
+    }
+    AvRevertMmThreadCharacteristics(AvTaskHandle);
+}
+
+//transmit stage: submits the encoded URBs in order. the completion routine hands them back to urb_list.
+//the hardware cursor is sent from here too, ahead of the URBs queued
+void SwapChainProcessor::RunSend()
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    DWORD AvTask = 0;
+    HANDLE AvTaskHandle = AvSetMmThreadCharacteristicsW(L"Distribution", &AvTask);
+    HANDLE WaitHandles [] = {
+        m_hSendEvent.Get(),
+        m_hPipeStopEvent.Get(),
+        m_hCursorEvent.Get(),
+        m_hCursorFreeEvent.Get()
+    };
+
+    for(;;) {
+        if(WAIT_OBJECT_0 == WaitForSingleObject(m_hCursorEvent.Get(), 0)) {
+            cursor_stat.coalesced += cursor_pending;
+            cursor_pending = 1;
+        }
+        if(cursor_pending)
+            send_cursor();
+        urb_itm_t * purb = (urb_itm_t *)pipe_ring_pop(&send_ring);
+        if(NULL == purb) {
+            DWORD WaitResult = WaitForMultipleObjects(ARRAYSIZE(WaitHandles), WaitHandles, FALSE, INFINITE);
+            if(WaitResult == WAIT_OBJECT_0 + 2) {
+                cursor_stat.coalesced += cursor_pending;
+                cursor_pending = 1;
+            } else if(WaitResult != WAIT_OBJECT_0 && WaitResult != WAIT_OBJECT_0 + 3) {
+                break;
+            }
+            continue;
+        }
+        long long t = get_perf_us();
+        purb->trace.ts[FRAME_TS_SUBMIT] = t;
+        if(!NT_SUCCESS(usb_send_msg_async(purb, pContext->BulkWritePipe, purb->Request, purb->urb_msg, purb->len))) {
+            //never completes, so the completion routine does not hand it back
+            if(purb->trace.report)
+                report_frame_stat(&purb->trace, IDDCX_FRAME_STATUS_DROPPED);
+            purb->trace.report = 0;
+            InterlockedPushEntrySList(&urb_list, &(purb->node));
+            SetEvent(m_hUrbFreeEvent.Get());
+        }
+        pipe_ring_done(&send_ring, (long)(t - purb->t_queued), (long)(get_perf_us() - t));
+        if(PIPE_STAT_ITEMS && send_ring.items >= PIPE_STAT_ITEMS)
+            log_pipe_stat("send", &send_ring);
+    }
+    AvRevertMmThreadCharacteristics(AvTaskHandle);
+}
+
+//IddCx leaves the pointer out of the desktop image from now on and signals m_hCursorEvent instead
+void SwapChainProcessor::setup_hw_cursor(void)
+{
+    IDARG_IN_SETUP_HWCURSOR in = {};
+
+    in.CursorInfo.Size = sizeof(in.CursorInfo);
+    in.CursorInfo.ColorXorCursorSupport = IDDCX_XOR_CURSOR_SUPPORT_NONE;
+    in.CursorInfo.AlphaCursorSupport = TRUE;
+    in.CursorInfo.MaxX = CURSOR_MAX_SIZE;
+    in.CursorInfo.MaxY = CURSOR_MAX_SIZE;
+    in.hNewCursorDataAvailable = m_hCursorEvent.Get();
+    NTSTATUS status = IddCxMonitorSetupHardwareCursor(m_hMonitor, &in);
+    if(!NT_SUCCESS(status))
+        LOG("hw cursor setup NG %x\n", status);
+}
+
+//transmit thread: the latest pointer state from IddCx goes out in cursor_urb. while the URB is on the
+//bus the update stays pending, later ones fold into it. a new sprite is sent on its own and leaves
+//the move pending, so the position is queried again once the device has the sprite
+void SwapChainProcessor::send_cursor(void)
+{
+    auto* pContext = WdfObjectGet_IndirectDeviceContextWrapper(mp_WdfDevice);
+    IDARG_IN_QUERY_HWCURSOR in = {};
+    IDARG_OUT_QUERY_HWCURSOR out = {};
+    int shape = 0;
+    int len = -1;
+
+    urb_itm_t * purb = (urb_itm_t *)InterlockedPopEntrySList(&cursor_urb_list);
+    if(NULL == purb)
+        return;
+    if(purb->t_queued)
+        lat_stat_add(&cursor_stat.usb, (long)(purb->trace.ts[FRAME_TS_COMPLETE] - purb->t_queued));
+    purb->t_queued = get_perf_us();
+    in.LastShapeId = cursor_shape_id;
+    in.ShapeBufferSizeInBytes = sizeof(cursor_shape);
+    in.pShapeBuffer = cursor_shape;
+    if(FAILED(IddCxMonitorQueryHardwareCursor(m_hMonitor, &in, &out))) {
+        LOG("hw cursor query NG\n");
+        purb->t_queued = 0;
+        InterlockedPushEntrySList(&cursor_urb_list, &(purb->node));
+        cursor_pending = 0;
+        return;
+    }
+    //a sprite that cannot be sent leaves cursor_shape_id as it is, so IddCx offers it again
+    if(out.IsCursorShapeUpdated) {
+        len = usb_encode_cursor_shape(purb, &out.CursorShapeInfo);
+        shape = len > 0;
+    }
+    if(!shape)
+        len = usb_encode_cursor_move(purb, out.X, out.Y, out.IsCursorVisible);
+    if(len <= 0 || !NT_SUCCESS(usb_send_msg_async(purb, pContext->BulkWritePipe, purb->Request, purb->urb_msg, purb->len))) {
+        //the update stays pending, it is queried again on the next pass of the transmit thread
+        purb->t_queued = 0;
+        InterlockedPushEntrySList(&cursor_urb_list, &(purb->node));
+        return;
+    }
+    if(shape) {
+        cursor_shape_id = out.CursorShapeInfo.CursorShapeId;
+        cursor_stat.shapes++;
+    } else {
+        cursor_stat.moves++;
+        cursor_pending = 0;
+    }
+    if(PIPE_STAT_ITEMS && cursor_stat.shapes + cursor_stat.moves >= PIPE_STAT_ITEMS)
+        log_cursor_stat();
 }
 
 #pragma endregion
@@ -759,7 +1417,7 @@ void IndirectDeviceContext::AssignSwapChain(IDDCX_SWAPCHAIN SwapChain, LUID Rend
         WdfObjectDelete(SwapChain);
     } else {
         // Create a new swap-chain processing thread
-        m_ProcessingThread.reset(new SwapChainProcessor(SwapChain, Device, this->m_WdfDevice, NewFrameEvent));
+        m_ProcessingThread.reset(new SwapChainProcessor(SwapChain, Device, this->m_WdfDevice, NewFrameEvent, m_Monitor));
     }
 }
 
@@ -1267,6 +1925,60 @@ long get_system_us(void)
 	return get_os_us();
 }
 
+//monotonic, for measuring durations; get_os_us() wraps every minute
+long long get_perf_us(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (0 == freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (now.QuadPart / freq.QuadPart) * 1000000 + (now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+//a get_perf_us() time in QPC ticks, the unit of the IddCx frame statistics
+UINT64 perf_us_to_qpc(long long us)
+{
+	static LARGE_INTEGER freq;
+
+	if (0 == freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	return (UINT64)((us / 1000000) * freq.QuadPart + (us % 1000000) * freq.QuadPart / 1000000);
+}
+
+void lat_stat_add(lat_stat_t * st, long us)
+{
+	long bin = us / 100;
+
+	if (bin < 0)
+		bin = 0;
+	if (bin >= LAT_HIST_BINS)
+		bin = LAT_HIST_BINS - 1;
+	st->hist[bin]++;
+	st->count++;
+	st->total_us += us;
+	if (us > st->max_us)
+		st->max_us = us;
+}
+
+//upper edge of the bin holding the pct percentile, in us
+long lat_stat_percentile(const lat_stat_t * st, int pct)
+{
+	uint32_t want = (uint32_t)(((uint64_t)st->count * pct + 99) / 100);
+	uint32_t seen = 0;
+	int i;
+
+	for (i = 0; i < LAT_HIST_BINS; i++) {
+		seen += st->hist[i];
+		if (seen >= want && seen > 0) {
+			long us = (i < LAT_HIST_BINS - 1) ? (i + 1) * 100 : st->max_us;
+			return us < st->max_us ? us : st->max_us;
+		}
+	}
+	return st->max_us;
+}
+
 
 
 long SwapChainProcessor::get_fps(void)
@@ -1300,6 +2012,195 @@ void SwapChainProcessor::put_fps_data(long t)
 
 }
 
+//count one encoded bitblt; a full window logs it and starts a new one
+void SwapChainProcessor::put_jpg_stat(int width, int height, long encode_us, int jpg_bytes)
+{
+#if JPG_STAT_FRAMES
+	jpg_stat_t * st = &jpg_stat;
+
+	if (0 == st->encode.count) {
+		st->quality_min = jpg_quality;
+		st->quality_max = jpg_quality;
+	}
+	lat_stat_add(&st->encode, encode_us);
+	st->in_bytes += (long long)width * height * 4;
+	st->out_bytes += jpg_bytes;
+	st->quality_sum += jpg_quality;
+	if (jpg_quality < st->quality_min)
+		st->quality_min = jpg_quality;
+	if (jpg_quality > st->quality_max)
+		st->quality_max = jpg_quality;
+	if (st->encode.count >= JPG_STAT_FRAMES)
+		log_jpg_stat();
+#endif
+}
+
+//adds the time since t to a stage and returns the current time, the start of the next stage
+long long SwapChainProcessor::put_stage_time(int stage, long long t)
+{
+	long long now = get_perf_us();
+
+#if FRAME_STAT_FRAMES
+	lat_stat_add(&frame_stat.stage[stage], (long)(now - t));
+	if (FRAME_STAGE_TOTAL == stage && frame_stat.stage[stage].count >= FRAME_STAT_FRAMES)
+		log_frame_stat();
+#endif
+	return now;
+}
+
+void SwapChainProcessor::log_frame_stat(void)
+{
+	static const char * names[FRAME_STAGE_MAX] = { "staging", "copy", "map", "read", "diff", "send", "total" };
+	char buf[512];
+	int pos;
+	int i;
+
+	pos = snprintf(buf, sizeof(buf), "framestat frames=%u created=%u waits=%u dropped=%u coalesced=%u wasted=%u held=%u "
+				   "repeated=%u unchanged=%u keepalive=%u",
+				   frame_stat.stage[FRAME_STAGE_TOTAL].count, frame_stat.staging_created, readback.waits, readback.dropped,
+				   readback.replaced, frame_stat.wasted, frame_free_ring.empty, frame_stat.repeated, frame_stat.unchanged,
+				   frame_stat.keepalive);
+	for (i = 0; i < FRAME_STAGE_MAX && pos > 0 && pos < (int)sizeof(buf); i++) {
+		lat_stat_t * st = &frame_stat.stage[i];
+		pos += snprintf(buf + pos, sizeof(buf) - pos, " %s_avg=%.3f %s_p50=%.1f %s_p99=%.1f", names[i],
+						st->count ? st->total_us / 1000.0 / st->count : 0.0, names[i], lat_stat_percentile(st, 50) / 1000.0,
+						names[i], lat_stat_percentile(st, 99) / 1000.0);
+	}
+	LOG("%s\n", buf);
+	memset(&frame_stat, 0, sizeof(frame_stat));
+	readback.waits = 0;
+	readback.dropped = 0;
+	readback.replaced = 0;
+	pipe_ring_reset_stat(&frame_free_ring);
+}
+
+//hand the stamps of one frame to IddCx, so OS-side tools see the latency of the pipe. colour
+//conversion and packetizing run inside the encoder MCU by MCU, they are reported as the encode step.
+//called from the swap-chain thread (frames dropped or unchanged at readback), the encode thread
+//(completed frames, failed encodes) and the send thread (failed submits). IddCx does not document
+//the call as safe from several threads at once, so the calls are serialized by report_lock
+void SwapChainProcessor::report_frame_stat(const frame_trace_t * trace, IDDCX_FRAME_STATUS status)
+{
+	IDDCX_FRAME_STATISTICS_STEP steps[2] = {};
+	IDARG_IN_REPORTFRAMESTATISTICS in = {};
+	IDDCX_FRAME_STATISTICS * st = &in.FrameStatistics;
+	UINT n = 0;
+
+	st->Size = sizeof(*st);
+	st->PresentationFrameNumber = trace->present;
+	st->FrameStatus = status;
+	st->FrameAcquireTime = perf_us_to_qpc(trace->ts[FRAME_TS_ACQUIRE]);
+	if (trace->ts[FRAME_TS_ENCODED]) {
+		steps[0].Size = sizeof(steps[0]);
+		steps[0].Type = IDDCX_FRAME_STATISTICS_STEP_TYPE_ENCODE_START;
+		steps[0].QpcTime = perf_us_to_qpc(trace->ts[FRAME_TS_ENCODE]);
+		steps[1].Size = sizeof(steps[1]);
+		steps[1].Type = IDDCX_FRAME_STATISTICS_STEP_TYPE_ENCODE_END;
+		steps[1].QpcTime = perf_us_to_qpc(trace->ts[FRAME_TS_ENCODED]);
+		n = 2;
+	}
+	//the send runs from the URB submit to its completion, the device has the frame then
+	if (trace->ts[FRAME_TS_COMPLETE]) {
+		st->SendStartTime = perf_us_to_qpc(trace->ts[FRAME_TS_SUBMIT]);
+		st->SendStopTime = perf_us_to_qpc(trace->ts[FRAME_TS_COMPLETE]);
+		st->SendCompleteTime = st->SendStopTime;
+	}
+	st->FrameProcessingStepsCount = n;
+	st->pFrameProcessingStep = n ? steps : NULL;
+	AcquireSRWLockExclusive(&report_lock);
+	IddCxSwapChainReportFrameStatistics(m_hSwapChain, &in);
+	ReleaseSRWLockExclusive(&report_lock);
+}
+
+//frames whose last URB completed are reported here, on the encode thread; the completion routine
+//only stamps them. the list is taken whole and given back, only this thread pops it
+void SwapChainProcessor::report_done_urbs(void)
+{
+	PSLIST_ENTRY entry = InterlockedFlushSList(&urb_list);
+
+	while (entry) {
+		PSLIST_ENTRY next = entry->Next;
+		urb_itm_t * urb = (urb_itm_t *)entry;
+
+		if (urb->trace.report) {
+			urb->trace.report = 0;
+			report_frame_stat(&urb->trace, IDDCX_FRAME_STATUS_COMPLETED);
+			put_frame_lat(&urb->trace);
+		}
+		InterlockedPushEntrySList(&urb_list, entry);
+		entry = next;
+	}
+}
+
+void SwapChainProcessor::put_frame_lat(const frame_trace_t * trace)
+{
+	int i;
+
+	lat_stat_add(&frame_lat.span[0], (long)(trace->ts[FRAME_TS_COMPLETE] - trace->ts[FRAME_TS_ACQUIRE]));
+	for (i = 1; i < FRAME_TS_MAX; i++)
+		lat_stat_add(&frame_lat.span[i], (long)(trace->ts[i] - trace->ts[i - 1]));
+	if (FRAME_STAT_FRAMES && 0 == frame_lat.span[0].count % FRAME_STAT_FRAMES)
+		log_frame_lat();
+}
+
+void SwapChainProcessor::log_frame_lat(void)
+{
+	static const char * names[FRAME_TS_MAX] = { "total", "copy", "map", "diff", "queue", "encode", "submit", "usb" };
+	char buf[512];
+	int pos;
+	int i;
+
+	pos = snprintf(buf, sizeof(buf), "latstat frames=%u", frame_lat.span[0].count);
+	for (i = 0; i < FRAME_TS_MAX && pos > 0 && pos < (int)sizeof(buf); i++) {
+		lat_stat_t * st = &frame_lat.span[i];
+		pos += snprintf(buf + pos, sizeof(buf) - pos, " %s_avg=%.3f %s_p50=%.1f %s_p99=%.1f", names[i],
+						st->total_us / 1000.0 / st->count, names[i], lat_stat_percentile(st, 50) / 1000.0,
+						names[i], lat_stat_percentile(st, 99) / 1000.0);
+	}
+	LOG("%s\n", buf);
+}
+
+//one line per stage thread, logged by the stage itself: how full its input ring ran, how long an
+//item waited there and how long the stage took for it
+void SwapChainProcessor::log_pipe_stat(const char * name, pipe_ring_t * q)
+{
+	unsigned int n = q->items ? q->items : 1;
+
+	LOG("pipestat stage=%s items=%u occ_avg=%.2f occ_max=%u idle=%u full=%u wait_avg=%.3f wait_max=%.3f "
+		"work_avg=%.3f work_max=%.3f\n",
+		name, q->items, (double)q->occupancy_sum / n, q->occupancy_max, q->empty, q->full, q->wait_us / 1000.0 / n,
+		q->wait_max_us / 1000.0, q->work_us / 1000.0 / n, q->work_max_us / 1000.0);
+	pipe_ring_reset_stat(q);
+}
+
+void SwapChainProcessor::log_cursor_stat(void)
+{
+	cursor_stat_t * st = &cursor_stat;
+
+	LOG("cursorstat shapes=%u moves=%u coalesced=%u usb_avg=%.3f usb_p50=%.1f usb_p99=%.1f usb_max=%.3f\n",
+		st->shapes, st->moves, st->coalesced, st->usb.count ? st->usb.total_us / 1000.0 / st->usb.count : 0.0,
+		lat_stat_percentile(&st->usb, 50) / 1000.0, lat_stat_percentile(&st->usb, 99) / 1000.0, st->usb.max_us / 1000.0);
+	memset(st, 0, sizeof(*st));
+}
+
+void SwapChainProcessor::log_jpg_stat(void)
+{
+	jpg_stat_t * st = &jpg_stat;
+	long long n = st->encode.count;
+	long long us = st->encode.total_us > 0 ? st->encode.total_us : 1;
+
+	if (0 == n)
+		return;
+	LOG("jpgstat px=%lld frames=%lld dct=%s sub=%d slices=%d opt=%d abbr=%d q_min=%d q_avg=%lld q_max=%d "
+		"ms_avg=%.3f ms_p50=%.1f ms_p99=%.1f ms_max=%.3f mbps=%.1f bytes=%lld ratio=%.1f\n",
+		st->in_bytes / 4 / n, n, JPG_ACCURATE_DCT ? "islow" : "fast", jpg_subsampling, jpg_slices,
+		JPG_OPTIMIZE_HUFFMAN, JPG_ABBREVIATED_STREAMS, st->quality_min, st->quality_sum / n, st->quality_max,
+		us / 1000.0 / n, lat_stat_percentile(&st->encode, 50) / 1000.0, lat_stat_percentile(&st->encode, 99) / 1000.0,
+		st->encode.max_us / 1000.0, (double)st->in_bytes / us, st->out_bytes / n,
+		st->out_bytes ? (double)st->in_bytes / st->out_bytes : 0.0);
+	memset(st, 0, sizeof(*st));
+}
+
 
 NTSTATUS usb_send_msg(WDFUSBPIPE pipeHandle, WDFREQUEST Request, PUCHAR msg, int tsize)
 {
@@ -1424,8 +2325,13 @@ VOID EvtRequestWriteCompletionRoutine(
 
 
 	LOG("pipe:%p cpl urb id:%d\n", urb->pipe, urb->id);
+	//the frame is reported by the encode thread, once the URB is back in the list
+	urb->trace.ts[FRAME_TS_COMPLETE] = get_perf_us();
 	InterlockedPushEntrySList(urb->urb_list,
 		&(urb->node));
+	//wakes the encode thread waiting for a URB
+	if (urb->free_event)
+		SetEvent(urb->free_event);
 
 	return;
 }
@@ -1444,21 +2350,19 @@ NTSTATUS usb_send_msg_async(urb_itm_t * urb, WDFUSBPIPE pipe, WDFREQUEST Request
 	writeSize = tsize;
 
 
-	status = WdfMemoryCreate(
+	//msg is the urb's own buffer and stays untouched until the completion routine hands the urb back,
+	//so the request can use it in place instead of a pool copy
+	status = WdfMemoryCreatePreallocated(
 		WDF_NO_OBJECT_ATTRIBUTES,
-		NonPagedPool,
-		0,
+		msg,
 		writeSize,
-		&wdfMemory,
-		NULL
+		&wdfMemory
 		);
 	if (!NT_SUCCESS(status)) {
-		LOG("WdfMemoryCreate NG\n");
+		LOG("WdfMemoryCreatePreallocated NG\n");
 		return status;
 	}
 
-	WdfMemoryCopyFromBuffer(wdfMemory, 0, msg, writeSize);
-
 
 	status = WdfUsbTargetPipeFormatRequestForWrite(
 		pipe,
@@ -1511,6 +2415,9 @@ typedef unsigned __int8 uint8_t;
 
 #define USBDISP_CMD_BITBLT           2
 #define USBDISP_CMD_BITBLT_JPEG       5
+#define USBDISP_CMD_JPEG_TABLES       6 //tables-only JPEG (SOI DQT DHT EOI) for the abbreviated BITBLT_JPEG frames that follow
+#define USBDISP_CMD_CURSOR_SHAPE      7 //pointer sprite, BGRA with straight alpha; x,y the hot spot, width,height the sprite
+#define USBDISP_CMD_CURSOR_MOVE       8 //header only; x,y the sprite's top left as int16, operation 1 while visible
 
 
 #define USBDISP_CMD_FLAG_START            (0x1<<7)
@@ -1741,6 +2648,26 @@ uint16_t crc16_calc(unsigned char *puchMsg, unsigned int usDataLen)
 	return crc16_calc_multi(0xFFFF, puchMsg, usDataLen);
 }
 
+//crc16 of the message bytes in buf[from..len) of a packetized stream, skipping the header byte of every packet after the first
+static uint16_t crc16_calc_packets(uint8_t * buf, int from, int len, int ep_size)
+{
+	uint16_t crc = 0xFFFF;
+	while (from < len) {
+		int end = (from / ep_size + 1) * ep_size;
+		if (end > len)
+			end = len;
+		crc = crc16_calc_multi(crc, &buf[from], end - from);
+		from = end + 1;
+	}
+	return crc;
+}
+
+//message bytes in a packetized stream of len bytes
+static int packetized_msg_bytes(int len, int ep_size)
+{
+	return (len > 0) ? len - (len - 1) / ep_size : 0;
+}
+
 
 #if 0
 int usb_send_image(WDFUSBPIPE pipeHandle, uint8_t * msg, uint8_t * urb_msg, uint32_t * framebuffer, int x, int y, int right, int bottom, int line_width)
@@ -1833,16 +2760,136 @@ int usb_send_image(WDFUSBPIPE pipeHandle, uint8_t * msg, uint8_t * urb_msg, uint
 
 
 
-int SwapChainProcessor::usb_send_jpeg_image(urb_itm_t * urb, WDFUSBPIPE pipeHandle, uint8_t * msg, uint8_t * urb_msg, uint32_t * framebuffer, int x, int y, int right, int bottom, int line_width)
+//patch total_bytes and crc16 into the bitblt header of a message written to a packetizing stream_mgr_t
+//and end it like encode_urb_msg does; returns the transfer length
+static int finish_packetized_msg(stream_mgr_t * mgr, int msg_pos)
+{
+	int ep_size = mgr->packet_size;
+	uint32_t total_bytes = packetized_msg_bytes(mgr->dp, ep_size);
+
+	_bitblt_encode_command_header_total_bytes(mgr->data, total_bytes, crc16_calc_packets(mgr->data, msg_pos, mgr->dp, ep_size));
+	//a message that ends on a packet boundary is followed by the next packet's header byte
+	if (mgr->dp % ep_size == 0)
+		mgr->data[mgr->dp++] = USBDISP_CMD_BITBLT;
+	return mgr->dp;
+}
+
+//append to a stream_mgr_t, starting a new packet with its header byte at every packet boundary
+static int stream_mgr_write(stream_mgr_t * mgr, const uint8_t * data, int len)
+{
+	while (len > 0) {
+		int n = len;
+		if (mgr->packet_size) {
+			int room = mgr->packet_size - mgr->dp % mgr->packet_size;
+			if (room == mgr->packet_size && mgr->dp > 0) {
+				if (mgr->dp + 1 >= mgr->max)
+					return 0;
+				mgr->data[mgr->dp++] = mgr->packet_header;
+				room--;
+			}
+			if (n > room)
+				n = room;
+		}
+		if (mgr->dp + n >= mgr->max)
+			return 0;
+		memcpy(&mgr->data[mgr->dp], data, n);
+		mgr->dp += n;
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+//pick the quality of a frame before anything of it is sent, so the tables sent ahead of it match.
+//under video load the encoder estimates the frame size from a sample of its MCUs and the best
+//quality that fits target_quaility_size is taken, so a frame lands near the budget the first time
+void SwapChainProcessor::choose_jpeg_quality(const uint8_t * src, int width, int height, int pitch)
+{
+	if (get_fps() >= 60) { //we think this may video case
+		jpg_quality = tje_encoder_choose_quality(jpg_encoder, width, height, TJE_BGRX, src, pitch, jpg_subsampling,
+			target_quaility_size, JPG_QUALITY_MIN, JPG_QUALITY_MAX);
+	}
+	else {
+		jpg_quality = JPG_QUALITY_STATIC;
+	}
+}
+
+//take slices until none are left, called on the pool and on the caller's thread
+static void run_jpeg_slices(jpg_slice_job_t * job)
+{
+	for (;;) {
+		int i = (int)InterlockedIncrement(&job->next) - 1;
+		if (i >= job->count)
+			break;
+		int first = job->rows * i / job->count;
+		int num = job->rows * (i + 1) / job->count - first;
+		stream_mgr_t out = { job->buf[i], JPEG_MAX_SIZE, 0 };
+		if (tje_encoder_encode_rows_to_ctx(job->enc, &out, job->width, job->height, TJE_BGRX, job->src, job->pitch,
+			job->quality, job->subsampling, first, num))
+			job->len[i] = out.dp;
+		else
+			job->len[i] = -1;
+	}
+}
+
+VOID CALLBACK SwapChainProcessor::JpgSliceWork(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_WORK Work)
+{
+	UNREFERENCED_PARAMETER(Instance);
+	UNREFERENCED_PARAMETER(Work);
+	run_jpeg_slices((jpg_slice_job_t *)Context);
+}
+
+//encode one frame as MCU-row slices on the thread pool and join them behind the header.
+//every slice boundary is a restart marker, so the result is the same as a single-threaded encode.
+int SwapChainProcessor::encode_jpeg_slices(void * ctx, int width, int height, const uint8_t * src, int pitch)
+{
+	stream_mgr_t * mgr = (stream_mgr_t *)ctx;
+	int cols, rows, i;
+
+	tje_mcu_grid(width, height, jpg_subsampling, &cols, &rows);
+	//one restart segment per MCU row, so any row can start a slice
+	tje_encoder_set_restart_interval(jpg_encoder, cols);
+	//the header also builds the quality tables, it must come before the workers start
+	if (!tje_encoder_encode_header_to_ctx(jpg_encoder, mgr, width, height, jpg_quality, jpg_subsampling))
+		return 0;
+
+	jpg_job.enc = jpg_encoder;
+	jpg_job.src = src;
+	jpg_job.width = width;
+	jpg_job.height = height;
+	jpg_job.pitch = pitch;
+	jpg_job.quality = jpg_quality;
+	jpg_job.subsampling = jpg_subsampling;
+	jpg_job.rows = rows;
+	jpg_job.count = (rows < jpg_slices) ? rows : jpg_slices;
+	jpg_job.next = 0;
+
+	for (i = 1; i < jpg_job.count; i++)
+		SubmitThreadpoolWork(jpg_work);
+	run_jpeg_slices(&jpg_job);
+	WaitForThreadpoolWorkCallbacks(jpg_work, FALSE);
+
+	for (i = 0; i < jpg_job.count; i++) {
+		if (jpg_job.len[i] < 0 || !stream_mgr_write(mgr, jpg_job.buf[i], jpg_job.len[i])) {
+			LOG("jpeg slice %d NG %d %d\n", i, jpg_job.len[i], mgr->dp);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//encode the bitblt of pixels, the rectangle at x,y of the screen, into urb_msg. returns urb->len, the
+//bytes to send, or -1; the transmit thread sends it
+int SwapChainProcessor::usb_encode_jpeg_image(urb_itm_t * urb, const uint8_t * pixels, int pitch, int x, int y, int right, int bottom)
 {
-	int last_copied_x, last_copied_y;
 	int ret = 0;
 	int pos = 0;
-	uint8_t * pix_msg;
 	stream_mgr_t m_mgr;
 	stream_mgr_t * mgr = &m_mgr;
 	uint32_t total_bytes = 0; //ovf bug 
 	int msg_pos = 0;
+	int jpg_bytes = 0;
+	int ep_size = urb->max_ep_out_size;
 
 
 	// estimate how many tickets are needed
@@ -1852,110 +2899,153 @@ int SwapChainProcessor::usb_send_jpeg_image(urb_itm_t * urb, WDFUSBPIPE pipeHand
 	if (!image_size) return -1;
 
 
-	msg_pos = _bitblt_encode_command_header(msg, x, y, right, bottom, USBDISP_CMD_BITBLT_JPEG);
-
-	pix_msg = &msg[msg_pos];
-	// locate to the begining...
-	framebuffer += (y * line_width + x);
-
-	for (last_copied_y = y; last_copied_y <= bottom; ++last_copied_y) {
-
-		for (last_copied_x = x; last_copied_x <= right; ++last_copied_x) {
-
-#ifdef PIXEL_32BIT
-			pixel_type_t pix = *framebuffer;
-			uint8_t r, g, b;
-			b = pix & 0xff;
-			g = (pix >> 8) & 0xff;
-			r = (pix >> 16) & 0xff;
-
-			*pix_msg++ = r;
-			*pix_msg++ = g;
-			*pix_msg++ = b;
-			msg_pos += 3;
-
-#else
-			pixel_type_t pix = *framebuffer;
-			uint8_t r, g, b;
-			b = (pix << 3) & 0xf8;
-			g = (pix >> 3) & 0xfc;
-			r = (pix >> 8) & 0xf8;
-
-			*pix_msg++ = r;
-			*pix_msg++ = g;
-			*pix_msg++ = b;
-			msg_pos += 3;
-#endif
-
-
-			++framebuffer;
+	//the bitblt header opens the first packet of urb_msg and the encoder writes behind it,
+	//adding the header byte of each further packet itself, so urb_msg is sent as is
+	msg_pos = _bitblt_encode_command_header(urb->urb_msg, x, y, right, bottom, USBDISP_CMD_BITBLT_JPEG);
 
-		}
-		framebuffer += line_width - right - 1 + x;
-	}
+	//the encoder converts the BGRX pixels straight from the frame, no RGB888 staging copy
 	long fps = get_fps();
-	int low_quality = -1;;
-	int high_quality = -1;
-
-redo: {
-	//ok we use jpeg transfer data
 
-	mgr->data = urb_msg;
-	mgr->max = JPEG_MAX_SIZE;
-	mgr->dp = 0;
-	if (!tje_encode_to_ctx(mgr, (right - x + 1), (bottom - y + 1), 3, &msg[sizeof(usbdisp_disp_bitblt_packet_t)], jpg_quality)) {
+	mgr->data = urb->urb_msg;
+	//same JPEG size limit as before, plus room for the packet header bytes
+	mgr->max = msg_pos + JPEG_MAX_SIZE + (msg_pos + JPEG_MAX_SIZE) / (ep_size - 1) + 1;
+	mgr->dp = msg_pos;
+	mgr->packet_size = ep_size;
+	mgr->packet_header = USBDISP_CMD_BITBLT;
+	long long t_encode = get_perf_us();
+	//a failed encode leaves a partial JPEG in urb_msg, it must not reach the device
+	if (jpg_slices > 1) {
+		if (!encode_jpeg_slices(mgr, (right - x + 1), (bottom - y + 1), pixels, pitch)) {
+			LOG("Could not encode JPEG slices\n");
+			return -1;
+		}
+	} else if (!tje_encoder_encode_to_ctx(jpg_encoder, mgr, (right - x + 1), (bottom - y + 1), TJE_BGRX, pixels, pitch, jpg_quality, jpg_subsampling)) {
 		LOG("Could not encode JPEG\n");
+		return -1;
 	}
-}
-	  LOG("%p jpg: total:%d %d\n", pipeHandle, mgr->dp, jpg_quality);
-	  if (fps >= 60) { //we think this may video case
-#define ABS(x) ((x) < 0 ? -(x) : (x))
-
-
-		  if (ABS(mgr->dp - target_quaility_size) < 2 * 1024)
-			  goto next;
-
-		  if (high_quality > 0 && low_quality > 0)
-			  goto next;
-
-		  if (mgr->dp > target_quaility_size) {
-			  high_quality = jpg_quality;
-			  if (jpg_quality >= 2) {
-				  jpg_quality--;
-				  goto next;
-			  }
-
-		  }
-		  else {
-			  low_quality = jpg_quality;
-			  if (jpg_quality <= 5) {
-				  jpg_quality++;
-				  goto next;
-			  }
-		  }
-	  }
-	  else {
-		  jpg_quality = 5;
-	  }
-  next:
-	  memcpy(&msg[sizeof(usbdisp_disp_bitblt_packet_t)], mgr->data, mgr->dp);
-
-	  total_bytes = sizeof(usbdisp_disp_bitblt_packet_t) + mgr->dp;
-	  _bitblt_encode_command_header_total_bytes(msg, total_bytes, crc16_calc(mgr->data, mgr->dp));
-	  //encode to urb protocol
-	  int urb_len = encode_urb_msg(pipeHandle, msg, urb_msg, total_bytes,urb->max_ep_out_size);
+	  t_encode = get_perf_us() - t_encode;
+	  jpg_bytes = packetized_msg_bytes(mgr->dp, ep_size) - msg_pos;
+	  put_jpg_stat((right - x + 1), (bottom - y + 1), (long)t_encode, jpg_bytes);
+	  LOG("jpg: total:%d %d predicted %d\n", jpg_bytes, jpg_quality, tje_encoder_predicted_size(jpg_encoder));
+	  //lets the size estimate of the next frames correct itself
+	  tje_encoder_report_size(jpg_encoder, jpg_quality, jpg_bytes);
+	  total_bytes = msg_pos + jpg_bytes;
+	  int urb_len = finish_packetized_msg(mgr, msg_pos);
 	  if (urb_len > 0) {
 		  gfid++;
-		  NTSTATUS ret = usb_send_msg_async(urb, pipeHandle, urb->Request, urb_msg, urb_len);
+		  jpg_tables_age++;
+		  urb->len = urb_len;
 		  put_fps_data(get_system_us());
-		  LOG("%p jpg: total:%d fps:%d(x10) %d\n", pipeHandle, total_bytes, fps, jpg_quality);
-		  return ret;
+		  LOG("jpg: total:%d fps:%d(x10) %d\n", total_bytes, fps, jpg_quality);
+		  return urb_len;
 	  }
 	  else
 		  return -1;
 
 }
 
+//encode the DQT/DHT tables for jpg_quality as a message of their own; abbreviated frames leave them out.
+//returns urb->len or -1
+int SwapChainProcessor::usb_encode_jpeg_tables(urb_itm_t * urb)
+{
+	stream_mgr_t m_mgr;
+	stream_mgr_t * mgr = &m_mgr;
+	int msg_pos = _bitblt_encode_command_header(urb->urb_msg, 0, 0, -1, -1, USBDISP_CMD_JPEG_TABLES);
+
+	mgr->data = urb->urb_msg;
+	mgr->max = urb->urb_msg_size;
+	mgr->dp = msg_pos;
+	mgr->packet_size = urb->max_ep_out_size;
+	mgr->packet_header = USBDISP_CMD_BITBLT;
+	if (!tje_encoder_encode_tables_to_ctx(jpg_encoder, mgr, jpg_quality)) {
+		LOG("Could not encode JPEG tables\n");
+		return -1;
+	}
+	int urb_len = finish_packetized_msg(mgr, msg_pos);
+	if (urb_len > 0) {
+		urb->len = urb_len;
+		jpg_tables_quality = jpg_quality;
+		jpg_tables_age = 0;
+	}
+	LOG("jpg tables: q%d %d\n", jpg_quality, urb_len);
+	return urb_len > 0 ? urb_len : -1;
+}
+
+//encode the pointer sprite in cursor_shape as a message of its own. a monochrome pointer is turned into
+//BGRA here, so the device draws a single format. returns urb->len or -1
+int SwapChainProcessor::usb_encode_cursor_shape(urb_itm_t * urb, const IDDCX_CURSOR_SHAPE_INFO * info)
+{
+	stream_mgr_t m_mgr;
+	stream_mgr_t * mgr = &m_mgr;
+	const uint8_t * src = cursor_shape;
+	int pitch = info->Pitch;
+	int width = info->Width;
+	int height = info->Height;
+	int x, y;
+
+	//as in DXGI, a monochrome shape holds the AND mask rows and then the XOR mask rows
+	if (IDDCX_CURSOR_SHAPE_TYPE_MONOCHROME == info->CursorType)
+		height /= 2;
+	else if (IDDCX_CURSOR_SHAPE_TYPE_ALPHA != info->CursorType)
+		return -1;
+	if (width <= 0 || height <= 0 || width > CURSOR_MAX_SIZE || height > CURSOR_MAX_SIZE)
+		return -1;
+	if (IDDCX_CURSOR_SHAPE_TYPE_MONOCHROME == info->CursorType) {
+		uint32_t * dst = (uint32_t *)cursor_rgba;
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				int bit = 0x80 >> (x & 7);
+				int and_bit = cursor_shape[y * pitch + x / 8] & bit;
+				int xor_bit = cursor_shape[(y + height) * pitch + x / 8] & bit;
+				//the device does not read back the frame under the sprite, inverting pixels are drawn black
+				if (and_bit)
+					*dst++ = xor_bit ? 0xff000000 : 0;
+				else
+					*dst++ = xor_bit ? 0xffffffff : 0xff000000;
+			}
+		}
+		src = cursor_rgba;
+		pitch = width * 4;
+	}
+
+	int msg_pos = _bitblt_encode_command_header(urb->urb_msg, info->XHot, info->YHot, info->XHot + width - 1,
+		info->YHot + height - 1, USBDISP_CMD_CURSOR_SHAPE);
+	mgr->data = urb->urb_msg;
+	mgr->max = urb->urb_msg_size;
+	mgr->dp = msg_pos;
+	mgr->packet_size = urb->max_ep_out_size;
+	mgr->packet_header = USBDISP_CMD_BITBLT;
+	for (y = 0; y < height; y++) {
+		if (!stream_mgr_write(mgr, src + y * pitch, width * 4))
+			return -1;
+	}
+	int urb_len = finish_packetized_msg(mgr, msg_pos);
+	if (urb_len > 0)
+		urb->len = urb_len;
+	LOG("cursor shape: %dx%d hot %d,%d %d\n", width, height, info->XHot, info->YHot, urb_len);
+	return urb_len > 0 ? urb_len : -1;
+}
+
+//encode the pointer position, a bare header: the move of the pointer costs a single packet.
+//returns urb->len or -1
+int SwapChainProcessor::usb_encode_cursor_move(urb_itm_t * urb, int x, int y, int visible)
+{
+	stream_mgr_t m_mgr;
+	stream_mgr_t * mgr = &m_mgr;
+	int msg_pos = _bitblt_encode_command_header(urb->urb_msg, x, y, x - 1, y - 1, USBDISP_CMD_CURSOR_MOVE);
+
+	((usbdisp_disp_bitblt_packet_t *)urb->urb_msg)->operation = visible ? 1 : 0;
+	mgr->data = urb->urb_msg;
+	mgr->max = urb->urb_msg_size;
+	mgr->dp = msg_pos;
+	mgr->packet_size = urb->max_ep_out_size;
+	mgr->packet_header = USBDISP_CMD_BITBLT;
+	int urb_len = finish_packetized_msg(mgr, msg_pos);
+	if (urb_len > 0)
+		urb->len = urb_len;
+	return urb_len > 0 ? urb_len : -1;
+}
+
 
 void scale_for_320x240(uint32_t * dst, uint32_t * src, int line, int len)
 {
@@ -19,6 +19,10 @@
 #include <wdf.h>
 #include <wdfusb.h>
 #include "Trace.h"
+#include "readback.h"
+#include "dirty_rect.h"
+#include "tile_diff.h"
+#include "frame_pipe.h"
 
 namespace Microsoft
 {
@@ -39,13 +43,38 @@ typedef uint32_t  pixel_type_t;
 #define DISP_MAX_HEIGHT 1024
 #define DISP_MAX_WIDTH  600
 
+// stamps of one presented frame through the pipe, get_perf_us(). colour conversion and
+// packetizing have no stamps of their own: the encoder does both MCU by MCU as it codes, so they
+// are part of the FRAME_TS_ENCODE..FRAME_TS_ENCODED span and reported to IddCx as the encode step
+enum {
+    FRAME_TS_ACQUIRE,       // buffer acquired
+    FRAME_TS_COPY,          // GPU copy queued
+    FRAME_TS_MAP,           // staging slot mapped
+    FRAME_TS_DIFF,          // fb_buf up to date, bitblts queued for the encode thread
+    FRAME_TS_ENCODE,        // encode started
+    FRAME_TS_ENCODED,
+    FRAME_TS_SUBMIT,        // URB submitted
+    FRAME_TS_COMPLETE,      // URB completed
+    FRAME_TS_MAX
+};
+
+typedef struct {
+    UINT present;           // presentation number
+    int report;             // the bitblt that finishes the frame, reported when its URB completes
+    long long ts[FRAME_TS_MAX];
+} frame_trace_t;
+
 typedef struct {
     SLIST_ENTRY node;
     WDFUSBPIPE pipe;
     int id;
-    uint8_t		msg[DISP_MAX_HEIGHT*DISP_MAX_WIDTH*4];
-    uint8_t		urb_msg[DISP_MAX_HEIGHT*DISP_MAX_WIDTH*4];
+    uint8_t *	urb_msg;        // behind the URB in the same allocation, see urb_alloc()
+    int urb_msg_size;
     PSLIST_HEADER urb_list;
+    HANDLE free_event;      // set once the URB is back in urb_list
+    int len;                // bytes of urb_msg to send
+    long long t_queued;     // handed to the transmit thread
+    frame_trace_t trace;    // of the frame this URB carries a bitblt of
     WDFREQUEST Request;
     WDFMEMORY  wdfMemory;
 	ULONG max_ep_out_size;
@@ -53,12 +82,152 @@ typedef struct {
 
 #define FPS_STAT_MAX 6
 
+// JPEG quality, 1-100 as in libjpeg.
+#define JPG_QUALITY_DEFAULT 92
+#define JPG_QUALITY_STATIC 90   // below the video frame rate
+#define JPG_QUALITY_MIN 50      // range of the rate control under video load
+#define JPG_QUALITY_MAX 92
+
+// A frame is cut into at most this many MCU-row slices, encoded in parallel.
+#define JPG_MAX_SLICES 4
+// 1: code each frame with Huffman tables built from the previous one, sent in its DHT.
+// needs a device decoder that loads the tables from DHT instead of assuming the defaults
+#define JPG_OPTIMIZE_HUFFMAN 0
+// 1: send the DQT/DHT tables as a USBDISP_CMD_JPEG_TABLES message when they change and
+// leave them out of the frames. needs a device that keeps the tables between messages
+#define JPG_ABBREVIATED_STREAMS 0
+// with both of the above, optimized Huffman tables are rebuilt and resent this often
+#define JPG_TABLES_REFRESH_FRAMES 60
+// 1: libjpeg's accurate integer DCT with rounding instead of the SIMD fixed-point one.
+// better picture per byte, about 2ms more CPU per 1024x600 frame
+#define JPG_ACCURATE_DCT 0
+
+typedef struct {
+    struct TJEEncoder * enc;
+    const uint8_t * src;
+    int width;
+    int height;
+    int pitch;
+    int quality;
+    int subsampling;
+    int rows;       // MCU rows in the frame
+    int count;      // slices in this frame
+    volatile LONG next;
+    uint8_t * buf[JPG_MAX_SLICES];
+    int len[JPG_MAX_SLICES];    // bytes in buf, -1 if the slice failed
+} jpg_slice_job_t;
+
 typedef struct {
     long tb[FPS_STAT_MAX];
     int cur;
     long last_fps;
 } fps_mgr_t;
 
+// encoder statistics: every JPG_STAT_FRAMES frames one line of key=value pairs is logged,
+// so runs of different builds and settings can be compared. 0: off
+#define JPG_STAT_FRAMES 300
+#define LAT_HIST_BINS 500   // 0.1ms bins, the last one also counts everything slower
+
+typedef struct {
+    uint32_t hist[LAT_HIST_BINS];
+    uint32_t count;
+    long long total_us;
+    long max_us;
+} lat_stat_t;
+
+typedef struct {
+    lat_stat_t encode;
+    long long in_bytes;     // BGRX bytes encoded
+    long long out_bytes;    // JPEG bytes without the packet headers
+    long long quality_sum;
+    int quality_min;
+    int quality_max;
+} jpg_stat_t;
+
+// per-stage times of the frame loop, logged every FRAME_STAT_FRAMES frames. 0: off
+#define FRAME_STAT_FRAMES 300
+
+enum {
+    FRAME_STAGE_STAGING,    // staging texture from the ring, created after a mode change
+    FRAME_STAGE_COPY,       // CopyResource queued
+    FRAME_STAGE_MAP,        // Map, waits for the GPU copy only when the readback lags too far
+    FRAME_STAGE_READ,       // copy of the dirty rectangles into fb_buf, without TILE_DIFF
+    FRAME_STAGE_DIFF,       // tile compare against fb_buf, copying the changed tiles into it
+    FRAME_STAGE_SEND,       // copy of the rectangles into frames for the encode thread
+    FRAME_STAGE_TOTAL,
+    FRAME_STAGE_MAX
+};
+
+typedef struct {
+    lat_stat_t stage[FRAME_STAGE_MAX];
+    uint32_t staging_created;   // staging textures created in this window
+    uint32_t wasted;            // frames read back while no frame was free for the encoder
+    uint32_t repeated;          // buffers with the presentation number of the one before, not read back
+    uint32_t unchanged;         // frames read back without a changed tile, nothing encoded
+    uint32_t keepalive;         // full frames sent because none went out for KEEPALIVE_MS
+} frame_stat_t;
+
+// latency of the frames sent since the swap chain started: span[i] from stamp i - 1 to stamp i,
+// span[0] from FRAME_TS_ACQUIRE to FRAME_TS_COMPLETE. kept and read by the encode thread only;
+// the latstat line it logs every FRAME_STAT_FRAMES frames is the way to see it
+typedef struct {
+    lat_stat_t span[FRAME_TS_MAX];
+} frame_lat_t;
+
+// capture, encode and transmit run on threads of their own, see frame_pipe.h.
+// frames carry the pixels of one bitblt from the capture to the encode thread
+#define PIPE_FRAMES 2
+#define MAX_URB_SIZE 2          // URBs for the frames, at most this many on the bus at once
+#define PIPE_RING_SIZE 4        // power of two, at least PIPE_FRAMES and the URBs
+// the encode and transmit threads log their counters every PIPE_STAT_ITEMS items. 0: off
+#define PIPE_STAT_ITEMS 300
+
+typedef struct {
+    int x;                  // bitblt rectangle, right and bottom inclusive
+    int y;
+    int right;
+    int bottom;
+    long long t_queued;     // handed to the encode thread
+    frame_trace_t trace;
+    uint8_t * pixels;       // BGRX, (right - x + 1) * 4 bytes per row
+} pipe_frame_t;
+
+// staging textures reused round robin, recreated only when the mode or format changes
+#define STAGING_RING_SIZE 3
+// frames whose GPU copy may still be running when the loop goes back to acquire the next one.
+// a frame is read back while the copy of the one after it runs; 0: copy and map in series
+#define READBACK_LAG 1
+
+// only the changed rectangles reported by IddCx are sent, each as its own bitblt,
+// unless they cover this share of the frame; then one full-frame bitblt goes out
+#define DIRTY_FULL_PERCENT 50
+// dirty rects / move regions taken from IddCx per frame, more mark the whole frame dirty
+#define DIRTY_QUERY_MAX 64
+// 1: narrow the dirty rectangles down to the tiles that differ from the previous frame,
+// for sessions that mark much more dirty than changed
+#define TILE_DIFF 1
+// a static screen sends nothing, but the whole frame still goes out when none did for this
+// long, so the device recovers from a frame it lost or decoded wrong. 0: off
+#define KEEPALIVE_MS 10000
+// longest wait for a new buffer while nothing is pending; the buffer event ends it anyway
+#define IDLE_WAIT_MS 250
+// 1: opt into the IddCx hardware cursor. the pointer is left out of the desktop image and goes to the
+// device as a sprite (USBDISP_CMD_CURSOR_SHAPE) and a position (USBDISP_CMD_CURSOR_MOVE) of its own,
+// so moving it encodes nothing. needs a device that draws the sprite over the frame
+#define HW_CURSOR 0
+// largest pointer sent as a sprite, IddCx draws bigger ones into the desktop image itself
+#define CURSOR_MAX_SIZE 64
+// a cursor message before the packet header bytes: the largest sprite behind the command header
+#define CURSOR_MSG_BYTES (CURSOR_MAX_SIZE * CURSOR_MAX_SIZE * 4 + 64)
+
+// hardware cursor messages, logged by the transmit thread every PIPE_STAT_ITEMS of them
+typedef struct {
+    uint32_t shapes;
+    uint32_t moves;
+    uint32_t coalesced;     // updates that came while one was pending, sent as one
+    lat_stat_t usb;         // query to completion of the cursor URB
+} cursor_stat_t;
+
 namespace Microsoft
 {
 
@@ -99,7 +268,7 @@ struct Direct3DDevice {
 class SwapChainProcessor
 {
 public:
-    SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, std::shared_ptr<Direct3DDevice> Device, WDFDEVICE      WdfDevice, HANDLE NewFrameEvent);
+    SwapChainProcessor(IDDCX_SWAPCHAIN hSwapChain, std::shared_ptr<Direct3DDevice> Device, WDFDEVICE      WdfDevice, HANDLE NewFrameEvent, IDDCX_MONITOR hMonitor);
     ~SwapChainProcessor();
 
 private:
@@ -109,24 +278,116 @@ private:
 
     void Run();
     void RunCore();
-    int usb_send_jpeg_image(urb_itm_t * urb, WDFUSBPIPE pipeHandle, uint8_t * msg, uint8_t * urb_msg, uint32_t * framebuffer, int x, int y, int right, int bottom, int line_width);
+    static VOID CALLBACK JpgSliceWork(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_WORK Work);
+    int encode_jpeg_slices(void * ctx, int width, int height, const uint8_t * src, int pitch);
+    void choose_jpeg_quality(const uint8_t * src, int width, int height, int pitch);
+    int usb_encode_jpeg_image(urb_itm_t * urb, const uint8_t * pixels, int pitch, int x, int y, int right, int bottom);
+    int usb_encode_jpeg_tables(urb_itm_t * urb);
     long get_fps(void);
     void put_fps_data(long t);
+    void put_jpg_stat(int width, int height, long encode_us, int jpg_bytes);
+    void log_jpg_stat(void);
+    long long put_stage_time(int stage, long long t);
+    void log_frame_stat(void);
+    void log_pipe_stat(const char * name, pipe_ring_t * q);
+    int prepare_staging_ring(const D3D11_TEXTURE2D_DESC * src_desc);
+    void release_staging_ring(void);
+    static int ReadbackCopy(void * ctx, int slot, void * src, int replace);
+    static int ReadbackMap(void * ctx, int slot, int wait);
+    static void ReadbackFrame(void * ctx, int slot, unsigned int seq);
+    static void ReadbackUnmap(void * ctx, int slot);
+    void collect_dirty_rects(const IDDCX_METADATA * meta, int width, int height);
+    int send_dirty_rects(const uint8_t * src, int line_width);
+    long keepalive_wait_ms(void);
+    int start_pipe(void);
+    void stop_pipe(void);
+    static DWORD CALLBACK EncodeThread(LPVOID Argument);
+    static DWORD CALLBACK SendThread(LPVOID Argument);
+    void RunEncode();
+    void RunSend();
+    urb_itm_t * pop_free_urb(void);
+    void queue_send_urb(urb_itm_t * urb);
+    void report_frame_stat(const frame_trace_t * trace, IDDCX_FRAME_STATUS status);
+    void report_done_urbs(void);
+    void put_frame_lat(const frame_trace_t * trace);
+    void log_frame_lat(void);
+    void setup_hw_cursor(void);
+    void send_cursor(void);
+    int usb_encode_cursor_shape(urb_itm_t * urb, const IDDCX_CURSOR_SHAPE_INFO * info);
+    int usb_encode_cursor_move(urb_itm_t * urb, int x, int y, int visible);
+    void log_cursor_stat(void);
 public:
     IDDCX_SWAPCHAIN m_hSwapChain;
+    IDDCX_MONITOR m_hMonitor;
     std::shared_ptr<Direct3DDevice> m_Device;
     WDFDEVICE  mp_WdfDevice;
-    uint8_t		fb_buf[DISP_MAX_HEIGHT*DISP_MAX_WIDTH*4];
+    uint8_t		fb_buf[DISP_MAX_HEIGHT*DISP_MAX_WIDTH*4];   // the last frame, fb_width * 4 bytes per row
     fps_mgr_t fps_mgr ;
+    jpg_stat_t jpg_stat;
+    frame_stat_t frame_stat;
+    frame_lat_t frame_lat;
+    SRWLOCK report_lock;        // report_frame_stat() runs on the swap-chain, encode and send threads
+    Microsoft::WRL::ComPtr<ID3D11Texture2D> staging_ring[STAGING_RING_SIZE];
+    D3D11_TEXTURE2D_DESC staging_desc;  // what the ring was created for
+    D3D11_MAPPED_SUBRESOURCE staging_mapped;    // the slot being read back
+    readback_t readback;
+    dirty_set_t frame_dirty;    // of the frame being acquired
+    dirty_set_t slot_dirty[STAGING_RING_SIZE];
+    frame_trace_t frame_trace;  // of the frame being acquired
+    frame_trace_t slot_trace[STAGING_RING_SIZE];
+    frame_trace_t sent_trace;   // of the frame read back last, its bitblts carry it
+    int sent_trace_open;        // the bitblt finishing it is not queued yet
+    dirty_set_t dirty_pending;  // in fb_buf, not sent yet
+    dirty_set_t dirty_lost;     // of frames whose map failed, sent with the next frame
+    dirty_set_t frame_changed;  // tiles of the frame read back that differ from the one before
+    tile_diff_t tile_diff;      // keeps fb_buf
+    pipe_frame_t pipe_frames[PIPE_FRAMES];
+    pipe_ring_t encode_ring;        // capture to encode, frames
+    pipe_ring_t frame_free_ring;    // encode back to capture, frames
+    pipe_ring_t send_ring;          // encode to transmit, URBs
+    void * encode_slots[PIPE_RING_SIZE];
+    void * frame_free_slots[PIPE_RING_SIZE];
+    void * send_slots[PIPE_RING_SIZE];
+    RECT dirty_query[DIRTY_QUERY_MAX];
+    IDDCX_MOVEREGION move_query[DIRTY_QUERY_MAX];
+    int fb_width;               // frame in fb_buf
+    int fb_height;
+    UINT64 last_present;        // presentation number of the last buffer read back
+    long long last_full_us;     // get_perf_us() when the last full frame was queued
     int jpg_quality;
     int dynamic_jpg_quality;
+    int jpg_subsampling;
+    struct TJEEncoder * jpg_encoder;
+    int jpg_slices;
+    PTP_WORK jpg_work;
+    jpg_slice_job_t jpg_job;
+    int jpg_tables_quality; // quality of the tables the device holds, -1: none
+    int jpg_tables_age;     // frames sent since those tables
     int target_quaility_size;
     uint16_t gfid;
     SLIST_HEADER urb_list;
     urb_itm_t * curr_urb;
+    urb_itm_t * urbs[MAX_URB_SIZE];     // every URB made, whether in urb_list or not
+    int urb_count;
+    urb_itm_t * cursor_urb;         // the transmit thread's own, NULL without HW_CURSOR
+    SLIST_HEADER cursor_urb_list;   // holds cursor_urb while it is not on the bus
+    UINT cursor_shape_id;           // of the sprite the device holds, (UINT)-1: none
+    int cursor_pending;             // IddCx has an update not sent yet
+    cursor_stat_t cursor_stat;
+    uint8_t cursor_shape[CURSOR_MAX_SIZE * CURSOR_MAX_SIZE * 4];
+    uint8_t cursor_rgba[CURSOR_MAX_SIZE * CURSOR_MAX_SIZE * 4];    // a monochrome sprite turned into BGRA
     HANDLE m_hAvailableBufferEvent;
     Microsoft::WRL::Wrappers::Thread m_hThread;
     Microsoft::WRL::Wrappers::Event m_hTerminateEvent;
+    Microsoft::WRL::Wrappers::Event m_hUrbFreeEvent;
+    Microsoft::WRL::Wrappers::Event m_hEncodeEvent;     // a frame queued for the encode thread
+    Microsoft::WRL::Wrappers::Event m_hSendEvent;       // a URB queued for the transmit thread
+    Microsoft::WRL::Wrappers::Event m_hFrameFreeEvent;  // a frame back from the encode thread
+    Microsoft::WRL::Wrappers::Event m_hPipeStopEvent;   // manual reset, ends the encode and transmit threads
+    Microsoft::WRL::Wrappers::Event m_hCursorEvent;     // set by IddCx, new pointer shape or position
+    Microsoft::WRL::Wrappers::Event m_hCursorFreeEvent; // cursor_urb back from the bus
+    Microsoft::WRL::Wrappers::Thread m_hEncodeThread;
+    Microsoft::WRL::Wrappers::Thread m_hSendThread;
 
 };
 
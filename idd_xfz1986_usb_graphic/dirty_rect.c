@@ -0,0 +1,139 @@
+/**
+ * dirty_rect.c
+ *
+ * See dirty_rect.h
+ */
+
+#include <string.h>
+
+#include "dirty_rect.h"
+
+static long dirty_rect_area(const dirty_rect_t * r)
+{
+    return (long)(r->right - r->left) * (r->bottom - r->top);
+}
+
+static dirty_rect_t dirty_union(const dirty_rect_t * a, const dirty_rect_t * b)
+{
+    dirty_rect_t u;
+
+    u.left = a->left < b->left ? a->left : b->left;
+    u.top = a->top < b->top ? a->top : b->top;
+    u.right = a->right > b->right ? a->right : b->right;
+    u.bottom = a->bottom > b->bottom ? a->bottom : b->bottom;
+    return u;
+}
+
+// pixels the union covers beyond the two rectangles, 0 or less when they overlap or are adjacent edge to edge
+static long dirty_growth(const dirty_rect_t * a, const dirty_rect_t * b)
+{
+    dirty_rect_t u = dirty_union(a, b);
+
+    return dirty_rect_area(&u) - dirty_rect_area(a) - dirty_rect_area(b);
+}
+
+static int dirty_overlap(const dirty_rect_t * a, const dirty_rect_t * b)
+{
+    return a->left < b->right && b->left < a->right && a->top < b->bottom && b->top < a->bottom;
+}
+
+void dirty_clear(dirty_set_t * set)
+{
+    set->count = 0;
+}
+
+void dirty_remove(dirty_set_t * set, int i)
+{
+    if (i < 0 || i >= set->count)
+        return;
+    memmove(&set->r[i], &set->r[i + 1], (set->count - i - 1) * sizeof(set->r[0]));
+    set->count--;
+}
+
+void dirty_add(dirty_set_t * set, int left, int top, int right, int bottom, int width, int height)
+{
+    dirty_rect_t n;
+    int i, j, merged;
+
+    // before aligning, which would grow an empty one into a whole tile
+    if (left >= right || top >= bottom)
+        return;
+    left = left < 0 ? 0 : left & ~(DIRTY_ALIGN - 1);
+    top = top < 0 ? 0 : top & ~(DIRTY_ALIGN - 1);
+    right = (right + DIRTY_ALIGN - 1) & ~(DIRTY_ALIGN - 1);
+    bottom = (bottom + DIRTY_ALIGN - 1) & ~(DIRTY_ALIGN - 1);
+    if (right > width)
+        right = width;
+    if (bottom > height)
+        bottom = height;
+    if (left >= right || top >= bottom)
+        return;
+    n.left = left;
+    n.top = top;
+    n.right = right;
+    n.bottom = bottom;
+
+    // fold in every rectangle the new one overlaps, or that it completes to a rectangle
+    do {
+        merged = 0;
+        for (i = 0; i < set->count; i++) {
+            if (dirty_overlap(&n, &set->r[i]) || dirty_growth(&n, &set->r[i]) <= 0) {
+                n = dirty_union(&n, &set->r[i]);
+                dirty_remove(set, i);
+                merged = 1;
+                break;
+            }
+        }
+    } while (merged);
+
+    if (set->count < DIRTY_MAX_RECTS) {
+        set->r[set->count++] = n;
+        return;
+    }
+
+    // full: of these and the new one, merge the pair whose union wastes the least area
+    {
+        dirty_rect_t all[DIRTY_MAX_RECTS + 1];
+        long best = 0;
+        int bi = -1, bj = 0;
+
+        memcpy(all, set->r, sizeof(set->r));
+        all[DIRTY_MAX_RECTS] = n;
+        for (i = 0; i <= DIRTY_MAX_RECTS; i++) {
+            for (j = i + 1; j <= DIRTY_MAX_RECTS; j++) {
+                long g = dirty_growth(&all[i], &all[j]);
+                if (bi < 0 || g < best) {
+                    best = g;
+                    bi = i;
+                    bj = j;
+                }
+            }
+        }
+        n = dirty_union(&all[bi], &all[bj]);
+        set->count = 0;
+        for (i = 0; i <= DIRTY_MAX_RECTS; i++) {
+            if (i != bi && i != bj)
+                set->r[set->count++] = all[i];
+        }
+    }
+    // the union may now overlap others, add it again
+    dirty_add(set, n.left, n.top, n.right, n.bottom, width, height);
+}
+
+void dirty_merge(dirty_set_t * set, const dirty_set_t * src, int width, int height)
+{
+    int i;
+
+    for (i = 0; i < src->count; i++)
+        dirty_add(set, src->r[i].left, src->r[i].top, src->r[i].right, src->r[i].bottom, width, height);
+}
+
+long dirty_area(const dirty_set_t * set)
+{
+    long area = 0;
+    int i;
+
+    for (i = 0; i < set->count; i++)
+        area += dirty_rect_area(&set->r[i]);
+    return area;
+}
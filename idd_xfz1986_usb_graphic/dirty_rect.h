@@ -0,0 +1,51 @@
+/**
+ * dirty_rect.h
+ *
+ * A small set of changed screen rectangles.
+ *
+ * Rectangles are aligned outward to DIRTY_ALIGN pixels, so each one is
+ * whole JPEG MCUs at every subsampling, and clipped to the frame. Adding a
+ * rectangle merges it with the ones it overlaps or touches; when the set is
+ * full, the two whose union grows the area least are merged. The set never
+ * holds more than DIRTY_MAX_RECTS rectangles, each sent as one bitblt.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define DIRTY_MAX_RECTS 4
+#define DIRTY_ALIGN     16
+
+typedef struct {
+    int left;
+    int top;
+    int right;      // exclusive
+    int bottom;     // exclusive
+} dirty_rect_t;
+
+typedef struct {
+    int count;
+    dirty_rect_t r[DIRTY_MAX_RECTS];
+} dirty_set_t;
+
+void dirty_clear(dirty_set_t * set);
+
+// adds [left, right) x [top, bottom) of a width x height frame. empty rectangles are ignored
+void dirty_add(dirty_set_t * set, int left, int top, int right, int bottom, int width, int height);
+
+// adds every rectangle of src
+void dirty_merge(dirty_set_t * set, const dirty_set_t * src, int width, int height);
+
+// drops r[i], keeping the order of the others
+void dirty_remove(dirty_set_t * set, int i);
+
+// pixels covered; rectangles of a set do not overlap
+long dirty_area(const dirty_set_t * set);
+
+#ifdef __cplusplus
+}  // extern C
+#endif
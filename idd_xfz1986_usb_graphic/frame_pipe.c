@@ -0,0 +1,85 @@
+/**
+ * frame_pipe.c
+ *
+ * See frame_pipe.h
+ */
+
+#include <string.h>
+
+#include "frame_pipe.h"
+
+// the producer publishes tail after writing the slot, the consumer head after reading it
+#if defined(_MSC_VER)
+#include <windows.h>
+#define PIPE_LOAD(p)        ((unsigned int)InterlockedCompareExchange((volatile LONG *)(p), 0, 0))
+#define PIPE_STORE(p, v)    InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#else
+#define PIPE_LOAD(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PIPE_STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+void pipe_ring_init(pipe_ring_t * q, void ** slot, unsigned int slots)
+{
+    memset(q, 0, sizeof(*q));
+    q->slot = slot;
+    q->mask = slots - 1;
+}
+
+int pipe_ring_push(pipe_ring_t * q, void * item)
+{
+    unsigned int tail = q->tail;
+
+    if (tail - PIPE_LOAD(&q->head) > q->mask) {
+        q->full++;
+        return 0;
+    }
+    q->slot[tail & q->mask] = item;
+    PIPE_STORE(&q->tail, tail + 1);
+    return 1;
+}
+
+void * pipe_ring_pop(pipe_ring_t * q)
+{
+    unsigned int head = q->head;
+    unsigned int n = PIPE_LOAD(&q->tail) - head;
+    void * item;
+
+    if (0 == n) {
+        q->empty++;
+        return NULL;
+    }
+    item = q->slot[head & q->mask];
+    PIPE_STORE(&q->head, head + 1);
+    q->items++;
+    q->occupancy_sum += n;
+    if (n > q->occupancy_max)
+        q->occupancy_max = n;
+    return item;
+}
+
+unsigned int pipe_ring_count(pipe_ring_t * q)
+{
+    return PIPE_LOAD(&q->tail) - PIPE_LOAD(&q->head);
+}
+
+void pipe_ring_done(pipe_ring_t * q, long wait_us, long work_us)
+{
+    q->wait_us += wait_us;
+    q->work_us += work_us;
+    if (wait_us > q->wait_max_us)
+        q->wait_max_us = wait_us;
+    if (work_us > q->work_max_us)
+        q->work_max_us = work_us;
+}
+
+void pipe_ring_reset_stat(pipe_ring_t * q)
+{
+    q->empty = 0;
+    q->items = 0;
+    q->occupancy_max = 0;
+    q->occupancy_sum = 0;
+    q->wait_us = 0;
+    q->work_us = 0;
+    q->wait_max_us = 0;
+    q->work_max_us = 0;
+}
@@ -0,0 +1,69 @@
+/**
+ * frame_pipe.h
+ *
+ * The queues between the stages of the frame pipeline.
+ *
+ * Capture, encode and transmit each run on a thread of their own and hand
+ * preallocated objects to each other by pointer through bounded
+ * single-producer, single-consumer rings: nothing is allocated or locked per
+ * frame. A full ring holds the producer back, an empty one makes the
+ * consumer wait; waiting and waking are left to the caller, there are no
+ * threads or events in here.
+ *
+ * Each ring also counts for the stage that consumes it: how full it was,
+ * how long items waited in it and how long the stage worked on them.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define PIPE_CACHE_LINE 64
+
+typedef struct {
+    // set by pipe_ring_init, read by both sides
+    void ** slot;
+    unsigned int mask;                  // slots - 1, slots a power of two
+    char pad0[PIPE_CACHE_LINE];
+
+    // producer side
+    volatile unsigned int tail;         // next slot written
+    unsigned int full;                  // pushes refused since init, the consumer was behind
+    char pad1[PIPE_CACHE_LINE];
+
+    // consumer side, the stage statistics
+    volatile unsigned int head;         // next slot read
+    unsigned int empty;                 // pops that found nothing
+    unsigned int items;                 // taken since the statistics were reset
+    unsigned int occupancy_max;
+    unsigned long long occupancy_sum;   // queued items seen by each pop, the one taken included
+    long long wait_us;                  // queued to taken, as reported to pipe_ring_done()
+    long long work_us;
+    long wait_max_us;
+    long work_max_us;
+} pipe_ring_t;
+
+// slots is a power of two, the ring holds that many items
+void pipe_ring_init(pipe_ring_t * q, void ** slot, unsigned int slots);
+
+// producer. 0 if the ring is full
+int pipe_ring_push(pipe_ring_t * q, void * item);
+
+// consumer. NULL if the ring is empty
+void * pipe_ring_pop(pipe_ring_t * q);
+
+// items queued, exact on either side for the items that side cannot move
+unsigned int pipe_ring_count(pipe_ring_t * q);
+
+// consumer: an item taken waited wait_us in the ring and took work_us to handle
+void pipe_ring_done(pipe_ring_t * q, long wait_us, long work_us);
+
+// consumer: starts a new statistics window, full keeps counting
+void pipe_ring_reset_stat(pipe_ring_t * q);
+
+#ifdef __cplusplus
+}  // extern C
+#endif
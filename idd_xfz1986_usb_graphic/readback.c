@@ -0,0 +1,86 @@
+/**
+ * readback.c
+ *
+ * See readback.h
+ */
+
+#include <string.h>
+
+#include "readback.h"
+
+void readback_init(readback_t * rb, const readback_ops_t * ops, void * ctx, int depth, int lag)
+{
+    memset(rb, 0, sizeof(*rb));
+    if (depth < 1)
+        depth = 1;
+    if (depth > READBACK_MAX_DEPTH)
+        depth = READBACK_MAX_DEPTH;
+    if (lag > depth - 1)
+        lag = depth - 1;
+    if (lag < 0)
+        lag = 0;
+    rb->ops = ops;
+    rb->ctx = ctx;
+    rb->depth = depth;
+    rb->lag = lag;
+}
+
+// maps the oldest pending slot and hands it to ops->frame. the map is tried without waiting
+// first, so the frames that stalled on the GPU are counted
+static void readback_take(readback_t * rb)
+{
+    int slot = rb->head;
+    int r = rb->ops->map(rb->ctx, slot, 0);
+
+    if (READBACK_MAP_BUSY == r) {
+        rb->waits++;
+        r = rb->ops->map(rb->ctx, slot, 1);
+    }
+    if (READBACK_MAP_OK == r) {
+        rb->ops->frame(rb->ctx, slot, rb->seq[slot]);
+        rb->ops->unmap(rb->ctx, slot);
+    } else {
+        rb->dropped++;
+    }
+    rb->head = (rb->head + 1) % rb->depth;
+    rb->pending--;
+}
+
+int readback_push(readback_t * rb, void * src, unsigned int seq)
+{
+    int slot;
+
+    if (rb->pending == rb->depth)
+        readback_take(rb);
+    slot = (rb->head + rb->pending) % rb->depth;
+    if (!rb->ops->copy(rb->ctx, slot, src, 0))
+        return 0;
+    rb->seq[slot] = seq;
+    rb->pending++;
+    return 1;
+}
+
+int readback_replace(readback_t * rb, void * src, unsigned int seq)
+{
+    int slot;
+
+    if (0 == rb->pending)
+        return readback_push(rb, src, seq);
+    slot = (rb->head + rb->pending - 1) % rb->depth;
+    if (!rb->ops->copy(rb->ctx, slot, src, 1))
+        return 0;
+    rb->seq[slot] = seq;
+    rb->replaced++;
+    return 1;
+}
+
+int readback_poll(readback_t * rb, int flush)
+{
+    int n = 0;
+
+    while (rb->pending > (flush ? 0 : rb->lag)) {
+        readback_take(rb);
+        n++;
+    }
+    return n;
+}
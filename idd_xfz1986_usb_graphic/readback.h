@@ -0,0 +1,84 @@
+/**
+ * readback.h
+ *
+ * Scheduling of the GPU to CPU frame readback.
+ *
+ * Each acquired frame is copied into one of a few staging slots and read
+ * back later, so the GPU copy of frame N runs while frame N-1 is converted
+ * and encoded instead of the CPU stalling in Map right after CopyResource.
+ *
+ * The device is only reached through readback_ops_t, there is no D3D in
+ * here.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define READBACK_MAX_DEPTH 4
+
+// results of readback_ops_t.map
+#define READBACK_MAP_OK     0
+#define READBACK_MAP_BUSY   1   // the copy has not finished, only when not waiting
+#define READBACK_MAP_FAIL   2
+
+typedef struct {
+    // queues the copy of src into the slot. with replace, the slot still holds a frame that was
+    // never read back and this one supersedes it. 0 on failure
+    int (*copy)(void * ctx, int slot, void * src, int replace);
+    // maps the slot for reading. without wait, READBACK_MAP_BUSY if its copy is still running
+    int (*map)(void * ctx, int slot, int wait);
+    // called while the slot is mapped, with the seq it was pushed with
+    void (*frame)(void * ctx, int slot, unsigned int seq);
+    void (*unmap)(void * ctx, int slot);
+} readback_ops_t;
+
+typedef struct {
+    const readback_ops_t * ops;
+    void * ctx;
+    int depth;              // slots, at most READBACK_MAX_DEPTH
+    int lag;                // frames left pending by readback_poll()
+    int head;               // oldest pending slot
+    int pending;
+    unsigned int seq[READBACK_MAX_DEPTH];
+    unsigned int waits;     // maps that had to wait for the GPU
+    unsigned int dropped;   // frames lost to a failed map
+    unsigned int replaced;  // frames copied over one never read back
+} readback_t;
+
+void readback_init(readback_t * rb, const readback_ops_t * ops, void * ctx, int depth, int lag);
+
+// - readback_push -
+//
+//  Queues the copy of a frame into the next slot. When every slot is
+//  pending, the oldest frame is read back first, waiting if needed.
+//
+//  Returns 0 if the copy could not be queued.
+int readback_push(readback_t * rb, void * src, unsigned int seq);
+
+// - readback_poll -
+//
+//  Reads back pending frames oldest first until `lag` of them are left, or
+//  none if `flush` is set. The newest frames stay pending so their copy runs
+//  while the older ones are encoded; a frame whose copy is still running is
+//  waited for.
+//
+//  Returns the number of frames read back.
+int readback_poll(readback_t * rb, int flush);
+
+// - readback_replace -
+//
+//  Copies a frame over the newest pending one instead of queueing it, for
+//  when nothing could be sent: frames that arrive while the link is busy
+//  cost one GPU copy each and only the latest of them is read back. Queues
+//  the frame as readback_push() does when none is pending.
+//
+//  Returns 0 if the copy could not be queued.
+int readback_replace(readback_t * rb, void * src, unsigned int seq);
+
+#ifdef __cplusplus
+}  // extern C
+#endif
@@ -0,0 +1,109 @@
+/**
+ * corpus.c
+ *
+ * See corpus.h
+ */
+
+#include <math.h>
+
+#include "corpus.h"
+
+const char * const corpus_names[CORPUS_KINDS] = { "text", "ui", "photo", "video", "gradient" };
+
+const int corpus_sizes[CORPUS_SIZES][2] = { { 320, 240 }, { 640, 480 }, { 800, 600 }, { 1024, 600 } };
+
+static uint32_t corpus_rnd(uint32_t * state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+static int clamp255(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static uint32_t bgrx(int r, int g, int b)
+{
+    return (uint32_t)clamp255(b) | (uint32_t)clamp255(g) << 8 | (uint32_t)clamp255(r) << 16 | 0xff000000u;
+}
+
+// dark glyph strokes on a light page under a title bar, lines of ragged length
+static void corpus_text(uint32_t * px, int width, int height)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint32_t c = 0xfff3f3f3;
+            if (y < 24)
+                c = 0xff1f1f1f;
+            else if ((y - 30) % 18 < 11 && x > 8 && x < width - 16 - (y * 7) % 120 && ((x * 13) ^ (y * 7)) % 5 < 2)
+                c = 0xff202020;
+            px[y * width + x] = c;
+        }
+    }
+}
+
+// flat panels, a side bar and one-pixel rules, scrolled by frame
+static void corpus_ui(uint32_t * px, int width, int height, int frame)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        int v = y + frame * 5;
+        for (x = 0; x < width; x++) {
+            int c = ((x / 3 + v / 5) % 7 == 0 || v % 12 < 2) ? 20 : 235;
+            px[y * width + x] = (x < width / 4) ? bgrx(40, 60, 120) : bgrx(c, c, c);
+        }
+    }
+}
+
+// smooth shading with grain; noise scales the grain, video has more of it and moves
+static void corpus_shaded(uint32_t * px, int width, int height, double noise, int frame)
+{
+    uint32_t state = 12345u + (uint32_t)frame * 2654435761u;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            int X = x + frame * 7;
+            int Y = y + frame * 3;
+            int n = (int)(noise * (corpus_rnd(&state) >> 10 & 63)) - (int)(noise * 32);
+            int r = 128 + (int)(90 * sin(X * 0.031) * cos(Y * 0.017)) + n;
+            int g = 128 + (int)(80 * sin((X + Y) * 0.011)) + n / 2;
+            int b = (int)(((X ^ Y) & 255) * noise + (1 - noise) * 128);
+            px[y * width + x] = bgrx(r, g, b);
+        }
+    }
+}
+
+static void corpus_gradient(uint32_t * px, int width, int height)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+            px[y * width + x] = bgrx(x * 255 / width, y * 255 / height, (x + y) * 255 / (width + height));
+}
+
+void corpus_frame(uint32_t * px, int width, int height, int kind, int frame)
+{
+    switch (kind) {
+    case CORPUS_TEXT:
+        corpus_text(px, width, height);
+        break;
+    case CORPUS_UI:
+        corpus_ui(px, width, height, frame);
+        break;
+    case CORPUS_PHOTO:
+        corpus_shaded(px, width, height, 0.4, 0);
+        break;
+    case CORPUS_VIDEO:
+        corpus_shaded(px, width, height, 1.2, frame);
+        break;
+    default:
+        corpus_gradient(px, width, height);
+        break;
+    }
+}
@@ -0,0 +1,42 @@
+/**
+ * corpus.h
+ *
+ * Synthetic desktop content for the benchmark and the tests.
+ *
+ * Every frame is generated from its kind, size and index alone, so two
+ * builds measured on different machines see the same pixels. The kinds
+ * cover what the panels show: text, UI chrome, photos, video stills and
+ * gradients, in the BGRX layout IddCx hands to the driver.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+enum {
+    CORPUS_TEXT,
+    CORPUS_UI,
+    CORPUS_PHOTO,
+    CORPUS_VIDEO,
+    CORPUS_GRADIENT,
+    CORPUS_KINDS
+};
+
+#define CORPUS_SIZES 4
+
+extern const char * const corpus_names[CORPUS_KINDS];
+// 320x240, 640x480, 800x600 and 1024x600
+extern const int corpus_sizes[CORPUS_SIZES][2];
+
+// fills width * height BGRX pixels, tightly packed. frame moves the content
+// of the video and UI kinds, as consecutive frames of a session would
+void corpus_frame(uint32_t * px, int width, int height, int kind, int frame);
+
+#ifdef __cplusplus
+}  // extern C
+#endif
@@ -0,0 +1,203 @@
+/**
+ * jpeg_bench.c
+ *
+ * Encoder benchmark over the synthetic corpus, for Linux.
+ *
+ * Every frame goes the way Driver.cpp sends it: encoded by a persistent
+ * encoder straight into a packetized message behind the 16 byte bitblt
+ * command header. With --threads above 1 the frame is cut into MCU-row
+ * slices on that many threads, as encode_jpeg_slices() does. One CSV row
+ * per size, content, DCT, subsampling and quality on stdout:
+ *
+ *   width,height,content,dct,subsampling,quality,threads,frames,bytes,
+ *   wire_bytes,ms_avg,ms_p50,ms_p99,fps,mbps,psnr
+ *
+ * bytes is the average JPEG size, wire_bytes the average message size with
+ * the command header and the packet header bytes, fps and mbps the frames
+ * and source BGRX megabytes encoded per second at the average time and psnr
+ * the quality of the last frame as libjpeg decodes it.
+ *
+ * usage: jpeg_bench [--frames N] [--packet N] [--size WxH] [--simd none|sse2|avx2]
+ *                   [--threads N] [--optimize-huffman]
+ *
+ * --optimize-huffman codes every frame after the first with the tables built
+ * from the one before, as JPG_OPTIMIZE_HUFFMAN does.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "jpeg_util.h"
+#include "slice_pool.h"
+
+#define BENCH_QUALITIES 4
+
+static const int bench_qualities[BENCH_QUALITIES] = { 50, 70, 85, 92 };
+static const char * const bench_dct_names[] = { "fast", "islow" };
+static const char * const bench_sub_names[] = { "444", "422", "420" };
+static const char * const bench_simd_names[] = { "none", "sse2", "avx2" };
+
+static double bench_now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static int bench_cmp(const void * a, const void * b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr, "usage: jpeg_bench [--frames N] [--packet N] [--size WxH] [--simd none|sse2|avx2]\n"
+                    "                  [--threads N] [--optimize-huffman]\n");
+}
+
+int main(int argc, char ** argv)
+{
+    int frames = 20;
+    int packet_size = 512;
+    int only_width = 0, only_height = 0;
+    int simd = TJE_SIMD_AVX2;
+    int threads = 1;
+    int optimize_huffman = 0;
+    slice_pool_t * pool = NULL;
+    int s, k, dct, sub, qi, i;
+    uint8_t * msg;
+    uint8_t * jpg;
+    uint32_t * px;
+    double * ms;
+    int msg_max;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--packet") && i + 1 < argc) {
+            packet_size = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &only_width, &only_height) != 2) {
+                bench_usage();
+                return 2;
+            }
+        } else if (!strcmp(argv[i], "--optimize-huffman")) {
+            optimize_huffman = 1;
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--simd") && i + 1 < argc) {
+            i++;
+            for (simd = TJE_SIMD_AVX2; simd >= 0 && strcmp(argv[i], bench_simd_names[simd]); simd--)
+                ;
+        } else {
+            bench_usage();
+            return 2;
+        }
+    }
+    if (frames < 1 || packet_size == 1 || packet_size < 0 || simd < 0 || threads < 1 || threads > SLICE_MAX_THREADS) {
+        bench_usage();
+        return 2;
+    }
+    if (threads > 1) {
+        pool = slice_pool_create(threads);
+        if (pool == NULL) {
+            fprintf(stderr, "no slice pool of %d threads\n", threads);
+            return 1;
+        }
+    }
+
+    // the CPU may have less than asked for, say what runs
+    tje_set_simd_level(simd);
+    fprintf(stderr, "simd: %s\n", bench_simd_names[tje_get_simd_level()]);
+
+    // same room as the frame URB of the driver
+    msg_max = CMD_HEADER_BYTES + JPEG_MAX_SIZE;
+    if (packet_size)
+        msg_max += msg_max / (packet_size - 1) + 1;
+    msg = (uint8_t *)malloc(msg_max);
+    jpg = (uint8_t *)malloc(msg_max);
+    ms = (double *)malloc(sizeof(double) * frames);
+
+    printf("width,height,content,dct,subsampling,quality,threads,frames,bytes,wire_bytes,ms_avg,ms_p50,ms_p99,fps,mbps,psnr\n");
+    for (s = 0; s < CORPUS_SIZES; s++) {
+        int width = corpus_sizes[s][0];
+        int height = corpus_sizes[s][1];
+        if (only_width && (width != only_width || height != only_height))
+            continue;
+        px = (uint32_t *)malloc(sizeof(uint32_t) * width * height * frames);
+
+        for (k = 0; k < CORPUS_KINDS; k++) {
+            for (i = 0; i < frames; i++)
+                corpus_frame(px + (size_t)width * height * i, width, height, k, i);
+
+            for (dct = 0; dct < 2; dct++) for (sub = 0; sub < 3; sub++) for (qi = 0; qi < BENCH_QUALITIES; qi++) {
+                tje_encoder_t * enc = tje_encoder_create();
+                stream_mgr_t mgr = { 0 };
+                double total = 0, psnr = 0;
+                long long bytes = 0, wire = 0;
+                int failed = 0;
+
+                tje_encoder_set_dct(enc, dct ? TJE_DCT_ISLOW : TJE_DCT_FAST);
+                tje_encoder_set_optimize_huffman(enc, optimize_huffman);
+                for (i = 0; i < frames; i++) {
+                    const uint32_t * frame = px + (size_t)width * height * i;
+                    double t0;
+
+                    mgr.data = msg;
+                    mgr.max = msg_max;
+                    mgr.dp = CMD_HEADER_BYTES;
+                    mgr.packet_size = packet_size;
+                    mgr.packet_header = CMD_PACKET_HEADER;
+                    t0 = bench_now_ms();
+                    if (pool) {
+                        if (!slice_pool_encode(pool, enc, &mgr, width, height, (const uint8_t *)frame, width * 4,
+                                               bench_qualities[qi], sub))
+                            failed++;
+                    } else if (!tje_encoder_encode_to_ctx(enc, &mgr, width, height, TJE_BGRX,
+                                                          (const unsigned char *)frame, width * 4,
+                                                          bench_qualities[qi], sub)) {
+                        failed++;
+                    }
+                    ms[i] = bench_now_ms() - t0;
+                    total += ms[i];
+                    wire += mgr.dp;
+                    bytes += jpeg_unpacketize(msg, CMD_HEADER_BYTES, mgr.dp, packet_size, jpg);
+                }
+                tje_encoder_destroy(enc);
+                if (failed) {
+                    fprintf(stderr, "%dx%d %s %s %s q%d: %d of %d frames over JPEG_MAX_SIZE\n", width, height,
+                            corpus_names[k], bench_dct_names[dct], bench_sub_names[sub], bench_qualities[qi], failed, frames);
+                    continue;
+                }
+
+                {
+                    int len = jpeg_unpacketize(msg, CMD_HEADER_BYTES, mgr.dp, packet_size, jpg);
+                    int dw, dh;
+                    uint8_t * rgb = jpeg_decode_rgb(jpg, len, &dw, &dh);
+                    if (rgb && dw == width && dh == height)
+                        psnr = jpeg_psnr(px + (size_t)width * height * (frames - 1), rgb, width, height);
+                    free(rgb);
+                }
+
+                qsort(ms, frames, sizeof(double), bench_cmp);
+                printf("%d,%d,%s,%s,%s,%d,%d,%d,%lld,%lld,%.3f,%.3f,%.3f,%.1f,%.1f,%.2f\n", width, height,
+                       corpus_names[k], bench_dct_names[dct], bench_sub_names[sub], bench_qualities[qi], threads,
+                       frames, bytes / frames, wire / frames, total / frames, ms[frames / 2],
+                       ms[(frames * 99 - 1) / 100], 1e3 / (total / frames), width * height * 4 / 1e3 / (total / frames),
+                       psnr);
+                fflush(stdout);
+            }
+        }
+        free(px);
+    }
+
+    slice_pool_destroy(pool);
+    free(ms);
+    free(jpg);
+    free(msg);
+    return 0;
+}
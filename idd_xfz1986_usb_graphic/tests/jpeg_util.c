@@ -0,0 +1,93 @@
+/**
+ * jpeg_util.c
+ *
+ * See jpeg_util.h
+ */
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+
+#include "jpeg_util.h"
+
+int jpeg_unpacketize(const uint8_t * in, int from, int len, int packet_size, uint8_t * out)
+{
+    int n = 0;
+    int p;
+
+    for (p = from; p < len; p++) {
+        if (packet_size > 0 && p > 0 && p % packet_size == 0)
+            continue;
+        out[n++] = in[p];
+    }
+    return n;
+}
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} jpeg_util_err_t;
+
+static void jpeg_util_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((jpeg_util_err_t *)cinfo->err)->jmp, 1);
+}
+
+// libjpeg only warns about corrupt data and goes on decoding, count that as failure
+static void jpeg_util_emit_message(j_common_ptr cinfo, int level)
+{
+    if (level < 0)
+        longjmp(((jpeg_util_err_t *)cinfo->err)->jmp, 1);
+}
+
+uint8_t * jpeg_decode_rgb(const uint8_t * jpg, int len, int * width, int * height)
+{
+    struct jpeg_decompress_struct cinfo;
+    jpeg_util_err_t err;
+    uint8_t * volatile rgb = NULL;
+
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpeg_util_error_exit;
+    err.pub.emit_message = jpeg_util_emit_message;
+    if (setjmp(err.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(rgb);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)jpg, (unsigned long)len);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    rgb = (uint8_t *)malloc((size_t)cinfo.output_width * cinfo.output_height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = rgb + (size_t)cinfo.output_scanline * cinfo.output_width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+
+    *width = (int)cinfo.output_width;
+    *height = (int)cinfo.output_height;
+    jpeg_destroy_decompress(&cinfo);
+    return rgb;
+}
+
+double jpeg_psnr(const uint32_t * bgrx, const uint8_t * rgb, int width, int height)
+{
+    double se = 0;
+    int i;
+
+    for (i = 0; i < width * height; i++) {
+        int r = (int)(bgrx[i] >> 16 & 0xff) - rgb[i * 3];
+        int g = (int)(bgrx[i] >> 8 & 0xff) - rgb[i * 3 + 1];
+        int b = (int)(bgrx[i] & 0xff) - rgb[i * 3 + 2];
+        se += r * r + g * g + b * b;
+    }
+    if (se == 0)
+        return 99;
+    return 10 * log10(255.0 * 255.0 * 3 * width * height / se);
+}
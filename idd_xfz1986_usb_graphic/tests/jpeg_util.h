@@ -0,0 +1,37 @@
+/**
+ * jpeg_util.h
+ *
+ * Helpers shared by the benchmark and the tests: the packetized output of
+ * the encoder turned back into a plain JPEG, a reference decode through
+ * libjpeg and the PSNR of the result.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// the bitblt command header the driver writes in front of the JPEG
+#define CMD_HEADER_BYTES 16
+// header byte of every packet after the first, USBDISP_CMD_BITBLT
+#define CMD_PACKET_HEADER 2
+
+// copies the message bytes in[from..len) of a packetized stream to out, leaving
+// out the header byte that opens every packet after the first. returns the
+// bytes written
+int jpeg_unpacketize(const uint8_t * in, int from, int len, int packet_size, uint8_t * out);
+
+// decodes with libjpeg into tightly packed RGB, malloc'ed. NULL if libjpeg
+// fails or warns about the stream, e.g. for a corrupt entropy-coded segment
+uint8_t * jpeg_decode_rgb(const uint8_t * jpg, int len, int * width, int * height);
+
+// PSNR in dB of the decoded RGB against the BGRX source, 99 when identical
+double jpeg_psnr(const uint32_t * bgrx, const uint8_t * rgb, int width, int height);
+
+#ifdef __cplusplus
+}  // extern C
+#endif
@@ -0,0 +1,24 @@
+/**
+ * msvc_compat.h
+ *
+ * Force-included into every file of the Linux build in this directory.
+ *
+ * tiny_jpeg.h spells its fixed-width types the MSVC way and relies on the
+ * C headers windows.h pulls in; this supplies both for gcc and clang.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define __int8 char
+#define __int16 short
+#define __int32 int
+#if defined(__LP64__)
+#define __int64 long
+#else
+#define __int64 long long
+#endif
@@ -0,0 +1,202 @@
+/**
+ * slice_pool.c
+ *
+ * See slice_pool.h
+ */
+
+#include <pthread.h>
+
+#include "../tiny_jpeg.h"
+#include "slice_pool.h"
+
+struct slice_pool {
+    int threads;
+    pthread_t tid[SLICE_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned generation;    // bumped for every frame the workers pick up
+    int busy;               // workers still on the frame
+    int quit;
+
+    // the frame, as jpg_slice_job_t
+    tje_encoder_t * enc;
+    const uint8_t * src;
+    int width;
+    int height;
+    int pitch;
+    int quality;
+    int subsampling;
+    int rows;
+    int count;
+    int next;
+    uint8_t * buf[SLICE_MAX_THREADS];
+    int len[SLICE_MAX_THREADS];
+};
+
+// take slices until none are left, run_jpeg_slices() of Driver.cpp
+static void slice_pool_run(slice_pool_t * pool)
+{
+    for (;;) {
+        int i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_SEQ_CST);
+        if (i >= pool->count)
+            break;
+        int first = pool->rows * i / pool->count;
+        int num = pool->rows * (i + 1) / pool->count - first;
+        stream_mgr_t out = { pool->buf[i], JPEG_MAX_SIZE, 0 };
+        if (tje_encoder_encode_rows_to_ctx(pool->enc, &out, pool->width, pool->height, TJE_BGRX, pool->src,
+                                           pool->pitch, pool->quality, pool->subsampling, first, num))
+            pool->len[i] = out.dp;
+        else
+            pool->len[i] = -1;
+    }
+}
+
+static void * slice_pool_worker(void * arg)
+{
+    slice_pool_t * pool = (slice_pool_t *)arg;
+    unsigned seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->quit && pool->generation == seen)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        seen = pool->generation;
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        slice_pool_run(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+slice_pool_t * slice_pool_create(int threads)
+{
+    slice_pool_t * pool;
+    int i;
+
+    if (threads < 1 || threads > SLICE_MAX_THREADS)
+        return NULL;
+    pool = (slice_pool_t *)calloc(1, sizeof(slice_pool_t));
+    if (pool == NULL)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < threads; i++) {
+        pool->buf[i] = (uint8_t *)malloc(JPEG_MAX_SIZE);
+        if (pool->buf[i] == NULL) {
+            slice_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    // workers 1..threads-1, the caller is the first
+    for (pool->threads = 1; pool->threads < threads; pool->threads++) {
+        if (pthread_create(&pool->tid[pool->threads], NULL, slice_pool_worker, pool)) {
+            slice_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void slice_pool_destroy(slice_pool_t * pool)
+{
+    int i;
+
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 1; i < pool->threads; i++)
+        pthread_join(pool->tid[i], NULL);
+
+    for (i = 0; i < SLICE_MAX_THREADS; i++)
+        free(pool->buf[i]);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// append to a stream_mgr_t, starting a new packet with its header byte at
+// every packet boundary. stream_mgr_write() of Driver.cpp
+static int slice_stream_write(stream_mgr_t * mgr, const uint8_t * data, int len)
+{
+    while (len > 0) {
+        int n = len;
+        if (mgr->packet_size) {
+            int room = mgr->packet_size - mgr->dp % mgr->packet_size;
+            if (room == mgr->packet_size && mgr->dp > 0) {
+                if (mgr->dp + 1 >= mgr->max)
+                    return 0;
+                mgr->data[mgr->dp++] = mgr->packet_header;
+                room--;
+            }
+            if (n > room)
+                n = room;
+        }
+        if (mgr->dp + n >= mgr->max)
+            return 0;
+        memcpy(&mgr->data[mgr->dp], data, n);
+        mgr->dp += n;
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int slice_pool_encode(slice_pool_t * pool, tje_encoder_t * enc, void * ctx, int width, int height,
+                      const uint8_t * src, int pitch, int quality, int subsampling)
+{
+    stream_mgr_t * mgr = (stream_mgr_t *)ctx;
+    int cols, rows, i;
+
+    tje_mcu_grid(width, height, subsampling, &cols, &rows);
+    // one restart segment per MCU row, so any row can start a slice
+    tje_encoder_set_restart_interval(enc, cols);
+    // the header also builds the quality tables, it must come before the workers start
+    if (!tje_encoder_encode_header_to_ctx(enc, mgr, width, height, quality, subsampling))
+        return 0;
+
+    pool->enc = enc;
+    pool->src = src;
+    pool->width = width;
+    pool->height = height;
+    pool->pitch = pitch;
+    pool->quality = quality;
+    pool->subsampling = subsampling;
+    pool->rows = rows;
+    pool->count = (rows < pool->threads) ? rows : pool->threads;
+    pool->next = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy = pool->threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    slice_pool_run(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->count; i++) {
+        if (pool->len[i] < 0 || !slice_stream_write(mgr, pool->buf[i], pool->len[i]))
+            return 0;
+    }
+    return 1;
+}
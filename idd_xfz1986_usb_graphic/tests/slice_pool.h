@@ -0,0 +1,37 @@
+/**
+ * slice_pool.h
+ *
+ * SwapChainProcessor::encode_jpeg_slices() on pthreads, for the benchmark
+ * and the tests: the frame header into the message, then the MCU rows cut
+ * into one slice per thread, encoded on a pool of persistent threads and
+ * appended behind the header packet by packet.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define SLICE_MAX_THREADS 8
+
+typedef struct slice_pool slice_pool_t;
+// tiny_jpeg.h is not include-guarded, Driver.h refers to the encoder the same way
+struct TJEEncoder;
+
+// threads counts the caller, which encodes a slice too. NULL on failure
+slice_pool_t * slice_pool_create(int threads);
+void slice_pool_destroy(slice_pool_t * pool);
+
+// ctx is the stream_mgr_t of the message. sets the restart interval of enc
+// to one MCU row, as the driver does. returns 0 if a slice failed or the
+// message is full
+int slice_pool_encode(slice_pool_t * pool, struct TJEEncoder * enc, void * ctx, int width, int height,
+                      const uint8_t * src, int pitch, int quality, int subsampling);
+
+#ifdef __cplusplus
+}  // extern C
+#endif
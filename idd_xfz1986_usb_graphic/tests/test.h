@@ -0,0 +1,61 @@
+/**
+ * test.h
+ *
+ * The unit tests of the portable sources. Each test is a void function in
+ * its own test_*.c file, listed once in TEST_LIST; test_main.c runs them all
+ * and fails when any CHECK did.
+ *
+ * tiny_jpeg.h turns assert() into a no-op, so tests use CHECK.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TEST_LIST(X) \
+    X(simd_levels_identical) \
+    X(bgrx_matches_rgb) \
+    X(subsampling_decodes) \
+    X(restart_markers) \
+    X(slices_match_single) \
+    X(bitwriter_bounds) \
+    X(bitwriter_stuffing) \
+    X(packetized_matches_plain) \
+    X(huffman_optimized) \
+    X(quality_floors) \
+    X(rate_prediction) \
+    X(readback_pipeline) \
+    X(readback_replace_and_drop) \
+    X(dirty_rect_random) \
+    X(dirty_rect_merge) \
+    X(tile_diff_sequences) \
+    X(tile_diff_hint) \
+    X(frame_pipe_ring) \
+    X(frame_pipe_stress)
+
+#define TEST_DECLARE(name) void test_##name(void);
+TEST_LIST(TEST_DECLARE)
+#undef TEST_DECLARE
+
+extern int test_checks;
+extern int test_failures;
+
+#define CHECK(cond) do { \
+        test_checks++; \
+        if (!(cond)) { \
+            test_failures++; \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+// CHECK with the case that failed, for checks inside loops over sizes and modes
+#define CHECK_MSG(cond, ...) do { \
+        test_checks++; \
+        if (!(cond)) { \
+            test_failures++; \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+        } \
+    } while (0)
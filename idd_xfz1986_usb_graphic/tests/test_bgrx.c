@@ -0,0 +1,77 @@
+/**
+ * test_bgrx.c
+ *
+ * BGRX frames read in place, with a pitch wider than the row, against the
+ * same pixels as packed RGB and RGBA: the colour conversion must not change
+ * a byte of the JPEG, with or without the SSE2 block loader.
+ */
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "test.h"
+
+#define BGRX_MAX_BYTES (320 * 240 * 4)
+// a pitch padded like a GPU surface, the padding filled with junk
+#define BGRX_PAD_PIXELS 13
+
+static const int bgrx_sizes[][2] = { { 320, 240 }, { 101, 37 }, { 7, 5 } };
+
+static int bgrx_encode(tje_encoder_t * enc, uint8_t * out, int width, int height, int format,
+                       const uint8_t * src, int pitch, int subsampling)
+{
+    stream_mgr_t mgr = { out, BGRX_MAX_BYTES, 0 };
+    if (!tje_encoder_encode_to_ctx(enc, &mgr, width, height, format, src, pitch, 75, subsampling))
+        return 0;
+    return mgr.dp;
+}
+
+void test_bgrx_matches_rgb(void)
+{
+    static uint32_t px[320 * 240];
+    static uint32_t padded[(320 + BGRX_PAD_PIXELS) * 240];
+    static uint8_t rgb[320 * 240 * 3];
+    static uint8_t rgba[320 * 240 * 4];
+    static uint8_t ref[BGRX_MAX_BYTES];
+    static uint8_t out[BGRX_MAX_BYTES];
+    tje_encoder_t * enc = tje_encoder_create();
+    int s, k, sub, simd, i, x, y;
+
+    for (s = 0; s < (int)(sizeof(bgrx_sizes) / sizeof(bgrx_sizes[0])); s++) {
+        int width = bgrx_sizes[s][0];
+        int height = bgrx_sizes[s][1];
+        int pitch = width + BGRX_PAD_PIXELS;
+        for (k = 0; k < CORPUS_KINDS; k++) {
+            corpus_frame(px, width, height, k, 1);
+            for (i = 0; i < width * height; i++) {
+                rgb[i * 3] = rgba[i * 4] = px[i] >> 16 & 0xff;
+                rgb[i * 3 + 1] = rgba[i * 4 + 1] = px[i] >> 8 & 0xff;
+                rgb[i * 3 + 2] = rgba[i * 4 + 2] = px[i] & 0xff;
+                rgba[i * 4 + 3] = (uint8_t)i;
+            }
+            for (y = 0; y < height; y++)
+                for (x = 0; x < pitch; x++)
+                    padded[y * pitch + x] = x < width ? px[y * width + x] : 0xdeadbeef;
+
+            for (sub = 0; sub < 3; sub++) {
+                int ref_len;
+
+                tje_set_simd_level(TJE_SIMD_NONE);
+                ref_len = bgrx_encode(enc, ref, width, height, TJE_RGB, rgb, width * 3, sub);
+                CHECK(ref_len > 0);
+                for (simd = TJE_SIMD_NONE; simd <= TJE_SIMD_AVX2; simd++) {
+                    int len;
+                    tje_set_simd_level(simd);
+                    len = bgrx_encode(enc, out, width, height, TJE_BGRX, (const uint8_t *)padded, pitch * 4, sub);
+                    CHECK_MSG(len == ref_len && !memcmp(out, ref, len), "bgrx %dx%d %s sub %d simd %d",
+                              width, height, corpus_names[k], sub, simd);
+                    len = bgrx_encode(enc, out, width, height, TJE_RGBA, rgba, width * 4, sub);
+                    CHECK_MSG(len == ref_len && !memcmp(out, ref, len), "rgba %dx%d %s sub %d simd %d",
+                              width, height, corpus_names[k], sub, simd);
+                }
+            }
+        }
+    }
+
+    tje_set_simd_level(TJE_SIMD_AVX2);
+    tje_encoder_destroy(enc);
+}
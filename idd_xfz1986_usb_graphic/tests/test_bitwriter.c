@@ -0,0 +1,93 @@
+/**
+ * test_bitwriter.c
+ *
+ * The entropy coder writing straight into the caller's span: a frame that
+ * does not fit fails without a byte past max, one that just fits comes out
+ * whole, and dense 0xff stuffing still decodes.
+ */
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "jpeg_util.h"
+#include "test.h"
+
+#define BITS_WIDTH 320
+#define BITS_HEIGHT 240
+#define BITS_MAX_BYTES (BITS_WIDTH * BITS_HEIGHT * 4)
+#define BITS_CANARY 0x5a
+
+static const int bits_packets[] = { 0, 64, 512 };
+
+void test_bitwriter_bounds(void)
+{
+    static uint32_t px[BITS_WIDTH * BITS_HEIGHT];
+    static uint8_t ref[BITS_MAX_BYTES];
+    static uint8_t out[BITS_MAX_BYTES];
+    tje_encoder_t * enc = tje_encoder_create();
+    int k, p, i;
+
+    for (k = 0; k < CORPUS_KINDS; k++) {
+        corpus_frame(px, BITS_WIDTH, BITS_HEIGHT, k, 0);
+        for (p = 0; p < 3; p++) {
+            int packet_size = bits_packets[p];
+            int start = packet_size ? CMD_HEADER_BYTES : 0;
+            stream_mgr_t mgr = { ref, BITS_MAX_BYTES, start, packet_size, CMD_PACKET_HEADER };
+            int full, max;
+
+            CHECK(tje_encoder_encode_to_ctx(enc, &mgr, BITS_WIDTH, BITS_HEIGHT, TJE_BGRX, (const unsigned char *)px,
+                                            BITS_WIDTH * 4, 95, TJE_SUBSAMPLING_444));
+            full = mgr.dp;
+
+            // the last byte of the span stays unused, so full + 1 is the least max that works
+            for (max = start + 1; max <= full + 1; max += (max < full - 64) ? (full - start) / 7 : 1) {
+                int ok;
+
+                memset(out, BITS_CANARY, sizeof(out));
+                mgr.data = out;
+                mgr.max = max;
+                mgr.dp = start;
+                ok = tje_encoder_encode_to_ctx(enc, &mgr, BITS_WIDTH, BITS_HEIGHT, TJE_BGRX,
+                                               (const unsigned char *)px, BITS_WIDTH * 4, 95, TJE_SUBSAMPLING_444);
+                CHECK_MSG(ok == (max > full), "%s packet %d max %d of %d", corpus_names[k], packet_size, max, full);
+                for (i = max; i < BITS_MAX_BYTES && out[i] == BITS_CANARY; i++)
+                    ;
+                CHECK_MSG(i == BITS_MAX_BYTES, "%s packet %d max %d: byte %d written", corpus_names[k],
+                          packet_size, max, i);
+                if (ok)
+                    CHECK(mgr.dp == full && !memcmp(out + start, ref + start, full - start));
+            }
+        }
+    }
+
+    tje_encoder_destroy(enc);
+}
+
+void test_bitwriter_stuffing(void)
+{
+    static uint32_t px[BITS_WIDTH * BITS_HEIGHT];
+    static uint8_t jpg[BITS_MAX_BYTES * 2];
+    tje_encoder_t * enc = tje_encoder_create();
+    uint32_t state = 1;
+    int i, ff = 0, dw, dh;
+    stream_mgr_t mgr = { jpg, sizeof(jpg), 0 };
+    uint8_t * rgb;
+
+    // white noise at full quality codes long runs of ones, so 0xff bytes to stuff.
+    // it is larger than the raw pixels
+    for (i = 0; i < BITS_WIDTH * BITS_HEIGHT; i++) {
+        state = state * 1103515245u + 12345u;
+        px[i] = state >> 8;
+    }
+    CHECK(tje_encoder_encode_to_ctx(enc, &mgr, BITS_WIDTH, BITS_HEIGHT, TJE_BGRX, (const unsigned char *)px,
+                                    BITS_WIDTH * 4, 100, TJE_SUBSAMPLING_444));
+    for (i = 0; i + 1 < mgr.dp; i++)
+        ff += jpg[i] == 0xff && jpg[i + 1] == 0x00;
+    CHECK_MSG(ff > 1000, "%d stuffed bytes", ff);
+
+    rgb = jpeg_decode_rgb(jpg, mgr.dp, &dw, &dh);
+    CHECK(rgb && dw == BITS_WIDTH && dh == BITS_HEIGHT);
+    if (rgb)
+        CHECK(jpeg_psnr(px, rgb, BITS_WIDTH, BITS_HEIGHT) > 30);
+    free(rgb);
+    tje_encoder_destroy(enc);
+}
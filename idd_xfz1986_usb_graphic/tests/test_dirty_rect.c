@@ -0,0 +1,161 @@
+/**
+ * test_dirty_rect.c
+ *
+ * The dirty rectangle set: aligned, clipped, never more than
+ * DIRTY_MAX_RECTS rectangles, never overlapping, and always covering every
+ * pixel added to it, checked against a coverage map over random updates.
+ */
+
+#include "../dirty_rect.h"
+#include "test.h"
+
+#define DR_WIDTH 1024
+#define DR_HEIGHT 600
+
+static uint32_t dr_state = 7;
+
+static int dr_rand(int n)
+{
+    dr_state = dr_state * 1103515245u + 12345u;
+    return (int)((dr_state >> 8) % (unsigned int)n);
+}
+
+static int dr_aligned(int v, int limit)
+{
+    return v % DIRTY_ALIGN == 0 || v == limit;
+}
+
+// the invariants of set for a frame, with added marking every pixel that was added to it
+static int dr_check(const dirty_set_t * set, const uint8_t * added, int width, int height)
+{
+    static uint8_t covered[DR_WIDTH * DR_HEIGHT];
+    long area = 0;
+    int i, j, x, y;
+
+    if (set->count < 0 || set->count > DIRTY_MAX_RECTS)
+        return 0;
+    memset(covered, 0, sizeof(covered));
+    for (i = 0; i < set->count; i++) {
+        const dirty_rect_t * r = &set->r[i];
+        if (r->left < 0 || r->top < 0 || r->right > width || r->bottom > height ||
+            r->left >= r->right || r->top >= r->bottom)
+            return 0;
+        if (!dr_aligned(r->left, width) || !dr_aligned(r->top, height) ||
+            !dr_aligned(r->right, width) || !dr_aligned(r->bottom, height))
+            return 0;
+        for (j = 0; j < i; j++) {
+            const dirty_rect_t * o = &set->r[j];
+            if (r->left < o->right && o->left < r->right && r->top < o->bottom && o->top < r->bottom)
+                return 0;
+        }
+        for (y = r->top; y < r->bottom; y++)
+            for (x = r->left; x < r->right; x++)
+                covered[y * width + x] = 1;
+        area += (long)(r->right - r->left) * (r->bottom - r->top);
+    }
+    if (area != dirty_area(set))
+        return 0;
+    for (i = 0; i < width * height; i++) {
+        if (added[i] && !covered[i])
+            return 0;
+    }
+    return 1;
+}
+
+static void dr_add(dirty_set_t * set, uint8_t * added, int left, int top, int right, int bottom,
+                   int width, int height)
+{
+    int x, y;
+
+    dirty_add(set, left, top, right, bottom, width, height);
+    for (y = top < 0 ? 0 : top; y < bottom && y < height; y++)
+        for (x = left < 0 ? 0 : left; x < right && x < width; x++)
+            added[y * width + x] = 1;
+}
+
+void test_dirty_rect_random(void)
+{
+    static uint8_t added[DR_WIDTH * DR_HEIGHT];
+    static const int frames[][2] = { { 1024, 600 }, { 1000, 599 }, { 40, 24 } };
+    dirty_set_t set;
+    int f, round, i;
+
+    for (f = 0; f < 3; f++) {
+        int width = frames[f][0];
+        int height = frames[f][1];
+        for (round = 0; round < 200; round++) {
+            int n = 1 + dr_rand(12);
+            dirty_clear(&set);
+            memset(added, 0, sizeof(added));
+            for (i = 0; i < n; i++) {
+                // small updates like a caret or a clock, larger windows, and some off the frame
+                int w = dr_rand(4) ? 1 + dr_rand(40) : 1 + dr_rand(width);
+                int h = dr_rand(4) ? 1 + dr_rand(30) : 1 + dr_rand(height);
+                int x = dr_rand(width + 40) - 20;
+                int y = dr_rand(height + 40) - 20;
+                dr_add(&set, added, x, y, x + w, y + h, width, height);
+                CHECK_MSG(dr_check(&set, added, width, height), "%dx%d round %d add %d", width, height, round, i);
+            }
+        }
+    }
+}
+
+void test_dirty_rect_merge(void)
+{
+    static uint8_t added[DR_WIDTH * DR_HEIGHT];
+    dirty_set_t set, other;
+
+    // aligned outward and clipped
+    dirty_clear(&set);
+    dirty_add(&set, 17, 5, 18, 6, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, 1020, 590, 1100, 700, DR_WIDTH, DR_HEIGHT);
+    CHECK(set.count == 2);
+    CHECK(set.r[0].left == 16 && set.r[0].top == 0 && set.r[0].right == 32 && set.r[0].bottom == 16);
+    CHECK(set.r[1].left == 1008 && set.r[1].top == 576 && set.r[1].right == DR_WIDTH && set.r[1].bottom == DR_HEIGHT);
+
+    // empty and off-frame rectangles are ignored
+    dirty_add(&set, 100, 100, 100, 200, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, 2000, 100, 2100, 200, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, -50, -50, -10, -10, DR_WIDTH, DR_HEIGHT);
+    CHECK(set.count == 2);
+
+    // edge to edge of the same span is one rectangle
+    dirty_clear(&set);
+    dirty_add(&set, 0, 0, 64, 32, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, 64, 0, 128, 32, DR_WIDTH, DR_HEIGHT);
+    CHECK(set.count == 1 && set.r[0].right == 128 && dirty_area(&set) == 128 * 32);
+
+    // one that bridges two folds them all into one
+    dirty_add(&set, 512, 0, 576, 32, DR_WIDTH, DR_HEIGHT);
+    CHECK(set.count == 2);
+    dirty_add(&set, 100, 16, 530, 20, DR_WIDTH, DR_HEIGHT);
+    CHECK(set.count == 1 && set.r[0].left == 0 && set.r[0].right == 576 && set.r[0].bottom == 32);
+
+    // full: the new one joins the rectangle it wastes the least area with
+    dirty_clear(&set);
+    dirty_add(&set, 0, 0, 16, 16, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, 1008, 0, 1024, 16, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, 0, 576, 16, 592, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, 1008, 576, 1024, 592, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, 32, 0, 48, 16, DR_WIDTH, DR_HEIGHT);
+    CHECK(set.count == DIRTY_MAX_RECTS);
+    CHECK(dirty_area(&set) == 48 * 16 + 3 * 16 * 16);
+
+    // dirty_merge() is dirty_add() of each rectangle
+    memset(added, 0, sizeof(added));
+    dirty_clear(&other);
+    dr_add(&other, added, 200, 200, 300, 300, DR_WIDTH, DR_HEIGHT);
+    dr_add(&other, added, 0, 0, 16, 16, DR_WIDTH, DR_HEIGHT);
+    dirty_merge(&other, &set, DR_WIDTH, DR_HEIGHT);
+    CHECK(other.count <= DIRTY_MAX_RECTS && dirty_area(&other) >= dirty_area(&set) + 112 * 112);
+    CHECK(dr_check(&other, added, DR_WIDTH, DR_HEIGHT));
+
+    // dirty_remove() keeps the order of the others
+    dirty_clear(&set);
+    dirty_add(&set, 0, 0, 16, 16, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, 100, 100, 116, 116, DR_WIDTH, DR_HEIGHT);
+    dirty_add(&set, 300, 300, 316, 316, DR_WIDTH, DR_HEIGHT);
+    dirty_remove(&set, 1);
+    dirty_remove(&set, 5);
+    CHECK(set.count == 2 && set.r[0].left == 0 && set.r[1].left == 288);
+}
@@ -0,0 +1,180 @@
+/**
+ * test_frame_pipe.c
+ *
+ * The pipeline rings: full and empty, FIFO order across index wrap-around,
+ * the stage statistics, and a capture / encode / transmit stress run on
+ * three threads with fake stages that recycle preallocated frames and URBs
+ * the way RunCore, RunEncode and RunSend do.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../frame_pipe.h"
+#include "test.h"
+
+#define PIPE_SLOTS 4
+#define PIPE_ITEMS 200000
+// frame and URB objects in flight, as the driver preallocates them
+#define PIPE_OBJECTS 2
+
+void test_frame_pipe_ring(void)
+{
+    void * slot[PIPE_SLOTS];
+    pipe_ring_t q;
+    int item[PIPE_SLOTS + 1];
+    int i;
+
+    pipe_ring_init(&q, slot, PIPE_SLOTS);
+    CHECK(pipe_ring_pop(&q) == NULL && q.empty == 1);
+    CHECK(pipe_ring_count(&q) == 0);
+
+    for (i = 0; i < PIPE_SLOTS; i++)
+        CHECK(pipe_ring_push(&q, &item[i]));
+    CHECK(!pipe_ring_push(&q, &item[PIPE_SLOTS]) && q.full == 1);
+    CHECK(pipe_ring_count(&q) == PIPE_SLOTS);
+
+    // first in, first out; each pop sees what was queued with its own item
+    for (i = 0; i < PIPE_SLOTS; i++) {
+        CHECK(pipe_ring_pop(&q) == &item[i]);
+        CHECK(pipe_ring_count(&q) == (unsigned int)(PIPE_SLOTS - 1 - i));
+    }
+    CHECK(pipe_ring_pop(&q) == NULL && q.empty == 2);
+    CHECK(q.items == PIPE_SLOTS && q.occupancy_max == PIPE_SLOTS);
+    CHECK(q.occupancy_sum == PIPE_SLOTS * (PIPE_SLOTS + 1) / 2);
+
+    pipe_ring_done(&q, 30, 100);
+    pipe_ring_done(&q, 10, 300);
+    CHECK(q.wait_us == 40 && q.work_us == 400 && q.wait_max_us == 30 && q.work_max_us == 300);
+    pipe_ring_reset_stat(&q);
+    CHECK(q.items == 0 && q.empty == 0 && q.occupancy_max == 0 && q.occupancy_sum == 0);
+    CHECK(q.wait_us == 0 && q.work_us == 0 && q.wait_max_us == 0 && q.work_max_us == 0);
+    CHECK(q.full == 1);
+
+    // the indices run free and wrap past 2^32
+    q.head = q.tail = 0xfffffffeu;
+    for (i = 0; i < PIPE_SLOTS; i++)
+        CHECK(pipe_ring_push(&q, &item[i]));
+    CHECK(!pipe_ring_push(&q, &item[PIPE_SLOTS]));
+    CHECK(pipe_ring_count(&q) == PIPE_SLOTS);
+    for (i = 0; i < PIPE_SLOTS; i++)
+        CHECK(pipe_ring_pop(&q) == &item[i]);
+    CHECK(pipe_ring_count(&q) == 0 && pipe_ring_pop(&q) == NULL);
+}
+
+typedef struct {
+    unsigned int seq;
+    unsigned int sum;
+} pipe_obj_t;
+
+typedef struct {
+    void * slot[4][PIPE_SLOTS];
+    pipe_ring_t capture_free;   // frames back to capture
+    pipe_ring_t encode_q;       // captured frames
+    pipe_ring_t urb_free;       // URBs back to encode
+    pipe_ring_t send_q;         // encoded URBs
+    pipe_obj_t frame[PIPE_OBJECTS];
+    pipe_obj_t urb[PIPE_OBJECTS];
+    int errors;
+} pipe_test_t;
+
+// stands in for the work of a stage, so the rings run full and empty in turn
+static unsigned int pipe_work(unsigned int x, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        x = x * 1103515245u + 12345u;
+    return x;
+}
+
+static void pipe_put(pipe_ring_t * q, void * item)
+{
+    while (!pipe_ring_push(q, item))
+        sched_yield();
+}
+
+static void * pipe_take(pipe_ring_t * q)
+{
+    void * item;
+    while ((item = pipe_ring_pop(q)) == NULL)
+        sched_yield();
+    return item;
+}
+
+static void * pipe_encode(void * arg)
+{
+    pipe_test_t * t = (pipe_test_t *)arg;
+    unsigned int seq;
+
+    for (seq = 0; seq < PIPE_ITEMS; seq++) {
+        pipe_obj_t * f = (pipe_obj_t *)pipe_take(&t->encode_q);
+        pipe_obj_t * u = (pipe_obj_t *)pipe_take(&t->urb_free);
+        if (f->seq != seq || f->sum != pipe_work(seq, 1))
+            __atomic_add_fetch(&t->errors, 1, __ATOMIC_RELAXED);
+        u->seq = f->seq;
+        u->sum = pipe_work(f->sum, 20);
+        pipe_put(&t->capture_free, f);
+        pipe_put(&t->send_q, u);
+    }
+    return NULL;
+}
+
+static void * pipe_transmit(void * arg)
+{
+    pipe_test_t * t = (pipe_test_t *)arg;
+    unsigned int seq;
+
+    for (seq = 0; seq < PIPE_ITEMS; seq++) {
+        pipe_obj_t * u = (pipe_obj_t *)pipe_take(&t->send_q);
+        if (u->seq != seq || u->sum != pipe_work(pipe_work(seq, 1), 20))
+            __atomic_add_fetch(&t->errors, 1, __ATOMIC_RELAXED);
+        pipe_put(&t->urb_free, u);
+    }
+    return NULL;
+}
+
+void test_frame_pipe_stress(void)
+{
+    static pipe_test_t t;
+    pthread_t encode, transmit;
+    struct timespec t0, t1;
+    unsigned int seq;
+    double s;
+    int i;
+
+    memset(&t, 0, sizeof(t));
+    pipe_ring_init(&t.capture_free, t.slot[0], PIPE_SLOTS);
+    pipe_ring_init(&t.encode_q, t.slot[1], PIPE_SLOTS);
+    pipe_ring_init(&t.urb_free, t.slot[2], PIPE_SLOTS);
+    pipe_ring_init(&t.send_q, t.slot[3], PIPE_SLOTS);
+    for (i = 0; i < PIPE_OBJECTS; i++) {
+        pipe_ring_push(&t.capture_free, &t.frame[i]);
+        pipe_ring_push(&t.urb_free, &t.urb[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    CHECK(!pthread_create(&encode, NULL, pipe_encode, &t));
+    CHECK(!pthread_create(&transmit, NULL, pipe_transmit, &t));
+    // capture on this thread
+    for (seq = 0; seq < PIPE_ITEMS; seq++) {
+        pipe_obj_t * f = (pipe_obj_t *)pipe_take(&t.capture_free);
+        f->seq = seq;
+        f->sum = pipe_work(seq, 1);
+        pipe_put(&t.encode_q, f);
+    }
+    pthread_join(encode, NULL);
+    pthread_join(transmit, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("  %d items through 3 stages in %.3f s, %.2f M/s; encode queue %.2f deep on average, full %u times\n",
+           PIPE_ITEMS, s, PIPE_ITEMS / s / 1e6, (double)t.encode_q.occupancy_sum / t.encode_q.items,
+           t.encode_q.full);
+    CHECK_MSG(t.errors == 0, "%d items out of order or corrupted", t.errors);
+    CHECK(t.encode_q.items == PIPE_ITEMS && t.send_q.items == PIPE_ITEMS);
+    // every object came home
+    CHECK(pipe_ring_count(&t.capture_free) == PIPE_OBJECTS && pipe_ring_count(&t.urb_free) == PIPE_OBJECTS);
+    CHECK(pipe_ring_count(&t.encode_q) == 0 && pipe_ring_count(&t.send_q) == 0);
+    CHECK(t.encode_q.occupancy_max <= PIPE_OBJECTS && t.send_q.occupancy_max <= PIPE_OBJECTS);
+}
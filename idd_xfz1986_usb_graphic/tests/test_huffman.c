@@ -0,0 +1,83 @@
+/**
+ * test_huffman.c
+ *
+ * Optimized Huffman tables: frames coded with the tables of the frame
+ * before decode to the same pixels as with the Annex K tables, in fewer
+ * bytes, on the single and the sliced path.
+ */
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "jpeg_util.h"
+#include "slice_pool.h"
+#include "test.h"
+
+#define HUFF_WIDTH 640
+#define HUFF_HEIGHT 480
+#define HUFF_MAX_BYTES (HUFF_WIDTH * HUFF_HEIGHT * 4)
+#define HUFF_FRAMES 4
+
+// encodes px at q85 into out, sliced when pool is set. returns the bytes, 0 on failure
+static int huff_encode(tje_encoder_t * enc, slice_pool_t * pool, uint8_t * out, const uint32_t * px, int sub)
+{
+    stream_mgr_t mgr = { out, HUFF_MAX_BYTES, 0 };
+    int ok;
+
+    if (pool)
+        ok = slice_pool_encode(pool, enc, &mgr, HUFF_WIDTH, HUFF_HEIGHT, (const uint8_t *)px, HUFF_WIDTH * 4, 85, sub);
+    else
+        ok = tje_encoder_encode_to_ctx(enc, &mgr, HUFF_WIDTH, HUFF_HEIGHT, TJE_BGRX, (const unsigned char *)px,
+                                       HUFF_WIDTH * 4, 85, sub);
+    return ok ? mgr.dp : 0;
+}
+
+void test_huffman_optimized(void)
+{
+    static uint32_t px[HUFF_WIDTH * HUFF_HEIGHT];
+    static uint8_t ref[HUFF_MAX_BYTES];
+    static uint8_t out[HUFF_MAX_BYTES];
+    slice_pool_t * pool = slice_pool_create(3);
+    int sliced, k, sub, i;
+
+    CHECK(pool != NULL);
+    for (sliced = 0; sliced < 2; sliced++) {
+        for (k = 0; k < CORPUS_KINDS; k++) for (sub = 0; sub < 3; sub++) {
+            tje_encoder_t * plain = tje_encoder_create();
+            tje_encoder_t * opt = tje_encoder_create();
+            long long plain_bytes = 0, opt_bytes = 0;
+
+            tje_encoder_set_optimize_huffman(opt, 1);
+            for (i = 0; i < HUFF_FRAMES; i++) {
+                int ref_len, len, rw, rh, dw, dh;
+                uint8_t * ref_rgb;
+                uint8_t * rgb;
+
+                corpus_frame(px, HUFF_WIDTH, HUFF_HEIGHT, k, i);
+                ref_len = huff_encode(plain, sliced ? pool : NULL, ref, px, sub);
+                len = huff_encode(opt, sliced ? pool : NULL, out, px, sub);
+                CHECK(ref_len > 0 && len > 0);
+                // the first frame has no counts yet and goes out with the default tables
+                if (i == 0)
+                    CHECK_MSG(len == ref_len && !memcmp(out, ref, len), "%s sub %d sliced %d",
+                              corpus_names[k], sub, sliced);
+                plain_bytes += ref_len;
+                opt_bytes += len;
+
+                ref_rgb = jpeg_decode_rgb(ref, ref_len, &rw, &rh);
+                rgb = jpeg_decode_rgb(out, len, &dw, &dh);
+                CHECK_MSG(ref_rgb && rgb && dw == HUFF_WIDTH && dh == HUFF_HEIGHT &&
+                          !memcmp(rgb, ref_rgb, HUFF_WIDTH * HUFF_HEIGHT * 3), "%s sub %d sliced %d frame %d",
+                          corpus_names[k], sub, sliced, i);
+                free(ref_rgb);
+                free(rgb);
+            }
+            CHECK_MSG(opt_bytes < plain_bytes, "%s sub %d sliced %d: %lld bytes, %lld with default tables",
+                      corpus_names[k], sub, sliced, opt_bytes, plain_bytes);
+
+            tje_encoder_destroy(opt);
+            tje_encoder_destroy(plain);
+        }
+    }
+
+    slice_pool_destroy(pool);
+}
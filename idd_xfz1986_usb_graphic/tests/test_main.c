@@ -0,0 +1,42 @@
+/**
+ * test_main.c
+ *
+ * Runs every test of TEST_LIST, or the ones named on the command line.
+ */
+
+#include <string.h>
+
+#include "test.h"
+
+int test_checks;
+int test_failures;
+
+typedef struct {
+    const char * name;
+    void (*run)(void);
+} test_entry_t;
+
+#define TEST_ENTRY(name) { #name, test_##name },
+static const test_entry_t tests[] = {
+    TEST_LIST(TEST_ENTRY)
+};
+#undef TEST_ENTRY
+
+int main(int argc, char ** argv)
+{
+    int i, j;
+
+    for (i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+        int failures = test_failures;
+        if (argc > 1) {
+            for (j = 1; j < argc && strcmp(argv[j], tests[i].name); j++)
+                ;
+            if (j == argc)
+                continue;
+        }
+        tests[i].run();
+        printf("%-32s %s\n", tests[i].name, test_failures == failures ? "ok" : "FAILED");
+    }
+    printf("%d checks, %d failed\n", test_checks, test_failures);
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,71 @@
+/**
+ * test_packetize.c
+ *
+ * The encoder writing the JPEG straight into the packetized URB message:
+ * behind the 16 byte command header, with the header byte at every packet
+ * boundary, the message must carry exactly the bytes of the plain stream.
+ */
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "jpeg_util.h"
+#include "test.h"
+
+#define PACKET_MAX_BYTES (640 * 480 * 4)
+
+static const int packet_sizes[] = { 17, 64, 512, 1023, 1024 };
+static const int packet_frames[][2] = { { 640, 480 }, { 37, 21 }, { 1, 1 } };
+
+void test_packetized_matches_plain(void)
+{
+    static uint32_t px[640 * 480];
+    static uint8_t plain[PACKET_MAX_BYTES];
+    static uint8_t msg[PACKET_MAX_BYTES];
+    static uint8_t jpg[PACKET_MAX_BYTES];
+    tje_encoder_t * enc = tje_encoder_create();
+    int s, k, p, rst, i;
+
+    for (s = 0; s < (int)(sizeof(packet_frames) / sizeof(packet_frames[0])); s++) {
+        int width = packet_frames[s][0];
+        int height = packet_frames[s][1];
+        for (k = 0; k < CORPUS_KINDS; k++) {
+            corpus_frame(px, width, height, k, 4);
+            for (rst = 0; rst < 2; rst++) {
+                stream_mgr_t ref = { plain, PACKET_MAX_BYTES, 0 };
+                int cols, rows;
+
+                tje_mcu_grid(width, height, TJE_SUBSAMPLING_420, &cols, &rows);
+                tje_encoder_set_restart_interval(enc, rst ? cols : 0);
+                CHECK(tje_encoder_encode_to_ctx(enc, &ref, width, height, TJE_BGRX, (const unsigned char *)px,
+                                                width * 4, 85, TJE_SUBSAMPLING_420));
+
+                for (p = 0; p < (int)(sizeof(packet_sizes) / sizeof(packet_sizes[0])); p++) {
+                    int ps = packet_sizes[p];
+                    stream_mgr_t mgr = { msg, PACKET_MAX_BYTES, CMD_HEADER_BYTES, ps, CMD_PACKET_HEADER };
+                    int headers = 1, len;
+
+                    memset(msg, 0, CMD_HEADER_BYTES);
+                    CHECK(tje_encoder_encode_to_ctx(enc, &mgr, width, height, TJE_BGRX, (const unsigned char *)px,
+                                                    width * 4, 85, TJE_SUBSAMPLING_420));
+                    // the command header is the driver's, the encoder starts behind it
+                    for (i = 0; i < CMD_HEADER_BYTES; i++)
+                        headers &= msg[i] == 0;
+                    for (i = ps; i < mgr.dp; i += ps)
+                        headers &= msg[i] == CMD_PACKET_HEADER;
+                    CHECK_MSG(headers, "%dx%d %s packet %d", width, height, corpus_names[k], ps);
+                    // one header byte for every packet after the first. a message ending on a boundary
+                    // gets the next one from finish_packetized_msg(), not from the encoder
+                    CHECK_MSG(mgr.dp == CMD_HEADER_BYTES + ref.dp + (mgr.dp - 1) / ps,
+                              "%dx%d %s packet %d: %d bytes for %d", width, height, corpus_names[k], ps, mgr.dp,
+                              ref.dp);
+
+                    len = jpeg_unpacketize(msg, CMD_HEADER_BYTES, mgr.dp, ps, jpg);
+                    CHECK_MSG(len == ref.dp && !memcmp(jpg, plain, len), "%dx%d %s packet %d rst %d",
+                              width, height, corpus_names[k], ps, rst);
+                }
+            }
+        }
+    }
+
+    tje_encoder_destroy(enc);
+}
@@ -0,0 +1,82 @@
+/**
+ * test_quality.c
+ *
+ * Picture quality and size per mode as libjpeg decodes them: PSNR floors
+ * and byte ceilings for every content kind, DCT and quality on a 640x480
+ * frame, and the accurate DCT never behind the fast one.
+ *
+ * The limits are measured values: the worst of the three subsampling modes,
+ * less 0.25 dB rounded down to half a dB and plus 5% rounded up to 100
+ * bytes. A change that costs quality or bytes shows up here; one that gains
+ * should move them.
+ */
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "jpeg_util.h"
+#include "test.h"
+
+#define QUAL_WIDTH 640
+#define QUAL_HEIGHT 480
+#define QUAL_MAX_BYTES (QUAL_WIDTH * QUAL_HEIGHT * 4)
+#define QUAL_LEVELS 3
+
+typedef struct {
+    double psnr;
+    int bytes;
+} qual_limit_t;
+
+static const int qual_levels[QUAL_LEVELS] = { 50, 85, 92 };
+
+// [kind][dct][quality]
+static const qual_limit_t qual_limits[CORPUS_KINDS][2][QUAL_LEVELS] = {
+    { { { 16.0, 105300 }, { 25.0, 186900 }, { 30.0, 238700 } },     // text fast
+      { { 24.0, 128500 }, { 33.0, 198600 }, { 38.5, 246500 } } },   // text islow
+    { { { 21.0, 70000 }, { 27.5, 116400 }, { 33.5, 147400 } },      // ui fast
+      { { 27.5, 82400 }, { 35.5, 126400 }, { 41.0, 154400 } } },    // ui islow
+    { { { 32.5, 15800 }, { 33.5, 57500 }, { 34.0, 113400 } },       // photo fast
+      { { 33.5, 29200 }, { 34.0, 114300 }, { 35.0, 193800 } } },    // photo islow
+    { { { 24.5, 41000 }, { 25.5, 170400 }, { 27.0, 289800 } },      // video fast
+      { { 25.0, 96400 }, { 26.5, 267600 }, { 27.5, 382400 } } },    // video islow
+    { { { 40.0, 11000 }, { 40.5, 17900 }, { 43.5, 23300 } },        // gradient fast
+      { { 43.5, 14100 }, { 49.5, 21400 }, { 50.5, 29800 } } },      // gradient islow
+};
+
+void test_quality_floors(void)
+{
+    static uint32_t px[QUAL_WIDTH * QUAL_HEIGHT];
+    static uint8_t jpg[QUAL_MAX_BYTES];
+    tje_encoder_t * enc = tje_encoder_create();
+    int k, dct, sub, qi;
+
+    for (k = 0; k < CORPUS_KINDS; k++) {
+        corpus_frame(px, QUAL_WIDTH, QUAL_HEIGHT, k, 0);
+        for (sub = 0; sub < 3; sub++) for (qi = 0; qi < QUAL_LEVELS; qi++) {
+            double psnr[2] = { 0, 0 };
+            for (dct = TJE_DCT_FAST; dct <= TJE_DCT_ISLOW; dct++) {
+                const qual_limit_t * limit = &qual_limits[k][dct][qi];
+                stream_mgr_t mgr = { jpg, QUAL_MAX_BYTES, 0 };
+                uint8_t * rgb;
+                int dw, dh;
+
+                tje_encoder_set_dct(enc, dct);
+                CHECK(tje_encoder_encode_to_ctx(enc, &mgr, QUAL_WIDTH, QUAL_HEIGHT, TJE_BGRX,
+                                                (const unsigned char *)px, QUAL_WIDTH * 4, qual_levels[qi], sub));
+                rgb = jpeg_decode_rgb(jpg, mgr.dp, &dw, &dh);
+                CHECK(rgb != NULL);
+                if (rgb)
+                    psnr[dct] = jpeg_psnr(px, rgb, QUAL_WIDTH, QUAL_HEIGHT);
+                free(rgb);
+
+                CHECK_MSG(psnr[dct] >= limit->psnr, "%s dct %d sub %d q%d: %.2f dB, floor %.1f",
+                          corpus_names[k], dct, sub, qual_levels[qi], psnr[dct], limit->psnr);
+                CHECK_MSG(mgr.dp <= limit->bytes, "%s dct %d sub %d q%d: %d bytes, ceiling %d",
+                          corpus_names[k], dct, sub, qual_levels[qi], mgr.dp, limit->bytes);
+            }
+            CHECK_MSG(psnr[TJE_DCT_ISLOW] >= psnr[TJE_DCT_FAST], "%s sub %d q%d: islow %.2f dB, fast %.2f dB",
+                      corpus_names[k], sub, qual_levels[qi], psnr[TJE_DCT_ISLOW], psnr[TJE_DCT_FAST]);
+        }
+    }
+
+    tje_encoder_destroy(enc);
+}
@@ -0,0 +1,68 @@
+/**
+ * test_rate.c
+ *
+ * Single-pass rate control over a session of 1024x600 frames with a scene
+ * cut every 5 frames, run the way RunCore does it under video load: the
+ * quality is chosen for the driver's 100 KB budget, the frame is encoded at
+ * it and its size reported back. The size estimate must be close and the
+ * frames the range can bring to the budget must land near it.
+ */
+
+#include <math.h>
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "test.h"
+
+#define RATE_WIDTH 1024
+#define RATE_HEIGHT 600
+#define RATE_MAX_BYTES (RATE_WIDTH * RATE_HEIGHT * 4)
+#define RATE_FRAMES 60
+#define RATE_SCENE_FRAMES 5
+// JPG_QUALITY_SIZE_HIGH, JPG_QUALITY_MIN and JPG_QUALITY_MAX of Driver.h
+#define RATE_TARGET (100 * 1024)
+#define RATE_QUALITY_MIN 50
+#define RATE_QUALITY_MAX 92
+
+void test_rate_prediction(void)
+{
+    static uint32_t px[RATE_WIDTH * RATE_HEIGHT];
+    static uint8_t jpg[RATE_MAX_BYTES];
+    tje_encoder_t * enc = tje_encoder_create();
+    double error = 0;
+    int in_range = 0, on_budget = 0;
+    int i;
+
+    for (i = 0; i < RATE_FRAMES; i++) {
+        stream_mgr_t mgr = { jpg, RATE_MAX_BYTES, 0 };
+        int kind = i / RATE_SCENE_FRAMES % CORPUS_KINDS;
+        int quality, predicted;
+
+        corpus_frame(px, RATE_WIDTH, RATE_HEIGHT, kind, i);
+        quality = tje_encoder_choose_quality(enc, RATE_WIDTH, RATE_HEIGHT, TJE_BGRX, (const unsigned char *)px,
+                                             RATE_WIDTH * 4, TJE_SUBSAMPLING_444, RATE_TARGET, RATE_QUALITY_MIN,
+                                             RATE_QUALITY_MAX);
+        predicted = tje_encoder_predicted_size(enc);
+        CHECK(quality >= RATE_QUALITY_MIN && quality <= RATE_QUALITY_MAX);
+        CHECK(tje_encoder_encode_to_ctx(enc, &mgr, RATE_WIDTH, RATE_HEIGHT, TJE_BGRX, (const unsigned char *)px,
+                                        RATE_WIDTH * 4, quality, TJE_SUBSAMPLING_444));
+        tje_encoder_report_size(enc, quality, mgr.dp);
+
+        error += fabs((double)mgr.dp - predicted) / mgr.dp;
+        // at the ends of the range the budget cannot be met either way
+        if (quality > RATE_QUALITY_MIN && quality < RATE_QUALITY_MAX) {
+            in_range++;
+            on_budget += fabs((double)mgr.dp - RATE_TARGET) <= RATE_TARGET / 10;
+        }
+        CHECK_MSG(quality == RATE_QUALITY_MIN || mgr.dp <= RATE_TARGET * 11 / 10,
+                  "frame %d %s q%d: %d bytes over the budget", i, corpus_names[kind], quality, mgr.dp);
+    }
+
+    error /= RATE_FRAMES;
+    printf("  prediction error %.1f%%, %d of %d frames in range within 10%% of the budget\n", error * 100,
+           on_budget, in_range);
+    CHECK_MSG(error < 0.06, "prediction error %.1f%%", error * 100);
+    CHECK(in_range >= RATE_FRAMES / 4);
+    CHECK_MSG(on_budget * 10 >= in_range * 9, "%d of %d frames on budget", on_budget, in_range);
+    tje_encoder_destroy(enc);
+}
@@ -0,0 +1,157 @@
+/**
+ * test_readback.c
+ *
+ * The readback scheduling against a fake device whose copies take a set
+ * number of frame ticks: frames come back once each, in order and with the
+ * content copied for them; a slot is never copied over while it is mapped or
+ * holds a frame nobody read; and a deep enough pipeline never waits.
+ */
+
+#include "../readback.h"
+#include "test.h"
+
+#define FAKE_FRAMES 200
+
+typedef struct {
+    unsigned int tick;              // advanced once per frame by the test
+    unsigned int latency;           // ticks a copy takes
+    unsigned int fail_seq;          // map of the frame with this seq fails, 0 for none
+    unsigned int content[READBACK_MAX_DEPTH];
+    unsigned int done[READBACK_MAX_DEPTH];  // tick the copy of the slot completes
+    int unread[READBACK_MAX_DEPTH];
+    int mapped[READBACK_MAX_DEPTH];
+    unsigned int last_seq;          // last frame handed out
+    int frames;
+    int misuse;                     // calls a real device would not survive
+} fake_gpu_t;
+
+static int fake_copy(void * ctx, int slot, void * src, int replace)
+{
+    fake_gpu_t * gpu = (fake_gpu_t *)ctx;
+
+    if (gpu->mapped[slot] || gpu->unread[slot] != replace)
+        gpu->misuse++;
+    gpu->content[slot] = (unsigned int)(uintptr_t)src;
+    gpu->done[slot] = gpu->tick + gpu->latency;
+    gpu->unread[slot] = 1;
+    return 1;
+}
+
+static int fake_map(void * ctx, int slot, int wait)
+{
+    fake_gpu_t * gpu = (fake_gpu_t *)ctx;
+
+    if (gpu->mapped[slot] || !gpu->unread[slot])
+        gpu->misuse++;
+    if (gpu->content[slot] == gpu->fail_seq) {
+        gpu->unread[slot] = 0;
+        return READBACK_MAP_FAIL;
+    }
+    if (gpu->tick < gpu->done[slot]) {
+        if (!wait)
+            return READBACK_MAP_BUSY;
+        // the CPU stalls until the copy is done
+        gpu->tick = gpu->done[slot];
+    }
+    gpu->mapped[slot] = 1;
+    return READBACK_MAP_OK;
+}
+
+static void fake_frame(void * ctx, int slot, unsigned int seq)
+{
+    fake_gpu_t * gpu = (fake_gpu_t *)ctx;
+
+    CHECK(gpu->mapped[slot]);
+    CHECK_MSG(gpu->content[slot] == seq, "slot %d holds %u, read back as %u", slot, gpu->content[slot], seq);
+    CHECK_MSG(seq > gpu->last_seq, "%u after %u", seq, gpu->last_seq);
+    gpu->last_seq = seq;
+    gpu->frames++;
+}
+
+static void fake_unmap(void * ctx, int slot)
+{
+    fake_gpu_t * gpu = (fake_gpu_t *)ctx;
+
+    if (!gpu->mapped[slot])
+        gpu->misuse++;
+    gpu->mapped[slot] = 0;
+    gpu->unread[slot] = 0;
+}
+
+static const readback_ops_t fake_ops = { fake_copy, fake_map, fake_frame, fake_unmap };
+
+// RunCore: push every acquired frame, then read back all but the newest lag
+static void fake_run(readback_t * rb, fake_gpu_t * gpu, int frames)
+{
+    unsigned int seq;
+
+    for (seq = 1; seq <= (unsigned int)frames; seq++) {
+        gpu->tick++;
+        CHECK(readback_push(rb, (void *)(uintptr_t)seq, seq));
+        readback_poll(rb, 0);
+    }
+    readback_poll(rb, 1);
+    CHECK(rb->pending == 0);
+}
+
+void test_readback_pipeline(void)
+{
+    readback_t rb;
+    int depth, lag;
+
+    for (depth = 1; depth <= READBACK_MAX_DEPTH; depth++) for (lag = 0; lag < depth; lag++) {
+        unsigned int latency;
+        for (latency = 0; latency <= 3; latency++) {
+            fake_gpu_t gpu = { 0 };
+            gpu.latency = latency;
+            readback_init(&rb, &fake_ops, &gpu, depth, lag);
+            fake_run(&rb, &gpu, FAKE_FRAMES);
+
+            CHECK_MSG(gpu.frames == FAKE_FRAMES && gpu.last_seq == FAKE_FRAMES && !gpu.misuse,
+                      "depth %d lag %d latency %u: %d frames, misuse %d", depth, lag, latency, gpu.frames, gpu.misuse);
+            CHECK(rb.dropped == 0 && rb.replaced == 0);
+            // a copy that finishes within lag frames is never waited for, apart from the final flush
+            if (latency <= (unsigned int)lag)
+                CHECK_MSG(rb.waits <= (unsigned int)lag, "depth %d lag %d latency %u: %u waits",
+                          depth, lag, latency, rb.waits);
+            // reading back right away waits for every copy that takes time
+            if (lag == 0 && latency > 0)
+                CHECK(rb.waits == FAKE_FRAMES);
+        }
+    }
+
+    // out of range depth and lag are clamped
+    readback_init(&rb, &fake_ops, NULL, 0, 5);
+    CHECK(rb.depth == 1 && rb.lag == 0);
+    readback_init(&rb, &fake_ops, NULL, READBACK_MAX_DEPTH + 3, READBACK_MAX_DEPTH + 3);
+    CHECK(rb.depth == READBACK_MAX_DEPTH && rb.lag == READBACK_MAX_DEPTH - 1);
+}
+
+void test_readback_replace_and_drop(void)
+{
+    readback_t rb;
+    fake_gpu_t gpu = { 0 };
+    unsigned int seq;
+
+    // the link is busy: every frame goes over the newest pending one, only the last comes back
+    gpu.latency = 1;
+    readback_init(&rb, &fake_ops, &gpu, 3, 1);
+    CHECK(readback_replace(&rb, (void *)(uintptr_t)1, 1));
+    CHECK(rb.pending == 1 && rb.replaced == 0);
+    for (seq = 2; seq <= 6; seq++) {
+        gpu.tick++;
+        CHECK(readback_replace(&rb, (void *)(uintptr_t)seq, seq));
+    }
+    CHECK(rb.pending == 1 && rb.replaced == 5);
+    CHECK(readback_poll(&rb, 0) == 0);
+    CHECK(readback_poll(&rb, 1) == 1);
+    CHECK(gpu.frames == 1 && gpu.last_seq == 6 && !gpu.misuse);
+
+    // a failed map loses that frame only
+    memset(&gpu, 0, sizeof(gpu));
+    gpu.latency = 2;
+    gpu.fail_seq = 7;
+    readback_init(&rb, &fake_ops, &gpu, 3, 2);
+    fake_run(&rb, &gpu, 20);
+    CHECK(rb.dropped == 1 && gpu.frames == 19 && gpu.last_seq == 20 && !gpu.misuse);
+}
@@ -0,0 +1,103 @@
+/**
+ * test_restart.c
+ *
+ * Restart intervals: DRI carries the interval, RST0..RST7 follow in turn
+ * after every interval of MCUs, and libjpeg decodes the same pixels as from
+ * the frame without restarts.
+ */
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "jpeg_util.h"
+#include "test.h"
+
+#define RST_MAX_BYTES (320 * 240 * 4)
+
+static const int rst_sizes[][2] = { { 320, 240 }, { 37, 21 }, { 8, 8 } };
+
+// interval in the DRI segment, -1 without one
+static int rst_dri(const uint8_t * jpg, int len)
+{
+    int i;
+    for (i = 2; i + 5 < len && !(jpg[i] == 0xff && jpg[i + 1] == 0xda); i++) {
+        if (jpg[i] == 0xff && jpg[i + 1] == 0xdd)
+            return jpg[i + 4] << 8 | jpg[i + 5];
+    }
+    return -1;
+}
+
+// counts the RSTn markers of the scan, -1 if one is out of turn. stuffing
+// keeps 0xff of the entropy-coded data from looking like a marker
+static int rst_markers(const uint8_t * jpg, int len)
+{
+    int i, n = 0;
+    for (i = 2; i + 1 < len && !(jpg[i] == 0xff && jpg[i + 1] == 0xda); i++)
+        ;
+    for (; i + 1 < len; i++) {
+        if (jpg[i] == 0xff && jpg[i + 1] >= 0xd0 && jpg[i + 1] <= 0xd7) {
+            if (jpg[i + 1] != 0xd0 + n % 8)
+                return -1;
+            n++;
+        }
+    }
+    return n;
+}
+
+void test_restart_markers(void)
+{
+    static uint32_t px[320 * 240];
+    static uint8_t jpg[RST_MAX_BYTES];
+    tje_encoder_t * enc = tje_encoder_create();
+    int s, k, sub, i;
+
+    for (s = 0; s < (int)(sizeof(rst_sizes) / sizeof(rst_sizes[0])); s++) {
+        int width = rst_sizes[s][0];
+        int height = rst_sizes[s][1];
+        for (k = 0; k < CORPUS_KINDS; k++) {
+            corpus_frame(px, width, height, k, 2);
+            for (sub = 0; sub < 3; sub++) {
+                int cols, rows, mcus;
+                int intervals[5];
+                uint8_t * ref;
+                int dw, dh;
+                stream_mgr_t mgr = { jpg, RST_MAX_BYTES, 0 };
+
+                tje_mcu_grid(width, height, sub, &cols, &rows);
+                mcus = cols * rows;
+                intervals[0] = 1;
+                intervals[1] = 3;
+                intervals[2] = cols;
+                intervals[3] = cols * 2 + 1;
+                intervals[4] = mcus + 5;
+
+                tje_encoder_set_restart_interval(enc, 0);
+                CHECK(tje_encoder_encode_to_ctx(enc, &mgr, width, height, TJE_BGRX, (const unsigned char *)px,
+                                                width * 4, 80, sub));
+                CHECK(rst_dri(jpg, mgr.dp) == -1);
+                CHECK(rst_markers(jpg, mgr.dp) == 0);
+                ref = jpeg_decode_rgb(jpg, mgr.dp, &dw, &dh);
+                CHECK(ref != NULL);
+
+                for (i = 0; i < 5; i++) {
+                    uint8_t * rgb;
+
+                    mgr.dp = 0;
+                    tje_encoder_set_restart_interval(enc, intervals[i]);
+                    CHECK(tje_encoder_encode_to_ctx(enc, &mgr, width, height, TJE_BGRX, (const unsigned char *)px,
+                                                    width * 4, 80, sub));
+                    CHECK(rst_dri(jpg, mgr.dp) == intervals[i]);
+                    CHECK_MSG(rst_markers(jpg, mgr.dp) == (mcus - 1) / intervals[i], "%dx%d %s sub %d interval %d",
+                              width, height, corpus_names[k], sub, intervals[i]);
+
+                    rgb = jpeg_decode_rgb(jpg, mgr.dp, &dw, &dh);
+                    CHECK_MSG(rgb && ref && dw == width && dh == height && !memcmp(rgb, ref, width * height * 3),
+                              "%dx%d %s sub %d interval %d", width, height, corpus_names[k], sub, intervals[i]);
+                    free(rgb);
+                }
+                free(ref);
+            }
+        }
+    }
+
+    tje_encoder_destroy(enc);
+}
@@ -0,0 +1,70 @@
+/**
+ * test_simd.c
+ *
+ * The SSE2 and AVX2 kernels of tiny_jpeg against the scalar path: every
+ * level the CPU has must produce the same bytes.
+ */
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "test.h"
+
+#define SIMD_MAX_BYTES (640 * 480 * 4)
+
+static const int simd_sizes[][2] = { { 640, 480 }, { 320, 240 }, { 37, 21 }, { 8, 8 } };
+static const int simd_qualities[] = { 1, 50, 85, 100 };
+static const char * const simd_level_names[] = { "none", "sse2", "avx2" };
+
+static int simd_encode(tje_encoder_t * enc, uint8_t * out, const uint32_t * px, int width, int height,
+                       int quality, int subsampling)
+{
+    stream_mgr_t mgr = { out, SIMD_MAX_BYTES, 0 };
+    if (!tje_encoder_encode_to_ctx(enc, &mgr, width, height, TJE_BGRX, (const unsigned char *)px, width * 4,
+                                   quality, subsampling))
+        return 0;
+    return mgr.dp;
+}
+
+void test_simd_levels_identical(void)
+{
+    static uint32_t px[640 * 480];
+    static uint8_t ref[SIMD_MAX_BYTES];
+    static uint8_t out[SIMD_MAX_BYTES];
+    tje_encoder_t * enc = tje_encoder_create();
+    int available, level, s, k, dct, sub, qi;
+
+    tje_set_simd_level(TJE_SIMD_AVX2);
+    available = tje_get_simd_level();
+    tje_set_simd_level(TJE_SIMD_NONE);
+    CHECK(tje_get_simd_level() == TJE_SIMD_NONE);
+    if (available == TJE_SIMD_NONE)
+        printf("  no SSE2 on this CPU, only the scalar path runs\n");
+
+    for (s = 0; s < (int)(sizeof(simd_sizes) / sizeof(simd_sizes[0])); s++) {
+        int width = simd_sizes[s][0];
+        int height = simd_sizes[s][1];
+        for (k = 0; k < CORPUS_KINDS; k++) {
+            corpus_frame(px, width, height, k, 3);
+            for (dct = TJE_DCT_FAST; dct <= TJE_DCT_ISLOW; dct++) for (sub = 0; sub < 3; sub++) for (qi = 0; qi < 4; qi++) {
+                int ref_len;
+
+                tje_encoder_set_dct(enc, dct);
+                tje_set_simd_level(TJE_SIMD_NONE);
+                ref_len = simd_encode(enc, ref, px, width, height, simd_qualities[qi], sub);
+                CHECK(ref_len > 0);
+
+                for (level = TJE_SIMD_SSE2; level <= available; level++) {
+                    int len;
+                    tje_set_simd_level(level);
+                    CHECK(tje_get_simd_level() == level);
+                    len = simd_encode(enc, out, px, width, height, simd_qualities[qi], sub);
+                    CHECK_MSG(len == ref_len && !memcmp(out, ref, len), "%s %dx%d %s dct %d sub %d q %d",
+                              simd_level_names[level], width, height, corpus_names[k], dct, sub, simd_qualities[qi]);
+                }
+            }
+        }
+    }
+
+    tje_set_simd_level(TJE_SIMD_AVX2);
+    tje_encoder_destroy(enc);
+}
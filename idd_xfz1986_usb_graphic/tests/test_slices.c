@@ -0,0 +1,58 @@
+/**
+ * test_slices.c
+ *
+ * A frame encoded as MCU-row slices on 1 to 8 threads and joined behind its
+ * header must be byte for byte the single encode with a restart interval of
+ * one MCU row, plain and packetized like the frame URB.
+ */
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "jpeg_util.h"
+#include "slice_pool.h"
+#include "test.h"
+
+#define SLICES_MAX_BYTES (CMD_HEADER_BYTES + JPEG_MAX_SIZE + JPEG_MAX_SIZE / 63 + 1)
+
+static const int slices_sizes[][2] = { { 1024, 600 }, { 320, 240 }, { 37, 21 }, { 8, 8 } };
+static const int slices_packets[] = { 0, 64, 512 };
+
+void test_slices_match_single(void)
+{
+    static uint32_t px[1024 * 600];
+    static uint8_t ref[SLICES_MAX_BYTES];
+    static uint8_t out[SLICES_MAX_BYTES];
+    tje_encoder_t * enc = tje_encoder_create();
+    int threads, s, sub, p;
+
+    for (threads = 1; threads <= SLICE_MAX_THREADS; threads++) {
+        slice_pool_t * pool = slice_pool_create(threads);
+        CHECK(pool != NULL);
+        if (pool == NULL)
+            continue;
+        for (s = 0; s < (int)(sizeof(slices_sizes) / sizeof(slices_sizes[0])); s++) {
+            int width = slices_sizes[s][0];
+            int height = slices_sizes[s][1];
+            corpus_frame(px, width, height, (threads + s) % CORPUS_KINDS, threads);
+            for (sub = 0; sub < 3; sub++) for (p = 0; p < 3; p++) {
+                int packet_size = slices_packets[p];
+                int start = packet_size ? CMD_HEADER_BYTES : 0;
+                stream_mgr_t single = { ref, SLICES_MAX_BYTES, start, packet_size, CMD_PACKET_HEADER };
+                stream_mgr_t sliced = { out, SLICES_MAX_BYTES, start, packet_size, CMD_PACKET_HEADER };
+                int cols, rows;
+
+                tje_mcu_grid(width, height, sub, &cols, &rows);
+                tje_encoder_set_restart_interval(enc, cols);
+                CHECK(tje_encoder_encode_to_ctx(enc, &single, width, height, TJE_BGRX, (const unsigned char *)px,
+                                                width * 4, 85, sub));
+                CHECK(slice_pool_encode(pool, enc, &sliced, width, height, (const uint8_t *)px, width * 4, 85, sub));
+                CHECK_MSG(sliced.dp == single.dp && !memcmp(out + start, ref + start, single.dp - start),
+                          "%d threads %dx%d sub %d packet %d: %d vs %d bytes", threads, width, height, sub,
+                          packet_size, sliced.dp, single.dp);
+            }
+        }
+        slice_pool_destroy(pool);
+    }
+
+    tje_encoder_destroy(enc);
+}
@@ -0,0 +1,70 @@
+/**
+ * test_subsampling.c
+ *
+ * 4:4:4, 4:2:2 and 4:2:0 frames through libjpeg: the SOF header carries
+ * the sampling factors of the mode, the picture decodes at its own size,
+ * partial MCUs included, and subsampled chroma makes colour frames smaller.
+ */
+
+#include "../tiny_jpeg.h"
+#include "corpus.h"
+#include "jpeg_util.h"
+#include "test.h"
+
+#define SUB_MAX_BYTES (320 * 240 * 4)
+
+static const int sub_sizes[][2] = { { 320, 240 }, { 37, 21 }, { 17, 9 }, { 16, 16 }, { 1, 1 } };
+// luma H and V factors of SOF0 for 4:4:4, 4:2:2 and 4:2:0
+static const uint8_t sub_luma_factors[3] = { 0x11, 0x21, 0x22 };
+
+// the sampling factors of the first component in SOF0, 0 without one
+static int sub_luma_sampling(const uint8_t * jpg, int len)
+{
+    int i;
+    for (i = 2; i + 12 < len; i++) {
+        if (jpg[i] == 0xff && jpg[i + 1] == 0xc0)
+            return jpg[i + 11];
+    }
+    return 0;
+}
+
+void test_subsampling_decodes(void)
+{
+    static uint32_t px[320 * 240];
+    static uint8_t jpg[SUB_MAX_BYTES];
+    tje_encoder_t * enc = tje_encoder_create();
+    int s, k, sub;
+
+    for (s = 0; s < (int)(sizeof(sub_sizes) / sizeof(sub_sizes[0])); s++) {
+        int width = sub_sizes[s][0];
+        int height = sub_sizes[s][1];
+        for (k = 0; k < CORPUS_KINDS; k++) {
+            int bytes[3] = { 0 };
+            corpus_frame(px, width, height, k, 0);
+            for (sub = 0; sub < 3; sub++) {
+                stream_mgr_t mgr = { jpg, SUB_MAX_BYTES, 0 };
+                int dw = 0, dh = 0;
+                uint8_t * rgb;
+
+                CHECK(tje_encoder_encode_to_ctx(enc, &mgr, width, height, TJE_BGRX, (const unsigned char *)px,
+                                                width * 4, 90, sub));
+                bytes[sub] = mgr.dp;
+                CHECK_MSG(sub_luma_sampling(jpg, mgr.dp) == sub_luma_factors[sub], "%dx%d %s sub %d",
+                          width, height, corpus_names[k], sub);
+
+                rgb = jpeg_decode_rgb(jpg, mgr.dp, &dw, &dh);
+                CHECK_MSG(rgb && dw == width && dh == height, "%dx%d %s sub %d", width, height, corpus_names[k], sub);
+                if (rgb) {
+                    double psnr = jpeg_psnr(px, rgb, width, height);
+                    CHECK_MSG(psnr > 20, "%dx%d %s sub %d: %.2f dB", width, height, corpus_names[k], sub, psnr);
+                }
+                free(rgb);
+            }
+            if (width >= 320 && (k == CORPUS_PHOTO || k == CORPUS_VIDEO))
+                CHECK_MSG(bytes[2] < bytes[1] && bytes[1] < bytes[0], "%s: %d %d %d bytes",
+                          corpus_names[k], bytes[0], bytes[1], bytes[2]);
+        }
+    }
+
+    tje_encoder_destroy(enc);
+}
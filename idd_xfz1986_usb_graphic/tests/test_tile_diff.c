@@ -0,0 +1,148 @@
+/**
+ * test_tile_diff.c
+ *
+ * The tile diff over synthetic frame sequences: every pixel that changed is
+ * in a returned rectangle, an unchanged frame returns none, and the saved
+ * frame always ends up a copy of the last one. Frames with partial tiles and
+ * a padded source pitch included.
+ */
+
+#include "../tile_diff.h"
+#include "corpus.h"
+#include "test.h"
+
+#define TD_MAX_WIDTH 1024
+#define TD_MAX_HEIGHT 600
+// a source pitch that is not the row, like a GPU surface
+#define TD_PITCH (TD_MAX_WIDTH * 4 + 64)
+
+static uint32_t td_state = 11;
+
+static int td_rand(int n)
+{
+    td_state = td_state * 1103515245u + 12345u;
+    return (int)((td_state >> 8) % (unsigned int)n);
+}
+
+static int td_covered(const dirty_set_t * set, int x, int y)
+{
+    int i;
+    for (i = 0; i < set->count; i++) {
+        const dirty_rect_t * r = &set->r[i];
+        if (x >= r->left && x < r->right && y >= r->top && y < r->bottom)
+            return 1;
+    }
+    return 0;
+}
+
+static int td_saved(const tile_diff_t * td, const uint8_t * cur, int width, int height)
+{
+    int y;
+    for (y = 0; y < height; y++) {
+        if (memcmp(td->prev + y * width * 4, cur + y * TD_PITCH, width * 4))
+            return 0;
+    }
+    return 1;
+}
+
+void test_tile_diff_sequences(void)
+{
+    static uint8_t cur[TD_MAX_HEIGHT * TD_PITCH];
+    static uint8_t old[TD_MAX_HEIGHT * TD_PITCH];
+    static uint32_t px[TD_MAX_WIDTH * TD_MAX_HEIGHT];
+    static uint8_t saved[TD_MAX_WIDTH * TD_MAX_HEIGHT * 4] __attribute__((aligned(16)));
+    static const int frames[][2] = { { 1024, 600 }, { 1000, 599 }, { 37, 21 } };
+    tile_diff_t td;
+    dirty_set_t changed;
+    int f, it, k, x, y;
+
+    tile_diff_init(&td, saved, TD_MAX_WIDTH * TD_MAX_HEIGHT);
+    for (f = 0; f < 3; f++) {
+        int width = frames[f][0];
+        int height = frames[f][1];
+        int tiles = ((width + TILE_DIFF_SIZE - 1) / TILE_DIFF_SIZE) * ((height + TILE_DIFF_SIZE - 1) / TILE_DIFF_SIZE);
+
+        corpus_frame(px, width, height, CORPUS_UI, f);
+        for (y = 0; y < height; y++)
+            memcpy(cur + y * TD_PITCH, px + y * width, width * 4);
+
+        // a new size is all changed and saved whole
+        CHECK(tile_diff_frame(&td, cur, TD_PITCH, width, height, NULL, &changed) == tiles);
+        CHECK(changed.count == 1 && dirty_area(&changed) == (long)width * height);
+        CHECK(td_saved(&td, cur, width, height));
+
+        for (it = 0; it < 150; it++) {
+            int n = td_rand(4);
+            memcpy(old, cur, sizeof(cur));
+            // a caret-sized change, then windows; one byte of a pixel is enough
+            for (k = 0; k < n; k++) {
+                int x0 = td_rand(width), y0 = td_rand(height);
+                int w = 1 + td_rand(k ? 200 : 3), h = 1 + td_rand(k ? 100 : 3);
+                for (y = y0; y < y0 + h && y < height; y++)
+                    for (x = x0; x < x0 + w && x < width; x++)
+                        cur[y * TD_PITCH + x * 4 + td_rand(3)] ^= 1 + td_rand(255);
+            }
+            tile_diff_frame(&td, cur, TD_PITCH, width, height, NULL, &changed);
+
+            for (y = 0; y < height; y++) {
+                for (x = 0; x < width; x++) {
+                    if (memcmp(cur + y * TD_PITCH + x * 4, old + y * TD_PITCH + x * 4, 4) && !td_covered(&changed, x, y)) {
+                        CHECK_MSG(0, "%dx%d step %d: pixel %d,%d changed and not reported", width, height, it, x, y);
+                        y = height;
+                        break;
+                    }
+                }
+            }
+            if (n == 0)
+                CHECK(changed.count == 0);
+            CHECK_MSG(td_saved(&td, cur, width, height), "%dx%d step %d", width, height, it);
+        }
+    }
+}
+
+void test_tile_diff_hint(void)
+{
+    static uint8_t cur[TD_MAX_HEIGHT * TD_PITCH];
+    static uint8_t saved[TD_MAX_WIDTH * TD_MAX_HEIGHT * 4] __attribute__((aligned(16)));
+    const int width = TD_MAX_WIDTH, height = TD_MAX_HEIGHT;
+    tile_diff_t td;
+    dirty_set_t hint, changed;
+    int x, y;
+
+    memset(cur, 0x40, sizeof(cur));
+    tile_diff_init(&td, saved, (long)width * height);
+    tile_diff_frame(&td, cur, TD_PITCH, width, height, NULL, &changed);
+    CHECK(tile_diff_frame(&td, cur, TD_PITCH, width, height, NULL, &changed) == 0 && changed.count == 0);
+
+    // only the hint is looked at: the change outside it waits for a frame without one
+    dirty_clear(&hint);
+    dirty_add(&hint, 0, 0, 64, 64, width, height);
+    cur[500 * TD_PITCH + 500 * 4] ^= 1;
+    cur[10 * TD_PITCH + 10 * 4] ^= 1;
+    CHECK(tile_diff_frame(&td, cur, TD_PITCH, width, height, &hint, &changed) == 1);
+    CHECK(changed.count == 1 && changed.r[0].left == 0 && changed.r[0].top == 0 &&
+          changed.r[0].right == 16 && changed.r[0].bottom == 16);
+    CHECK(tile_diff_frame(&td, cur, TD_PITCH, width, height, NULL, &changed) == 1);
+    CHECK(changed.count == 1 && changed.r[0].left == 496 && changed.r[0].top == 496);
+
+    // a row of changed tiles is one rectangle
+    for (x = 0; x < width; x += 16)
+        cur[100 * TD_PITCH + x * 4] ^= 1;
+    CHECK(tile_diff_frame(&td, cur, TD_PITCH, width, height, NULL, &changed) == width / 16);
+    CHECK(changed.count == 1 && changed.r[0].top == 96 && changed.r[0].right == width);
+
+    // tile_diff_copy() saves without comparing
+    dirty_clear(&hint);
+    dirty_add(&hint, 32, 32, 100, 90, width, height);
+    for (y = 32; y < 90; y++)
+        cur[y * TD_PITCH + 40 * 4] ^= 7;
+    tile_diff_copy(&td, cur, TD_PITCH, width, height, &hint);
+    CHECK(td_saved(&td, cur, width, height));
+
+    // after a reset, and for a frame larger than the buffer, everything or the hint is changed
+    tile_diff_reset(&td);
+    CHECK(tile_diff_frame(&td, cur, TD_PITCH, width, height, NULL, &changed) == 64 * 38);
+    tile_diff_init(&td, saved, 100);
+    CHECK(tile_diff_frame(&td, cur, TD_PITCH, width, height, &hint, &changed) == dirty_area(&hint) / 256);
+    CHECK(changed.count == hint.count && dirty_area(&changed) == dirty_area(&hint));
+}
@@ -0,0 +1,170 @@
+/**
+ * tile_diff.c
+ *
+ * See tile_diff.h
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "tile_diff.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TILE_DIFF_SSE2 1
+#include <emmintrin.h>
+#else
+#define TILE_DIFF_SSE2 0
+#endif
+
+void tile_diff_init(tile_diff_t * td, unsigned char * buf, long max_pixels)
+{
+    memset(td, 0, sizeof(*td));
+    td->prev = buf;
+    td->max_pixels = max_pixels;
+}
+
+void tile_diff_reset(tile_diff_t * td)
+{
+    td->width = 0;
+    td->height = 0;
+}
+
+// 1 if any of `rows` rows of `bytes` bytes differ
+static int tile_differs(const unsigned char * a, int apitch, const unsigned char * b, int bpitch, int bytes, int rows)
+{
+    int y;
+
+#if TILE_DIFF_SSE2
+    // a full tile row is 64 bytes, four compares folded into one mask
+    if (TILE_DIFF_SIZE * 4 == 64 && 64 == bytes) {
+        for (y = 0; y < rows; y++, a += apitch, b += bpitch) {
+            __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a), _mm_loadu_si128((const __m128i *)b));
+            __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 16)), _mm_loadu_si128((const __m128i *)(b + 16)));
+            __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 32)), _mm_loadu_si128((const __m128i *)(b + 32)));
+            __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 48)), _mm_loadu_si128((const __m128i *)(b + 48)));
+            if (0xffff != _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3))))
+                return 1;
+        }
+        return 0;
+    }
+#endif
+    for (y = 0; y < rows; y++, a += apitch, b += bpitch) {
+        if (memcmp(a, b, bytes))
+            return 1;
+    }
+    return 0;
+}
+
+// the saved frame is read again only for rectangles that wait for a URB, so it is written
+// around the cache when the rows allow it. tile_fence() ends a frame of these stores
+static void tile_copy(unsigned char * dst, int dpitch, const unsigned char * src, int spitch, int bytes, int rows)
+{
+    int y;
+
+#if TILE_DIFF_SSE2
+    if (0 == (bytes & 15) && 0 == (dpitch & 15) && 0 == ((size_t)dst & 15)) {
+        int x;
+        for (y = 0; y < rows; y++, dst += dpitch, src += spitch) {
+            for (x = 0; x < bytes; x += 16)
+                _mm_stream_si128((__m128i *)(dst + x), _mm_loadu_si128((const __m128i *)(src + x)));
+        }
+        return;
+    }
+#endif
+    for (y = 0; y < rows; y++, dst += dpitch, src += spitch)
+        memcpy(dst, src, bytes);
+}
+
+static void tile_fence(void)
+{
+#if TILE_DIFF_SSE2
+    _mm_sfence();
+#endif
+}
+
+// a frame of a new size: saved whole, all of it changed
+static int tile_diff_new_size(tile_diff_t * td, const unsigned char * src, int pitch, int width, int height,
+                              dirty_set_t * changed)
+{
+    tile_copy(td->prev, width * 4, src, pitch, width * 4, height);
+    tile_fence();
+    td->width = width;
+    td->height = height;
+    dirty_add(changed, 0, 0, width, height, width, height);
+    return ((width + TILE_DIFF_SIZE - 1) / TILE_DIFF_SIZE) * ((height + TILE_DIFF_SIZE - 1) / TILE_DIFF_SIZE);
+}
+
+int tile_diff_frame(tile_diff_t * td, const unsigned char * src, int pitch, int width, int height,
+                    const dirty_set_t * hint, dirty_set_t * changed)
+{
+    dirty_set_t all;
+    int ppitch = width * 4;
+    int tiles = 0;
+    int i, x, y;
+
+    dirty_clear(changed);
+    // nothing to compare with: take the hint as it is
+    if (NULL == td->prev || (long)width * height > td->max_pixels) {
+        if (hint)
+            dirty_merge(changed, hint, width, height);
+        else
+            dirty_add(changed, 0, 0, width, height, width, height);
+        return (int)(dirty_area(changed) / (TILE_DIFF_SIZE * TILE_DIFF_SIZE));
+    }
+    if (td->width != width || td->height != height)
+        return tile_diff_new_size(td, src, pitch, width, height, changed);
+    if (NULL == hint) {
+        dirty_clear(&all);
+        dirty_add(&all, 0, 0, width, height, width, height);
+        hint = &all;
+    }
+
+    // hint rectangles are on the tile grid and do not overlap, each tile is looked at once.
+    // runs of changed tiles in a tile row become one rectangle
+    for (i = 0; i < hint->count; i++) {
+        const dirty_rect_t * r = &hint->r[i];
+        for (y = r->top; y < r->bottom; y += TILE_DIFF_SIZE) {
+            int rows = (r->bottom - y < TILE_DIFF_SIZE) ? r->bottom - y : TILE_DIFF_SIZE;
+            int run = -1;
+            for (x = r->left; x < r->right; x += TILE_DIFF_SIZE) {
+                int bytes = ((r->right - x < TILE_DIFF_SIZE) ? r->right - x : TILE_DIFF_SIZE) * 4;
+                const unsigned char * s = src + y * pitch + x * 4;
+                unsigned char * p = td->prev + y * ppitch + x * 4;
+                if (tile_differs(s, pitch, p, ppitch, bytes, rows)) {
+                    tile_copy(p, ppitch, s, pitch, bytes, rows);
+                    tiles++;
+                    if (run < 0)
+                        run = x;
+                } else if (run >= 0) {
+                    dirty_add(changed, run, y, x, y + rows, width, height);
+                    run = -1;
+                }
+            }
+            if (run >= 0)
+                dirty_add(changed, run, y, r->right, y + rows, width, height);
+        }
+    }
+    tile_fence();
+    return tiles;
+}
+
+void tile_diff_copy(tile_diff_t * td, const unsigned char * src, int pitch, int width, int height,
+                    const dirty_set_t * set)
+{
+    dirty_set_t changed;
+    int ppitch = width * 4;
+    int i;
+
+    if (NULL == td->prev || (long)width * height > td->max_pixels)
+        return;
+    if (td->width != width || td->height != height) {
+        tile_diff_new_size(td, src, pitch, width, height, &changed);
+        return;
+    }
+    for (i = 0; i < set->count; i++) {
+        const dirty_rect_t * r = &set->r[i];
+        tile_copy(td->prev + r->top * ppitch + r->left * 4, ppitch, src + r->top * pitch + r->left * 4, pitch,
+                  (r->right - r->left) * 4, r->bottom - r->top);
+    }
+    tile_fence();
+}
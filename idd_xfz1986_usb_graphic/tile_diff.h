@@ -0,0 +1,62 @@
+/**
+ * tile_diff.h
+ *
+ * Finds the parts of a frame that really changed.
+ *
+ * The frame is compared against a saved copy of the previous one in
+ * TILE_DIFF_SIZE square tiles, on the same grid as the dirty rectangles.
+ * Changed tiles are copied into the saved frame and returned as a
+ * dirty_set_t, so the OS may report far more than changed (often the whole
+ * surface) without costing an encode.
+ *
+ * The saved frame is the caller's buffer and stays a copy of the last frame,
+ * so parts of it can be sent later without reading the source again.
+ */
+
+#pragma once
+
+#include "dirty_rect.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define TILE_DIFF_SIZE DIRTY_ALIGN
+
+typedef struct {
+    unsigned char * prev;   // the last frame, width * 4 bytes per row, 16-byte aligned for streaming stores
+    long max_pixels;
+    int width;              // of prev, 0 until a frame is saved
+    int height;
+} tile_diff_t;
+
+// keeps the saved frame in buf, max_pixels * 4 bytes
+void tile_diff_init(tile_diff_t * td, unsigned char * buf, long max_pixels);
+
+// forgets the saved frame, the next one is all changed
+void tile_diff_reset(tile_diff_t * td);
+
+// - tile_diff_frame -
+//
+//  Compares the BGRX frame src against the saved one, only inside the
+//  rectangles of hint or everywhere if hint is NULL, and sets changed to
+//  the tiles that differ. A frame of another size than the saved one is
+//  all changed; one larger than the buffer is not saved and changed is just
+//  the hint.
+//
+//  Returns the number of changed tiles.
+int tile_diff_frame(tile_diff_t * td, const unsigned char * src, int pitch, int width, int height,
+                    const dirty_set_t * hint, dirty_set_t * changed);
+
+// - tile_diff_copy -
+//
+//  Copies the rectangles of set from src into the saved frame without
+//  comparing, for when the diff is not used. A frame of another size than
+//  the saved one is copied whole.
+void tile_diff_copy(tile_diff_t * td, const unsigned char * src, int pitch, int width, int height,
+                    const dirty_set_t * set);
+
+#ifdef __cplusplus
+}  // extern C
+#endif
@@ -8,7 +8,8 @@
  *
  * Features
  *  - Implements Baseline DCT JPEG compression.
- *  - No dynamic allocations.
+ *  - No per-frame allocations through a tje_encoder_create() encoder; the
+ *    one-shot tje_encode_* calls allocate and free one on every call.
  *
  * This library is coded in the spirit of the stb libraries and mostly follows
  * the stb guidelines.
@@ -123,12 +124,17 @@ int main()
 #ifdef _WIN32
 
 #include <windows.h>
+#include <stdlib.h> // malloc
+#include <stddef.h> // offsetof
 #ifndef snprintf
 #define snprintf sprintf_s
 #endif
 // Not quite the same but it works for us. If I am not mistaken, it differs
 // only in the return value.
 
+#define TJEI_ATOMIC_ADD(p, v) InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v))
+#else
+#define TJEI_ATOMIC_ADD(p, v) __sync_fetch_and_add((p), (v))
 #endif
 
 #ifndef NDEBUG
@@ -151,25 +157,142 @@ typedef struct {
     tje_write_func* func;
 } TJEWriteContext;
 
+#define MAX_JPG_QUAILITY 100
+
+// Big enough for SOI, both DQTs, SOF, the four DHTs and SOS (605 bytes).
+#define TJEI_HEADER_MAX 640
+
+// Four DHT segments with every legal symbol: 2 * (21 + 12) + 2 * (21 + 162).
+#define TJEI_DHT_MAX 432
+
+// Rate control: MCUs analyzed per frame, in pairs of neighbours.
+#define TJEI_RATE_MCUS 128
+#define TJEI_RATE_BLOCKS (TJEI_RATE_MCUS * 6)
+
+#if TJE_USE_FAST_DCT
+// One quantization table prepared for the DCTs, in natural order.
 typedef struct {
-    uint8_t huffsize[4][257];
-    uint16_t huffcode[4][256];
-    // Huffman data.
-    uint8_t         ehuffsize[4][257];
-    uint16_t        ehuffcode[4][256];
-    uint8_t const * ht_bits[4];
-    uint8_t const * ht_vals[4];
+    // AAN-scaled reciprocals for tjei_fdct_quant().
+    FLOAT_INT32_T   aan[64];
+    // islow divides its 8x scaled output by 8 * quantizer, rounding to
+    // nearest; rcp is ceil(2^32 / div), exact for any coefficient it sees.
+    uint32_t        div[64];
+    uint32_t        rcp[64];
+} TJEDivisors;
+#endif
+
+// One analyzed block. Its AC terms are rate_coef[previous end, end).
+typedef struct {
+    int32_t         dc;         // AAN DC term
+    uint32_t        end;
+    int16_t         pred;       // block whose DC predicts this one, -1 if none was sampled
+    uint8_t         chroma;
+} TJERateBlock;
+
+// Everything that only depends on the quality level. Built the first time a
+// level is used and then reused for every frame.
+typedef struct {
+    int             ready;
 
     // Cuantization tables.
     uint8_t         qt_luma[64];
     uint8_t         qt_chroma[64];
+#if TJE_USE_FAST_DCT
+    TJEDivisors     div_luma;
+    TJEDivisors     div_chroma;
+#endif
+
+    // Serialized headers up to and including SOS. The SOF frame size and luma
+    // sampling factor are patched in place before each frame.
+    uint8_t         header[TJEI_HEADER_MAX];
+    int             header_len;
+    int             sof_offset;
+    int             dht_offset;     // Start of the default DHTs.
+    int             sos_offset;     // DRI goes here when restart markers are on.
+} TJEQualityCache;
+
+struct TJEEncoder {
+    // Huffman data. The Annex K tables, or with optimize_huffman the tables
+    // built from the symbol counts of the previous frame.
+    uint8_t         ehuffsize[4][257];
+    uint16_t        ehuffcode[4][256];
+
+    // MCUs per entropy-coded segment. 0: no restart markers.
+    int             restart_interval;
+
+    // TJE_DCT_FAST or TJE_DCT_ISLOW.
+    int             dct_method;
+
+    // Optimized Huffman tables. freq collects the symbol counts of the frame
+    // being coded; the next frame header turns them into tables. dht_len is
+    // non-zero while ehuff* hold such tables, and dht replaces the default
+    // DHTs of the cached header.
+    int             optimize_huffman;
+    uint32_t        freq[4][256];
+    uint8_t         dht[TJEI_DHT_MAX];
+    int             dht_len;
+
+    // Frame headers leave out DQT and DHT; the decoder has them from the last
+    // tje_encoder_encode_tables_to_ctx(), which is also where optimized
+    // Huffman tables change in this mode.
+    int             abbreviated;
+
+    // Rate control (tje_encoder_choose_quality). rate_coef holds the AC
+    // terms of the sampled blocks that can quantize to non-zero, as zig-zag
+    // position << 24 | AAN magnitude. rate_gain (x1024) is the correction
+    // learned from the sizes reported after coding. Both arrays are NULL in
+    // the encoder of a one-shot call.
+    uint32_t*       rate_coef;          // TJEI_RATE_BLOCKS * 63
+    TJERateBlock*   rate_block;         // TJEI_RATE_BLOCKS
+    int             rate_blocks;        // blocks sampled
+    int             rate_sampled;       // MCUs sampled
+    int             rate_mcus;          // MCUs in the frame
+    int             rate_gain;
+    int             rate_quality;       // chosen for the frame being coded
+    uint64_t        rate_predicted;     // its size before rate_gain, 0 if none
+
+    // Levels quality_first and up; all of them in a tje_encoder_create()
+    // encoder, only the one it codes in that of a one-shot call.
+    TJEQualityCache* quality;
+    int             quality_first;
+};
+
+// Entropy coder output. Bits collect in a 64-bit word that is stored eight
+// bytes at a time straight into the output span.
+typedef struct {
+    uint64_t        buffer;         // Pending bits, right aligned.
+    int             free_bits;      // 64 minus the number of pending bits.
+    uint8_t*        out;            // Next output byte.
+    uint8_t*        out_end;
+} TJEBitWriter;
+
+typedef struct {
+    // Tables for this frame; owned by the encoder.
+    struct TJEEncoder* enc;
+    TJEQualityCache*   qc;
+
+    // Source image. src_pitch is in bytes; src_format is TJE_RGB, TJE_RGBA or TJE_BGRX.
+    const uint8_t*  src_data;
+    int             src_format;
+    int             src_pitch;
+    int             width;
+    int             height;
+    int             subsampling;    // TJE_SUBSAMPLING_*
 
     // fwrite by default. User-defined when using tje_encode_with_func.
     TJEWriteContext write_context;
 
-    // Buffered output. Big performance win when using the usual stdlib implementations.
-    size_t          output_buffer_count;
+    // Output span. For stream_mgr_t contexts it is the caller's buffer, so
+    // nothing is copied twice; otherwise it is output_buffer, handed to the
+    // write callback whenever it fills up.
+    TJEBitWriter    bw;
+    stream_mgr_t*   direct;
+    int             overflow;       // Direct span ran out; the frame is dropped.
     uint8_t         output_buffer[TJEI_BUFFER_SIZE];
+
+    // Symbol counts of this call, added to enc->freq at the end. Only cleared
+    // and used with optimize_huffman.
+    uint32_t        freq[4][256];
 } TJEState;
 
 // ============================================================
@@ -280,6 +403,26 @@ static const uint8_t tjei_default_ht_chroma_ac[] = {
     0xF9, 0xFA
 };
 
+enum {
+    TJEI_LUMA_DC,
+    TJEI_LUMA_AC,
+    TJEI_CHROMA_DC,
+    TJEI_CHROMA_AC,
+};
+
+static const uint8_t* const tjei_ht_bits[4] = {
+    tjei_default_ht_luma_dc_len,
+    tjei_default_ht_luma_ac_len,
+    tjei_default_ht_chroma_dc_len,
+    tjei_default_ht_chroma_ac_len,
+};
+
+static const uint8_t* const tjei_ht_vals[4] = {
+    tjei_default_ht_luma_dc,
+    tjei_default_ht_luma_ac,
+    tjei_default_ht_chroma_dc,
+    tjei_default_ht_chroma_ac,
+};
 
 // ============================================================
 // Code
@@ -372,28 +515,103 @@ typedef struct {
 #pragma pack(pop)
 
 
+// End of the direct span from `out`: the next packet boundary when the stream
+// is packetized, else the last usable byte. Packet 0 starts with the caller's
+// own header, so boundaries are at packet_size, 2 * packet_size, ...
+static uint8_t* tjei_direct_end(const stream_mgr_t* stream, const uint8_t* out)
+{
+    uint8_t* end = stream->data + stream->max - 1;
+    if(stream->packet_size > 0) {
+        size_t pos = (size_t)(out - stream->data);
+        size_t ps = (size_t)stream->packet_size;
+        size_t next = pos ? (pos + ps - 1) / ps * ps : ps;
+        if(next < (size_t)(end - stream->data)) {
+            end = stream->data + next;
+        }
+    }
+    return end;
+}
+
+// Makes room in a full output span. Callback output is handed over and the
+// buffer reused. A packetized direct span gets its next packet header byte. A
+// full direct span means the frame does not fit: the rest is written to
+// output_buffer as scratch and tjei_flush() reports the failure.
+static void tjei_spill(TJEState* state, TJEBitWriter* bw)
+{
+    stream_mgr_t* stream = state->direct;
+    if(stream && stream->packet_size > 0 && !state->overflow &&
+       bw->out < stream->data + stream->max - 1) {
+        *bw->out++ = stream->packet_header;
+        bw->out_end = tjei_direct_end(stream, bw->out);
+        return;
+    }
+    if(!stream) {
+        state->write_context.func(state->write_context.context, state->output_buffer,
+                                  (int)(bw->out - state->output_buffer));
+    } else if(!state->overflow) {
+        LOGW("%s over max %d\n", __FUNCTION__, state->direct->max);
+        state->overflow = 1;
+    }
+    bw->out = state->output_buffer;
+    bw->out_end = state->output_buffer + TJEI_BUFFER_SIZE;
+}
+
 static void tjei_write(TJEState* state, const void* data, size_t num_bytes, size_t num_elements)
 {
+    const uint8_t* src = (const uint8_t*)data;
     size_t to_write = num_bytes * num_elements;
 
-    // Cap to the buffer available size and copy memory.
-    size_t capped_count = tjei_min(to_write, TJEI_BUFFER_SIZE - 1 - state->output_buffer_count);
-
-    memcpy(state->output_buffer + state->output_buffer_count, data, capped_count);
-    state->output_buffer_count += capped_count;
+    while(to_write) {
+        size_t room = (size_t)(state->bw.out_end - state->bw.out);
+        if(room == 0) {
+            tjei_spill(state, &state->bw);
+            continue;
+        }
+        if(room > to_write) {
+            room = to_write;
+        }
+        memcpy(state->bw.out, src, room);
+        state->bw.out += room;
+        src += room;
+        to_write -= room;
+    }
+}
 
-    assert(state->output_buffer_count <= TJEI_BUFFER_SIZE - 1);
+static void tjei_stdlib_func(void* context, void* data, int size);
 
-    // Flush the buffer.
-    if(state->output_buffer_count == TJEI_BUFFER_SIZE - 1) {
-        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
-        state->output_buffer_count = 0;
+static void tjei_init_output(TJEState* state, tje_write_func* func, void* context)
+{
+    state->write_context.context = context;
+    state->write_context.func = func;
+    state->bw.buffer = 0;
+    state->bw.free_bits = 64;
+    state->overflow = 0;
+    state->direct = NULL;
+    if(func == tjei_stdlib_func) {
+        // Same limit as tjei_stdlib_func: at most max - 1 bytes.
+        state->direct = (stream_mgr_t*)context;
+        state->bw.out = state->direct->data + state->direct->dp;
+        state->bw.out_end = tjei_direct_end(state->direct, state->bw.out);
+    } else {
+        state->bw.out = state->output_buffer;
+        state->bw.out_end = state->output_buffer + TJEI_BUFFER_SIZE;
     }
+}
 
-    // Recursively calling ourselves with the rest of the buffer.
-    if(capped_count < to_write) {
-        tjei_write(state, (uint8_t*)data + capped_count, to_write - capped_count, 1);
+// Returns 0 if a direct span overflowed.
+static int tjei_flush(TJEState* state)
+{
+    if(state->direct) {
+        if(state->overflow) {
+            return 0;
+        }
+        state->direct->dp = (int)(state->bw.out - state->direct->data);
+    } else if(state->bw.out != state->output_buffer) {
+        state->write_context.func(state->write_context.context, state->output_buffer,
+                                  (int)(state->bw.out - state->output_buffer));
+        state->bw.out = state->output_buffer;
     }
+    return 1;
 }
 
 static void tjei_write_DQT(TJEState* state, const uint8_t* matrix, uint8_t id)
@@ -411,6 +629,16 @@ static void tjei_write_DQT(TJEState* state, const uint8_t* matrix, uint8_t id)
     tjei_write(state, matrix, 64 * sizeof(uint8_t), 1);
 }
 
+static void tjei_write_DRI(TJEState* state, uint16_t restart_interval)
+{
+    uint16_t DRI = tjei_be_word(0xffdd);
+    uint16_t len = tjei_be_word(0x0004); // 2(len) + 2(interval)
+    uint16_t ri = tjei_be_word(restart_interval);
+    tjei_write(state, &DRI, sizeof(uint16_t), 1);
+    tjei_write(state, &len, sizeof(uint16_t), 1);
+    tjei_write(state, &ri, sizeof(uint16_t), 1);
+}
+
 typedef enum {
     TJEI_DC = 0,
     TJEI_AC = 1
@@ -441,6 +669,13 @@ static void tjei_write_DHT(TJEState* state,
     tjei_write(state, matrix_len, sizeof(uint8_t), 16);
     tjei_write(state, matrix_val, sizeof(uint8_t), (size_t)num_values);
 }
+static void tjei_write_DHTs(TJEState* state, uint8_t const * const bits[4], uint8_t const * const vals[4])
+{
+    tjei_write_DHT(state, bits[TJEI_LUMA_DC],   vals[TJEI_LUMA_DC], TJEI_DC, 0);
+    tjei_write_DHT(state, bits[TJEI_LUMA_AC],   vals[TJEI_LUMA_AC], TJEI_AC, 0);
+    tjei_write_DHT(state, bits[TJEI_CHROMA_DC], vals[TJEI_CHROMA_DC], TJEI_DC, 1);
+    tjei_write_DHT(state, bits[TJEI_CHROMA_AC], vals[TJEI_CHROMA_AC], TJEI_AC, 1);
+}
 // ============================================================
 //  Huffman deflation code.
 // ============================================================
@@ -513,37 +748,109 @@ TJEI_FORCE_INLINE void tjei_calculate_variable_length_int(int value, uint16_t ou
     out[0] = (uint16_t)(value & ((1 << out[1]) - 1));
 }
 
-// Write bits to file.
-TJEI_FORCE_INLINE void tjei_write_bits(TJEState* state,
-                                       uint32_t* bitbuffer, uint32_t* location,
-                                       uint16_t num_bits, uint16_t bits)
+TJEI_FORCE_INLINE void tjei_put_byte(TJEState* state, TJEBitWriter* bw, uint8_t c)
 {
-    //   v-- location
-    //  [                     ]   <-- bit buffer
-    // 32                     0
-    //
-    // This call pushes to the bitbuffer and saves the location. Data is pushed
-    // from most significant to less significant.
-    // When we can write a full byte, we write a byte and shift.
-
-    // Push the stack.
-    uint32_t nloc = *location + num_bits;
-    *bitbuffer |= (uint32_t)(bits << (32 - nloc));
-    *location = nloc;
-    while(*location >= 8) {
-        // Grab the most significant byte.
-        uint8_t c = (uint8_t)((*bitbuffer) >> 24);
-        // Write it to file.
-        tjei_write(state, &c, 1, 1);
-        if(c == 0xff)  {
+    if(bw->out == bw->out_end) {
+        tjei_spill(state, bw);
+    }
+    *bw->out++ = c;
+}
+
+// Byte-at-a-time store of a word, for the last few bytes of the span or of a
+// packet.
+static void tjei_emit_word_bytes(TJEState* state, TJEBitWriter* bw, uint64_t w)
+{
+    int i;
+    for(i = 56; i >= 0; i -= 8) {
+        uint8_t c = (uint8_t)(w >> i);
+        tjei_put_byte(state, bw, c);
+        if(c == 0xff) {
+            tjei_put_byte(state, bw, 0);
+        }
+    }
+}
+
+// Stores a full 64-bit word, most significant byte first. Any 0xff byte gets a
+// 0x00 after it so it is not read as a marker; the word-level test below is
+// exact for "no 0xff" and only sends a few other words down the slow path.
+TJEI_FORCE_INLINE void tjei_emit_word(TJEState* state, TJEBitWriter* bw, uint64_t w)
+{
+    uint8_t* p = bw->out;
+    ptrdiff_t room = bw->out_end - p;
+    int i;
+    if(room >= 8 && !(w & 0x8080808080808080ULL & ~(w + 0x0101010101010101ULL))) {
+        p[0] = (uint8_t)(w >> 56);
+        p[1] = (uint8_t)(w >> 48);
+        p[2] = (uint8_t)(w >> 40);
+        p[3] = (uint8_t)(w >> 32);
+        p[4] = (uint8_t)(w >> 24);
+        p[5] = (uint8_t)(w >> 16);
+        p[6] = (uint8_t)(w >> 8);
+        p[7] = (uint8_t)w;
+        bw->out = p + 8;
+        return;
+    }
+    if(room < 16) {
+        tjei_emit_word_bytes(state, bw, w);
+        return;
+    }
+    for(i = 56; i >= 0; i -= 8) {
+        uint8_t c = (uint8_t)(w >> i);
+        *p++ = c;
+        if(c == 0xff) {
             // Special case: tell JPEG this is not a marker.
-            char z = 0;
-            tjei_write(state, &z, 1, 1);
+            *p++ = 0;
+        }
+    }
+    bw->out = p;
+}
+
+// Write bits to file. `bits` must not have anything set above num_bits.
+TJEI_FORCE_INLINE void tjei_write_bits(TJEState* state, TJEBitWriter* bw,
+                                       uint16_t num_bits, uint16_t bits)
+{
+    int free_bits = bw->free_bits - num_bits;
+    if(free_bits >= 0) {
+        bw->buffer = (bw->buffer << num_bits) | bits;
+        bw->free_bits = free_bits;
+    } else {
+        // Top the word up, store it, and keep the -free_bits low bits that did
+        // not fit. Bits above those are shifted out before the next store.
+        tjei_emit_word(state, bw, (bw->buffer << (num_bits + free_bits)) | ((uint64_t)bits >> -free_bits));
+        bw->buffer = bits;
+        bw->free_bits = free_bits + 64;
+    }
+}
+
+// Pads the pending bits to a byte boundary with `pad_bit` and stores them.
+static void tjei_flush_bits(TJEState* state, TJEBitWriter* bw, int pad_bit)
+{
+    int pending = 64 - bw->free_bits;
+    if(pending & 7) {
+        uint16_t pad = (uint16_t)(8 - (pending & 7));
+        tjei_write_bits(state, bw, pad, (uint16_t)(pad_bit ? (1 << pad) - 1 : 0));
+        pending = 64 - bw->free_bits;
+    }
+    while(pending > 0) {
+        uint8_t c;
+        pending -= 8;
+        c = (uint8_t)(bw->buffer >> pending);
+        tjei_put_byte(state, bw, c);
+        if(c == 0xff) {
+            tjei_put_byte(state, bw, 0);
         }
-        // Pop the stack.
-        *bitbuffer <<= 8;
-        *location -= 8;
     }
+    bw->buffer = 0;
+    bw->free_bits = 64;
+}
+
+// Ends an entropy-coded segment: pads to a byte boundary with 1-bits (F.1.2.3)
+// and writes RSTn. The caller resets the DC predictions.
+static void tjei_write_restart(TJEState* state, int index)
+{
+    tjei_flush_bits(state, &state->bw, 1);
+    uint16_t RST = tjei_be_word((uint16_t)(0xffd0 + index));
+    tjei_write(state, &RST, sizeof(uint16_t), 1);
 }
 
 // DCT implementation by Thomas G. Lane.
@@ -686,29 +993,27 @@ static FLOAT_INT32_T slow_fdct(int u, int v, FLOAT_INT32_T* data)
 }
 #endif
 
-#define ABS(x) ((x) < 0 ? -(x) : (x))
+// ============================================================
+// Forward DCT + quantization kernels.
+//
+// tjei_fdct_quant() transforms one 8x8 data unit, quantizes it with the
+// pre-processed table and stores the coefficients in zig-zag order.
+//
+// The SSE2 and AVX2 variants replay the FLOAT_INT_MODE arithmetic of
+// tjei_fdct() lane by lane: every x/1024 truncates toward zero before the
+// constant multiply and the quantizer product wraps at 32 bits, so their
+// output is bit-exact with the scalar path. The variant is chosen from a
+// CPUID check made once, capped by tje_set_simd_level().
+// ============================================================
 
-static void tjei_encode_and_write_MCU(TJEState* state,
-                                      FLOAT_INT32_T* mcu,
-#if TJE_USE_FAST_DCT
-                                      FLOAT_INT32_T* qt,  // Pre-processed quantization matrix.
-#else
-                                      uint8_t* qt,
-#endif
-                                      uint8_t* huff_dc_len, uint16_t* huff_dc_code, // Huffman tables
-                                      uint8_t* huff_ac_len, uint16_t* huff_ac_code,
-                                      int* pred,  // Previous DC coefficient
-                                      uint32_t* bitbuffer,  // Bitstack.
-                                      uint32_t* location)
+typedef void tjei_fdct_quant_func(const FLOAT_INT32_T* mcu, const FLOAT_INT32_T* qt, int du[64]);
+
+static void tjei_fdct_quant_c(const FLOAT_INT32_T* mcu, const FLOAT_INT32_T* qt, int du[64])
 {
-    int du[64];  // Data unit in zig-zag order
-    int i;
-    int u, v, val, diff, last_non_zero_i;
     FLOAT_INT32_T dct_mcu[64];
-    uint16_t vli[2];
+    int i, val;
     memcpy(dct_mcu, mcu, 64 * sizeof(FLOAT_INT32_T));
 
-#if TJE_USE_FAST_DCT
     tjei_fdct(dct_mcu);
     for(i = 0; i < 64; ++i) {
         FLOAT_INT32_T fval = dct_mcu[i];
@@ -723,187 +1028,1038 @@ static void tjei_encode_and_write_MCU(TJEState* state,
         val = (int)FLOAT_2_INT32_SCALE_BACK(FLOAT_2_INT32_SCALE_BACK(fval));
         du[tjei_zig_zag[i]] = val;
     }
-#else
-    for(v = 0; v < 8; ++v) {
-        for(u = 0; u < 8; ++u) {
-            dct_mcu[v * 8 + u] = slow_fdct(u, v, mcu);
+}
+
+// Flat blocks (solid backgrounds, window fills) are the bulk of a desktop frame.
+// When all 64 samples are equal every difference inside the DCT is zero, so the
+// AC terms are exactly zero and the DC term is the plain sum of the samples.
+// Returns 0 for any other block. Otherwise sets du[0] to the value
+// tjei_fdct_quant would produce; the AC terms are left untouched.
+static int tjei_block_is_flat(const FLOAT_INT32_T* mcu)
+{
+    const FLOAT_INT32_T v = mcu[0];
+    int i;
+    for(i = 0; i < 64; i += 8) {
+        if((mcu[i + 0] != v) | (mcu[i + 1] != v) | (mcu[i + 2] != v) | (mcu[i + 3] != v) |
+           (mcu[i + 4] != v) | (mcu[i + 5] != v) | (mcu[i + 6] != v) | (mcu[i + 7] != v)) {
+            return 0;
         }
     }
-    for(i = 0; i < 64; ++i) {
-        FLOAT_INT32_T fval = dct_mcu[i] / (qt[i]);
-        val = (int)((fval > 0) ? floorf(FLOAT_2_INT32_SCALE_BACK(fval + FLOAT_2_INT32(0.5f)) : ceilf(FLOAT_2_INT32_SCALE_BACK(fval - FLOAT_2_INT32(0.5f)));
-                                        du[tjei_zig_zag[i]] = val;
-                                    }
-#endif
+    return 1;
+}
+
+static int tjei_flat_block_quant(const FLOAT_INT32_T* mcu, const FLOAT_INT32_T* qt, int du[64])
+{
+    FLOAT_INT32_T fval;
+    if(!tjei_block_is_flat(mcu)) {
+        return 0;
+    }
+    fval = mcu[0] * 64;
+    fval *= (qt[0]);
+#ifdef FLOAT_INT_MODE
 
+#else
+    fval = (fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f);
+    fval = floorf(fval + FLOAT_2_INT32(1024 + 0.5f));
+    fval -= FLOAT_2_INT32(1024);
+#endif
+    du[0] = (int)FLOAT_2_INT32_SCALE_BACK(FLOAT_2_INT32_SCALE_BACK(fval));
+    return 1;
+}
 
+#if TJE_USE_FAST_DCT
+// ============================================================
+// Accurate integer DCT (TJE_DCT_ISLOW).
+//
+// The Loeffler-Ligtenberg-Moschytz DCT with 13-bit constants and 2 extra bits
+// between the passes, as in libjpeg's jfdctint.c, so its output matches
+// libjpeg's islow for the same samples. The samples are rounded to integers
+// first, the output is scaled by 8, and the quantizer rounds to nearest
+// instead of truncating.
+// ============================================================
 
-    // Encode DC coefficient.
-    diff = du[0] - *pred;
-    *pred = du[0];
-    if(diff != 0) {
-        tjei_calculate_variable_length_int(diff, vli);
-        // Write number of bits with Huffman coding
-        tjei_write_bits(state, bitbuffer, location, huff_dc_len[vli[1]], huff_dc_code[vli[1]]);
-        // Write the bits.
-        tjei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
-    } else {
-        tjei_write_bits(state, bitbuffer, location, huff_dc_len[0], huff_dc_code[0]);
-    }
+#define TJEI_ISLOW_CONST_BITS 13
+#define TJEI_ISLOW_PASS1_BITS 2
+#define TJEI_ISLOW_DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+#define TJEI_FIX_0_298631336  2446
+#define TJEI_FIX_0_390180644  3196
+#define TJEI_FIX_0_541196100  4433
+#define TJEI_FIX_0_765366865  6270
+#define TJEI_FIX_0_899976223  7373
+#define TJEI_FIX_1_175875602  9633
+#define TJEI_FIX_1_501321110  12299
+#define TJEI_FIX_1_847759065  15137
+#define TJEI_FIX_1_961570560  16069
+#define TJEI_FIX_2_053119869  16819
+#define TJEI_FIX_2_562915447  20995
+#define TJEI_FIX_3_072711026  25172
 
-    // ==== Encode AC coefficients ====
+#ifdef FLOAT_INT_MODE
+#define TJEI_SAMPLE_TO_INT(v) ((int32_t)(((v) + 512) >> 10))
+#else
+#define TJEI_SAMPLE_TO_INT(v) ((int32_t)floorf((v) + 0.5f))
+#endif
 
-    last_non_zero_i = 0;
-    // Find the last non-zero element.
-    for(i = 63; i > 0; --i) {
-        if(du[i] != 0) {
-            last_non_zero_i = i;
-            break;
-        }
-    }
+static void tjei_fdct_islow(int32_t* data)
+{
+    int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    int32_t tmp10, tmp11, tmp12, tmp13;
+    int32_t z1, z2, z3, z4, z5;
+    int32_t* dataptr;
+    int ctr;
 
-    for(i = 1; i <= last_non_zero_i; ++i) {
-        // If zero, increase count. If >=15, encode (FF,00)
-        int zero_count = 0;
-        while(du[i] == 0) {
-            ++zero_count;
-            ++i;
-            if(zero_count == 16) {
-                // encode (ff,00) == 0xf0
-                tjei_write_bits(state, bitbuffer, location, huff_ac_len[0xf0], huff_ac_code[0xf0]);
-                zero_count = 0;
-            }
-        }
-        tjei_calculate_variable_length_int(du[i], vli);
+    // Pass 1: rows. Results are scaled up by 2^PASS1_BITS.
+    dataptr = data;
+    for(ctr = 0; ctr < 8; ++ctr, dataptr += 8) {
+        tmp0 = dataptr[0] + dataptr[7];
+        tmp7 = dataptr[0] - dataptr[7];
+        tmp1 = dataptr[1] + dataptr[6];
+        tmp6 = dataptr[1] - dataptr[6];
+        tmp2 = dataptr[2] + dataptr[5];
+        tmp5 = dataptr[2] - dataptr[5];
+        tmp3 = dataptr[3] + dataptr[4];
+        tmp4 = dataptr[3] - dataptr[4];
 
-        assert(zero_count < 0x10);
-        assert(vli[1] <= 10);
+        // Even part.
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
 
-        uint16_t sym1 = (uint16_t)((uint16_t)zero_count << 4) | vli[1];
+        dataptr[0] = (tmp10 + tmp11) << TJEI_ISLOW_PASS1_BITS;
+        dataptr[4] = (tmp10 - tmp11) << TJEI_ISLOW_PASS1_BITS;
+
+        z1 = (tmp12 + tmp13) * TJEI_FIX_0_541196100;
+        dataptr[2] = TJEI_ISLOW_DESCALE(z1 + tmp13 * TJEI_FIX_0_765366865, TJEI_ISLOW_CONST_BITS - TJEI_ISLOW_PASS1_BITS);
+        dataptr[6] = TJEI_ISLOW_DESCALE(z1 - tmp12 * TJEI_FIX_1_847759065, TJEI_ISLOW_CONST_BITS - TJEI_ISLOW_PASS1_BITS);
+
+        // Odd part.
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * TJEI_FIX_1_175875602;
+
+        tmp4 *= TJEI_FIX_0_298631336;
+        tmp5 *= TJEI_FIX_2_053119869;
+        tmp6 *= TJEI_FIX_3_072711026;
+        tmp7 *= TJEI_FIX_1_501321110;
+        z1 *= -TJEI_FIX_0_899976223;
+        z2 *= -TJEI_FIX_2_562915447;
+        z3 *= -TJEI_FIX_1_961570560;
+        z4 *= -TJEI_FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        dataptr[7] = TJEI_ISLOW_DESCALE(tmp4 + z1 + z3, TJEI_ISLOW_CONST_BITS - TJEI_ISLOW_PASS1_BITS);
+        dataptr[5] = TJEI_ISLOW_DESCALE(tmp5 + z2 + z4, TJEI_ISLOW_CONST_BITS - TJEI_ISLOW_PASS1_BITS);
+        dataptr[3] = TJEI_ISLOW_DESCALE(tmp6 + z2 + z3, TJEI_ISLOW_CONST_BITS - TJEI_ISLOW_PASS1_BITS);
+        dataptr[1] = TJEI_ISLOW_DESCALE(tmp7 + z1 + z4, TJEI_ISLOW_CONST_BITS - TJEI_ISLOW_PASS1_BITS);
+    }
 
-        assert(huff_ac_len[sym1] != 0);
+    // Pass 2: columns. Removes the PASS1_BITS scaling; the output is 8x the
+    // true DCT.
+    dataptr = data;
+    for(ctr = 0; ctr < 8; ++ctr, ++dataptr) {
+        tmp0 = dataptr[8 * 0] + dataptr[8 * 7];
+        tmp7 = dataptr[8 * 0] - dataptr[8 * 7];
+        tmp1 = dataptr[8 * 1] + dataptr[8 * 6];
+        tmp6 = dataptr[8 * 1] - dataptr[8 * 6];
+        tmp2 = dataptr[8 * 2] + dataptr[8 * 5];
+        tmp5 = dataptr[8 * 2] - dataptr[8 * 5];
+        tmp3 = dataptr[8 * 3] + dataptr[8 * 4];
+        tmp4 = dataptr[8 * 3] - dataptr[8 * 4];
+
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
 
-        // Write symbol 1  --- (RUNLENGTH, SIZE)
-        tjei_write_bits(state, bitbuffer, location, huff_ac_len[sym1], huff_ac_code[sym1]);
-        // Write symbol 2  --- (AMPLITUDE)
-        tjei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
+        dataptr[8 * 0] = TJEI_ISLOW_DESCALE(tmp10 + tmp11, TJEI_ISLOW_PASS1_BITS);
+        dataptr[8 * 4] = TJEI_ISLOW_DESCALE(tmp10 - tmp11, TJEI_ISLOW_PASS1_BITS);
+
+        z1 = (tmp12 + tmp13) * TJEI_FIX_0_541196100;
+        dataptr[8 * 2] = TJEI_ISLOW_DESCALE(z1 + tmp13 * TJEI_FIX_0_765366865, TJEI_ISLOW_CONST_BITS + TJEI_ISLOW_PASS1_BITS);
+        dataptr[8 * 6] = TJEI_ISLOW_DESCALE(z1 - tmp12 * TJEI_FIX_1_847759065, TJEI_ISLOW_CONST_BITS + TJEI_ISLOW_PASS1_BITS);
+
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * TJEI_FIX_1_175875602;
+
+        tmp4 *= TJEI_FIX_0_298631336;
+        tmp5 *= TJEI_FIX_2_053119869;
+        tmp6 *= TJEI_FIX_3_072711026;
+        tmp7 *= TJEI_FIX_1_501321110;
+        z1 *= -TJEI_FIX_0_899976223;
+        z2 *= -TJEI_FIX_2_562915447;
+        z3 *= -TJEI_FIX_1_961570560;
+        z4 *= -TJEI_FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        dataptr[8 * 7] = TJEI_ISLOW_DESCALE(tmp4 + z1 + z3, TJEI_ISLOW_CONST_BITS + TJEI_ISLOW_PASS1_BITS);
+        dataptr[8 * 5] = TJEI_ISLOW_DESCALE(tmp5 + z2 + z4, TJEI_ISLOW_CONST_BITS + TJEI_ISLOW_PASS1_BITS);
+        dataptr[8 * 3] = TJEI_ISLOW_DESCALE(tmp6 + z2 + z3, TJEI_ISLOW_CONST_BITS + TJEI_ISLOW_PASS1_BITS);
+        dataptr[8 * 1] = TJEI_ISLOW_DESCALE(tmp7 + z1 + z4, TJEI_ISLOW_CONST_BITS + TJEI_ISLOW_PASS1_BITS);
     }
+}
 
-    if(last_non_zero_i != 63) {
-        // write EOB HUFF(00,00)
-        tjei_write_bits(state, bitbuffer, location, huff_ac_len[0], huff_ac_code[0]);
+// Rounds coef / div to nearest, halves away from zero, as libjpeg's quantizer.
+TJEI_FORCE_INLINE int tjei_islow_divide(int32_t coef, const TJEDivisors* qt, int i)
+{
+    uint32_t n = (uint32_t)(coef < 0 ? -coef : coef) + (qt->div[i] >> 1);
+    int val = (int)(((uint64_t)n * qt->rcp[i]) >> 32);
+    return coef < 0 ? -val : val;
+}
+
+// Same contract as tjei_flat_block_quant(): returns 1 with only du[0] set for
+// a flat block, else 0 with all of du set.
+static int tjei_islow_quant(const FLOAT_INT32_T* mcu, const TJEDivisors* qt, int du[64])
+{
+    int32_t data[64];
+    int32_t diff = 0;
+    int i;
+    for(i = 0; i < 64; ++i) {
+        data[i] = TJEI_SAMPLE_TO_INT(mcu[i]);
+        diff |= data[i] ^ data[0];
+    }
+    if(!diff) {
+        // The DC term of a flat block is 8 * 8 * sample; no AC.
+        du[0] = tjei_islow_divide(data[0] * 64, qt, 0);
+        return 1;
+    }
+    tjei_fdct_islow(data);
+    for(i = 0; i < 64; ++i) {
+        du[tjei_zig_zag[i]] = tjei_islow_divide(data[i], qt, i);
     }
-    return;
+    return 0;
 }
+#endif
 
-enum {
-    TJEI_LUMA_DC,
-    TJEI_LUMA_AC,
-    TJEI_CHROMA_DC,
-    TJEI_CHROMA_AC,
-};
+#if defined(FLOAT_INT_MODE) && TJE_USE_FAST_DCT && \
+    (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#define TJEI_HAS_X86_SIMD 1
+#else
+#define TJEI_HAS_X86_SIMD 0
+#endif
 
-#if TJE_USE_FAST_DCT
-struct TJEProcessedQT {
-    FLOAT_INT32_T chroma[64];
-    FLOAT_INT32_T luma[64];
-};
+#if TJEI_HAS_X86_SIMD
+
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TJEI_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define TJEI_TARGET_AVX2 __attribute__((target("avx2")))
 #endif
 
-// Set up huffman tables in state.
-static OPTIMIZE_ATTR void tjei_huff_expand(TJEState* state)
-{
-    int i, k;
-    assert(state);
+#define TJEI_C4     FLOAT_2_INT32(0.707106781)
+#define TJEI_C6     FLOAT_2_INT32(0.382683433)
+#define TJEI_C2_C6  FLOAT_2_INT32(0.541196100)
+#define TJEI_C2PC6  FLOAT_2_INT32(1.306562965)
 
-    state->ht_bits[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc_len;
-    state->ht_bits[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac_len;
-    state->ht_bits[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc_len;
-    state->ht_bits[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac_len;
+// ---- SSE2: four data units rows per register, block held as two halves.
 
-    state->ht_vals[TJEI_LUMA_DC]   = tjei_default_ht_luma_dc;
-    state->ht_vals[TJEI_LUMA_AC]   = tjei_default_ht_luma_ac;
-    state->ht_vals[TJEI_CHROMA_DC] = tjei_default_ht_chroma_dc;
-    state->ht_vals[TJEI_CHROMA_AC] = tjei_default_ht_chroma_ac;
+// x / 1024 with C (truncate toward zero) semantics.
+static __m128i tjei_sse2_scale_back(__m128i x)
+{
+    __m128i bias = _mm_and_si128(_mm_srai_epi32(x, 31), _mm_set1_epi32(1023));
+    return _mm_srai_epi32(_mm_add_epi32(x, bias), 10);
+}
 
-    // How many codes in total for each of LUMA_(DC|AC) and CHROMA_(DC|AC)
-    int32_t spec_tables_len[4] = { 0 };
+// Low 32 bits of a 32x32 multiply. SSE2 only has the even-lane widening one.
+static __m128i tjei_sse2_mullo(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd  = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd,  _MM_SHUFFLE(0, 0, 2, 0)));
+}
 
-    for(i = 0; i < 4; ++i) {
-        for(k = 0; k < 16; ++k) {
-            spec_tables_len[i] += state->ht_bits[i][k];
-        }
-    }
+static __m128i tjei_sse2_mulc(__m128i x, int32_t c)
+{
+    return tjei_sse2_mullo(tjei_sse2_scale_back(x), _mm_set1_epi32(c));
+}
 
-    // Fill out the extended tables..
-    for(i = 0; i < 4; ++i) {
-        assert(256 >= spec_tables_len[i]);
-        tjei_huff_get_code_lengths(state->huffsize[i], state->ht_bits[i]);
-        tjei_huff_get_codes(state->huffcode[i], state->huffsize[i], spec_tables_len[i]);
-    }
-    for(i = 0; i < 4; ++i) {
-        int64_t count = spec_tables_len[i];
-        tjei_huff_get_extended(state->ehuffsize[i],
-                               state->ehuffcode[i],
-                               state->ht_vals[i],
-                               &state->huffsize[i][0],
-                               &state->huffcode[i][0], count);
-    }
+static void tjei_sse2_transpose4(__m128i* a, __m128i* b, __m128i* c, __m128i* d)
+{
+    __m128i t0 = _mm_unpacklo_epi32(*a, *b);
+    __m128i t1 = _mm_unpacklo_epi32(*c, *d);
+    __m128i t2 = _mm_unpackhi_epi32(*a, *b);
+    __m128i t3 = _mm_unpackhi_epi32(*c, *d);
+    *a = _mm_unpacklo_epi64(t0, t1);
+    *b = _mm_unpackhi_epi64(t0, t1);
+    *c = _mm_unpacklo_epi64(t2, t3);
+    *d = _mm_unpackhi_epi64(t2, t3);
 }
 
-static OPTIMIZE_ATTR int tjei_encode_main(TJEState* state,
-        const unsigned char* src_data,
-        const int width,
-        const int height,
-        const int src_num_components)
+// One AAN pass over eight registers; register k holds element k of each lane's vector.
+static void tjei_sse2_fdct_1d(__m128i* d)
 {
-    int i, x, y, off_y, off_x;
+    __m128i tmp0 = _mm_add_epi32(d[0], d[7]);
+    __m128i tmp7 = _mm_sub_epi32(d[0], d[7]);
+    __m128i tmp1 = _mm_add_epi32(d[1], d[6]);
+    __m128i tmp6 = _mm_sub_epi32(d[1], d[6]);
+    __m128i tmp2 = _mm_add_epi32(d[2], d[5]);
+    __m128i tmp5 = _mm_sub_epi32(d[2], d[5]);
+    __m128i tmp3 = _mm_add_epi32(d[3], d[4]);
+    __m128i tmp4 = _mm_sub_epi32(d[3], d[4]);
+    __m128i tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5, z11, z13;
+
+    /* Even part */
+    tmp10 = _mm_add_epi32(tmp0, tmp3);
+    tmp13 = _mm_sub_epi32(tmp0, tmp3);
+    tmp11 = _mm_add_epi32(tmp1, tmp2);
+    tmp12 = _mm_sub_epi32(tmp1, tmp2);
+
+    d[0] = _mm_add_epi32(tmp10, tmp11);
+    d[4] = _mm_sub_epi32(tmp10, tmp11);
+
+    z1 = tjei_sse2_mulc(_mm_add_epi32(tmp12, tmp13), TJEI_C4);
+    d[2] = _mm_add_epi32(tmp13, z1);
+    d[6] = _mm_sub_epi32(tmp13, z1);
+
+    /* Odd part */
+    tmp10 = _mm_add_epi32(tmp4, tmp5);
+    tmp11 = _mm_add_epi32(tmp5, tmp6);
+    tmp12 = _mm_add_epi32(tmp6, tmp7);
+
+    z5 = tjei_sse2_mulc(_mm_sub_epi32(tmp10, tmp12), TJEI_C6);
+    z2 = _mm_add_epi32(tjei_sse2_mulc(tmp10, TJEI_C2_C6), z5);
+    z4 = _mm_add_epi32(tjei_sse2_mulc(tmp12, TJEI_C2PC6), z5);
+    z3 = tjei_sse2_mulc(tmp11, TJEI_C4);
+
+    z11 = _mm_add_epi32(tmp7, z3);
+    z13 = _mm_sub_epi32(tmp7, z3);
+
+    d[5] = _mm_add_epi32(z13, z2);
+    d[3] = _mm_sub_epi32(z13, z2);
+    d[1] = _mm_add_epi32(z11, z4);
+    d[7] = _mm_sub_epi32(z11, z4);
+}
 
-    if(src_num_components != 3 && src_num_components != 4) {
-        return 0;
+static void tjei_fdct_quant_sse2(const FLOAT_INT32_T* mcu, const FLOAT_INT32_T* qt, int du[64])
+{
+    // lo[k]/hi[k]: columns 0-3 / 4-7 of row k.
+    __m128i lo[8], hi[8];
+    int32_t out[64];
+    int i;
+
+    for(i = 0; i < 8; ++i) {
+        lo[i] = _mm_loadu_si128((const __m128i*)(mcu + i * 8));
+        hi[i] = _mm_loadu_si128((const __m128i*)(mcu + i * 8 + 4));
     }
 
-    if(width > 0xffff || height > 0xffff) {
-        return 0;
+    /* Pass 1: rows. Transpose so that register k holds column k of four rows. */
+    {
+        __m128i top[8], bot[8];
+        top[0] = lo[0]; top[1] = lo[1]; top[2] = lo[2]; top[3] = lo[3];
+        top[4] = hi[0]; top[5] = hi[1]; top[6] = hi[2]; top[7] = hi[3];
+        bot[0] = lo[4]; bot[1] = lo[5]; bot[2] = lo[6]; bot[3] = lo[7];
+        bot[4] = hi[4]; bot[5] = hi[5]; bot[6] = hi[6]; bot[7] = hi[7];
+        tjei_sse2_transpose4(&top[0], &top[1], &top[2], &top[3]);
+        tjei_sse2_transpose4(&top[4], &top[5], &top[6], &top[7]);
+        tjei_sse2_transpose4(&bot[0], &bot[1], &bot[2], &bot[3]);
+        tjei_sse2_transpose4(&bot[4], &bot[5], &bot[6], &bot[7]);
+
+        tjei_sse2_fdct_1d(top);
+        tjei_sse2_fdct_1d(bot);
+
+        tjei_sse2_transpose4(&top[0], &top[1], &top[2], &top[3]);
+        tjei_sse2_transpose4(&top[4], &top[5], &top[6], &top[7]);
+        tjei_sse2_transpose4(&bot[0], &bot[1], &bot[2], &bot[3]);
+        tjei_sse2_transpose4(&bot[4], &bot[5], &bot[6], &bot[7]);
+        lo[0] = top[0]; lo[1] = top[1]; lo[2] = top[2]; lo[3] = top[3];
+        hi[0] = top[4]; hi[1] = top[5]; hi[2] = top[6]; hi[3] = top[7];
+        lo[4] = bot[0]; lo[5] = bot[1]; lo[6] = bot[2]; lo[7] = bot[3];
+        hi[4] = bot[4]; hi[5] = bot[5]; hi[6] = bot[6]; hi[7] = bot[7];
     }
 
-#if TJE_USE_FAST_DCT
+    /* Pass 2: columns. Rows are already laid out one per register. */
+    tjei_sse2_fdct_1d(lo);
+    tjei_sse2_fdct_1d(hi);
+
+    /* Quantize: (dct * qt) / 1024 / 1024, truncated, as in the scalar path. */
+    for(i = 0; i < 8; ++i) {
+        __m128i bias = _mm_set1_epi32((1 << 20) - 1);
+        __m128i l = tjei_sse2_mullo(lo[i], _mm_loadu_si128((const __m128i*)(qt + i * 8)));
+        __m128i h = tjei_sse2_mullo(hi[i], _mm_loadu_si128((const __m128i*)(qt + i * 8 + 4)));
+        l = _mm_srai_epi32(_mm_add_epi32(l, _mm_and_si128(_mm_srai_epi32(l, 31), bias)), 20);
+        h = _mm_srai_epi32(_mm_add_epi32(h, _mm_and_si128(_mm_srai_epi32(h, 31), bias)), 20);
+        _mm_storeu_si128((__m128i*)(out + i * 8), l);
+        _mm_storeu_si128((__m128i*)(out + i * 8 + 4), h);
+    }
 
-    struct TJEProcessedQT pqt;
-    // Again, taken from classic japanese implementation.
-    //
-    /* For float AA&N IDCT method, divisors are equal to quantization
-     * coefficients scaled by scalefactor[row]*scalefactor[col], where
-     *   scalefactor[0] = 1
-     *   scalefactor[k] = cos(k*PI/16) * sqrt(2)    for k=1..7
-     * We apply a further scale factor of 8.
-     * What's actually stored is 1/divisor so that the inner loop can
-     * use a multiplication rather than a division.
-     */
-    static const FLOAT_INT32_T aan_scales[] = {
-        FLOAT_2_INT32(1.0f), FLOAT_2_INT32(1.387039845f), FLOAT_2_INT32(1.306562965f), FLOAT_2_INT32(1.175875602f),
-        FLOAT_2_INT32(1.0f), FLOAT_2_INT32(0.785694958f), FLOAT_2_INT32(0.541196100f), FLOAT_2_INT32(0.275899379f)
-    };
+    for(i = 0; i < 64; ++i) {
+        du[tjei_zig_zag[i]] = out[i];
+    }
+}
 
-    // build (de)quantization tables
-    for(y = 0; y < 8; y++) {
-        for(x = 0; x < 8; x++) {
-            FLOAT_INT32_T tmp = 0;
-            int i = y * 8 + x;
-            tmp = FLOAT_2_INT32(1.0f) / 8;
-            tmp = FLOAT_2_INT32(tmp) / aan_scales[x];
-            tmp = FLOAT_2_INT32(tmp) / aan_scales[y];
-            tmp =  FLOAT_2_INT32(tmp) / INT8_2_INT32(state->qt_luma[tjei_zig_zag[i]]);
-            pqt.luma[y*8+x] = tmp;
-            //pqt.luma[y*8+x] = FLOAT_2_INT32(1.0f) / (8 * aan_scales[x] * aan_scales[y] * INT8_2_INT32(state->qt_luma[tjei_zig_zag[i]]));
-            tmp = FLOAT_2_INT32(1.0f) / 8;
-            tmp = FLOAT_2_INT32(tmp) / aan_scales[x];
-            tmp = FLOAT_2_INT32(tmp) / aan_scales[y];
-            tmp = FLOAT_2_INT32(tmp) / INT8_2_INT32(state->qt_chroma[tjei_zig_zag[i]]);
-            pqt.chroma[y*8+x] = tmp;
+// ---- AVX2: one row per register.
+
+TJEI_TARGET_AVX2 static __m256i tjei_avx2_mulc(__m256i x, int32_t c)
+{
+    __m256i bias = _mm256_and_si256(_mm256_srai_epi32(x, 31), _mm256_set1_epi32(1023));
+    x = _mm256_srai_epi32(_mm256_add_epi32(x, bias), 10);
+    return _mm256_mullo_epi32(x, _mm256_set1_epi32(c));
+}
+
+TJEI_TARGET_AVX2 static void tjei_avx2_transpose8(__m256i* r)
+{
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+TJEI_TARGET_AVX2 static void tjei_avx2_fdct_1d(__m256i* d)
+{
+    __m256i tmp0 = _mm256_add_epi32(d[0], d[7]);
+    __m256i tmp7 = _mm256_sub_epi32(d[0], d[7]);
+    __m256i tmp1 = _mm256_add_epi32(d[1], d[6]);
+    __m256i tmp6 = _mm256_sub_epi32(d[1], d[6]);
+    __m256i tmp2 = _mm256_add_epi32(d[2], d[5]);
+    __m256i tmp5 = _mm256_sub_epi32(d[2], d[5]);
+    __m256i tmp3 = _mm256_add_epi32(d[3], d[4]);
+    __m256i tmp4 = _mm256_sub_epi32(d[3], d[4]);
+    __m256i tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5, z11, z13;
+
+    /* Even part */
+    tmp10 = _mm256_add_epi32(tmp0, tmp3);
+    tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+    tmp11 = _mm256_add_epi32(tmp1, tmp2);
+    tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+    d[0] = _mm256_add_epi32(tmp10, tmp11);
+    d[4] = _mm256_sub_epi32(tmp10, tmp11);
+
+    z1 = tjei_avx2_mulc(_mm256_add_epi32(tmp12, tmp13), TJEI_C4);
+    d[2] = _mm256_add_epi32(tmp13, z1);
+    d[6] = _mm256_sub_epi32(tmp13, z1);
+
+    /* Odd part */
+    tmp10 = _mm256_add_epi32(tmp4, tmp5);
+    tmp11 = _mm256_add_epi32(tmp5, tmp6);
+    tmp12 = _mm256_add_epi32(tmp6, tmp7);
+
+    z5 = tjei_avx2_mulc(_mm256_sub_epi32(tmp10, tmp12), TJEI_C6);
+    z2 = _mm256_add_epi32(tjei_avx2_mulc(tmp10, TJEI_C2_C6), z5);
+    z4 = _mm256_add_epi32(tjei_avx2_mulc(tmp12, TJEI_C2PC6), z5);
+    z3 = tjei_avx2_mulc(tmp11, TJEI_C4);
+
+    z11 = _mm256_add_epi32(tmp7, z3);
+    z13 = _mm256_sub_epi32(tmp7, z3);
+
+    d[5] = _mm256_add_epi32(z13, z2);
+    d[3] = _mm256_sub_epi32(z13, z2);
+    d[1] = _mm256_add_epi32(z11, z4);
+    d[7] = _mm256_sub_epi32(z11, z4);
+}
+
+TJEI_TARGET_AVX2 static void tjei_fdct_quant_avx2(const FLOAT_INT32_T* mcu, const FLOAT_INT32_T* qt, int du[64])
+{
+    __m256i r[8];
+    int32_t out[64];
+    int i;
+
+    for(i = 0; i < 8; ++i) {
+        r[i] = _mm256_loadu_si256((const __m256i*)(mcu + i * 8));
+    }
+
+    /* Pass 1: rows (on the transposed block). Pass 2: columns. */
+    tjei_avx2_transpose8(r);
+    tjei_avx2_fdct_1d(r);
+    tjei_avx2_transpose8(r);
+    tjei_avx2_fdct_1d(r);
+
+    for(i = 0; i < 8; ++i) {
+        __m256i v = _mm256_mullo_epi32(r[i], _mm256_loadu_si256((const __m256i*)(qt + i * 8)));
+        __m256i bias = _mm256_and_si256(_mm256_srai_epi32(v, 31), _mm256_set1_epi32((1 << 20) - 1));
+        v = _mm256_srai_epi32(_mm256_add_epi32(v, bias), 20);
+        _mm256_storeu_si256((__m256i*)(out + i * 8), v);
+    }
+
+    for(i = 0; i < 64; ++i) {
+        du[tjei_zig_zag[i]] = out[i];
+    }
+}
+
+static int tjei_cpu_simd_level(void)
+{
+#if defined(_MSC_VER)
+    int regs[4];
+    int max_leaf;
+    __cpuid(regs, 0);
+    max_leaf = regs[0];
+    __cpuid(regs, 1);
+    if(!(regs[3] & (1 << 26))) {
+        return TJE_SIMD_NONE;
+    }
+    // AVX2 needs the OS to save YMM state (OSXSAVE + XCR0 bits 1,2) as well as the CPUID bit.
+    if(max_leaf < 7 || !(regs[2] & (1 << 27)) || !(regs[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6) {
+        return TJE_SIMD_SSE2;
+    }
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) ? TJE_SIMD_AVX2 : TJE_SIMD_SSE2;
+#else
+    unsigned int a, b, c, d, xcr0_lo, xcr0_hi;
+    if(!__get_cpuid(1, &a, &b, &c, &d) || !(d & bit_SSE2)) {
+        return TJE_SIMD_NONE;
+    }
+    if(!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return TJE_SIMD_SSE2;
+    }
+    __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if((xcr0_lo & 6) != 6 || !__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+        return TJE_SIMD_SSE2;
+    }
+    return (b & bit_AVX2) ? TJE_SIMD_AVX2 : TJE_SIMD_SSE2;
+#endif
+}
+
+#endif // TJEI_HAS_X86_SIMD
+
+// ============================================================
+// Color conversion.
+//
+// tjei_load_block() fetches one 8x8 data unit from the source image and
+// converts it to level-shifted Y, Cb, Cr in FLOAT_INT32_T. Pixels past the
+// right/bottom edge repeat the last column/row. BGRX blocks that lie fully
+// inside the image go through the SSE2 kernel, which computes the same
+// x1024 integer products as the scalar code, so both give identical blocks.
+// ============================================================
+
+#define TJEI_RGB_TO_YCBCR(r, g, b, y, cb, cr) do { \
+        (y)  = FLOAT_2_INT32(0.299f)   * (r) + FLOAT_2_INT32(0.587f)    * (g) + FLOAT_2_INT32(0.114f)    * (b) - FLOAT_2_INT32(128); \
+        (cb) = FLOAT_2_INT32(-0.1687f) * (r) - FLOAT_2_INT32(0.3313f)   * (g) + FLOAT_2_INT32(0.5f)      * (b); \
+        (cr) = FLOAT_2_INT32(0.5f)     * (r) - FLOAT_2_INT32(0.4187f)   * (g) - FLOAT_2_INT32(0.0813f)   * (b); \
+    } while(0)
+
+typedef void tjei_load_block_func(const uint8_t* src, int pitch,
+                                  FLOAT_INT32_T* du_y, FLOAT_INT32_T* du_b, FLOAT_INT32_T* du_r);
+
+// Generic path: any supported layout, clamps at the image edges.
+static void tjei_load_block_c(const TJEState* state, int x, int y,
+                              FLOAT_INT32_T* du_y, FLOAT_INT32_T* du_b, FLOAT_INT32_T* du_r)
+{
+    int off_x, off_y;
+    int bpp = (state->src_format == TJE_RGB) ? 3 : 4;
+    int ri = (state->src_format == TJE_BGRX) ? 2 : 0;
+
+    for(off_y = 0; off_y < 8; ++off_y) {
+        int row = y + off_y;
+        if(row >= state->height) {
+            row = state->height - 1;
+        }
+        const uint8_t* line = state->src_data + (size_t)row * state->src_pitch;
+        for(off_x = 0; off_x < 8; ++off_x) {
+            int block_index = (off_y * 8 + off_x);
+            int col = x + off_x;
+            if(col >= state->width) {
+                col = state->width - 1;
+            }
+            const uint8_t* px = line + col * bpp;
+            uint8_t r = px[ri];
+            uint8_t g = px[1];
+            uint8_t b = px[2 - ri];
+
+            TJEI_RGB_TO_YCBCR(r, g, b, du_y[block_index], du_b[block_index], du_r[block_index]);
+        }
+    }
+}
+
+static void tjei_load_bgrx_block_c(const uint8_t* src, int pitch,
+                                   FLOAT_INT32_T* du_y, FLOAT_INT32_T* du_b, FLOAT_INT32_T* du_r)
+{
+    int off_x, off_y;
+    for(off_y = 0; off_y < 8; ++off_y) {
+        const uint8_t* px = src + (size_t)off_y * pitch;
+        for(off_x = 0; off_x < 8; ++off_x, px += 4) {
+            int block_index = (off_y * 8 + off_x);
+            TJEI_RGB_TO_YCBCR(px[2], px[1], px[0], du_y[block_index], du_b[block_index], du_r[block_index]);
+        }
+    }
+}
+
+#if TJEI_HAS_X86_SIMD
+
+// Two signed 16-bit multipliers in one 32-bit lane, for _mm_madd_epi16.
+#define TJEI_PAIR16(lo, hi) ((int)(((uint32_t)((hi) & 0xffff) << 16) | (uint32_t)((lo) & 0xffff)))
+
+static void tjei_load_bgrx_block_sse2(const uint8_t* src, int pitch,
+                                      FLOAT_INT32_T* du_y, FLOAT_INT32_T* du_b, FLOAT_INT32_T* du_r)
+{
+    const __m128i mask_b  = _mm_set1_epi32(0x000000ff);
+    const __m128i mask_g  = _mm_set1_epi32(0x0000ff00);
+    // (b, g) pairs and (r, 0) pairs against the same coefficients as TJEI_RGB_TO_YCBCR.
+    const __m128i y_bg  = _mm_set1_epi32(TJEI_PAIR16(FLOAT_2_INT32(0.114f), FLOAT_2_INT32(0.587f)));
+    const __m128i y_r   = _mm_set1_epi32(FLOAT_2_INT32(0.299f));
+    const __m128i cb_bg = _mm_set1_epi32(TJEI_PAIR16(FLOAT_2_INT32(0.5f), -FLOAT_2_INT32(0.3313f)));
+    const __m128i cb_r  = _mm_set1_epi32(TJEI_PAIR16(FLOAT_2_INT32(-0.1687f), 0));
+    const __m128i cr_bg = _mm_set1_epi32(TJEI_PAIR16(-FLOAT_2_INT32(0.0813f), -FLOAT_2_INT32(0.4187f)));
+    const __m128i cr_r  = _mm_set1_epi32(FLOAT_2_INT32(0.5f));
+    const __m128i y_off = _mm_set1_epi32(FLOAT_2_INT32(128));
+    int off_y, half;
+
+    for(off_y = 0; off_y < 8; ++off_y) {
+        const uint8_t* line = src + (size_t)off_y * pitch;
+        for(half = 0; half < 2; ++half) {
+            __m128i px = _mm_loadu_si128((const __m128i*)(line + half * 16));
+            __m128i bg = _mm_or_si128(_mm_and_si128(px, mask_b), _mm_slli_epi32(_mm_and_si128(px, mask_g), 8));
+            __m128i rr = _mm_and_si128(_mm_srli_epi32(px, 16), mask_b);
+            __m128i vy  = _mm_sub_epi32(_mm_add_epi32(_mm_madd_epi16(bg, y_bg), _mm_madd_epi16(rr, y_r)), y_off);
+            __m128i vcb = _mm_add_epi32(_mm_madd_epi16(bg, cb_bg), _mm_madd_epi16(rr, cb_r));
+            __m128i vcr = _mm_add_epi32(_mm_madd_epi16(bg, cr_bg), _mm_madd_epi16(rr, cr_r));
+            int block_index = off_y * 8 + half * 4;
+            _mm_storeu_si128((__m128i*)(du_y + block_index), vy);
+            _mm_storeu_si128((__m128i*)(du_b + block_index), vcb);
+            _mm_storeu_si128((__m128i*)(du_r + block_index), vcr);
+        }
+    }
+}
+
+#endif // TJEI_HAS_X86_SIMD
+
+// Chosen by the first tjei_init_kernels() and again by every
+// tje_set_simd_level(), never during an encode. Slice workers read them
+// without a lock, so the level must not be changed while any encode runs.
+static tjei_fdct_quant_func* tjei_fdct_quant = tjei_fdct_quant_c;
+static tjei_load_block_func* tjei_load_bgrx_block = tjei_load_bgrx_block_c;
+static int tjei_simd_detected = -1;         // what the CPU and OS support, -1 until CPUID ran
+static int tjei_simd_cap = TJE_SIMD_AVX2;   // the tje_set_simd_level() limit
+static int tjei_simd_active = -1;           // min of the two, -1 until the kernels are chosen
+
+// CPUID and xgetbv run once. Two first callers racing here store the same level.
+static int tjei_detect_simd(void)
+{
+    if(tjei_simd_detected < 0) {
+#if TJEI_HAS_X86_SIMD
+        tjei_simd_detected = tjei_cpu_simd_level();
+#else
+        tjei_simd_detected = TJE_SIMD_NONE;
+#endif
+    }
+    return tjei_simd_detected;
+}
+
+static void tjei_select_kernels(void)
+{
+    int level = tjei_detect_simd();
+    if(level > tjei_simd_cap) {
+        level = tjei_simd_cap;
+    }
+    switch(level) {
+#if TJEI_HAS_X86_SIMD
+    case TJE_SIMD_AVX2:
+        tjei_fdct_quant = tjei_fdct_quant_avx2;
+        tjei_load_bgrx_block = tjei_load_bgrx_block_sse2;
+        break;
+    case TJE_SIMD_SSE2:
+        tjei_fdct_quant = tjei_fdct_quant_sse2;
+        tjei_load_bgrx_block = tjei_load_bgrx_block_sse2;
+        break;
+#endif
+    default:
+        level = TJE_SIMD_NONE;
+        tjei_fdct_quant = tjei_fdct_quant_c;
+        tjei_load_bgrx_block = tjei_load_bgrx_block_c;
+        break;
+    }
+    tjei_simd_active = level;
+}
+
+// The kernels for the detected level on first use; later calls change nothing.
+static void tjei_init_kernels(void)
+{
+    if(tjei_simd_active < 0) {
+        tjei_select_kernels();
+    }
+}
+
+void tje_set_simd_level(int max_level)
+{
+    tjei_simd_cap = max_level;
+    tjei_select_kernels();
+}
+
+int tje_get_simd_level(void)
+{
+    tjei_init_kernels();
+    return tjei_simd_active;
+}
+
+static void tjei_load_block(const TJEState* state, int x, int y,
+                            FLOAT_INT32_T* du_y, FLOAT_INT32_T* du_b, FLOAT_INT32_T* du_r)
+{
+    if(state->src_format == TJE_BGRX && x + 8 <= state->width && y + 8 <= state->height) {
+        tjei_load_bgrx_block(state->src_data + (size_t)y * state->src_pitch + x * 4, state->src_pitch,
+                             du_y, du_b, du_r);
+    } else {
+        tjei_load_block_c(state, x, y, du_y, du_b, du_r);
+    }
+}
+
+#define ABS(x) ((x) < 0 ? -(x) : (x))
+
+static void tjei_encode_and_write_MCU(TJEState* state,
+                                      FLOAT_INT32_T* mcu,
+#if TJE_USE_FAST_DCT
+                                      const TJEDivisors* qt,  // Pre-processed quantization matrix.
+#else
+                                      uint8_t* qt,
+#endif
+                                      uint8_t* huff_dc_len, uint16_t* huff_dc_code, // Huffman tables
+                                      uint8_t* huff_ac_len, uint16_t* huff_ac_code,
+                                      uint32_t* dc_freq, uint32_t* ac_freq, // Symbol counts, or NULL
+                                      int* pred)  // Previous DC coefficient
+{
+    // Work on a local copy so the bit buffer stays in registers.
+    TJEBitWriter bwl = state->bw;
+    TJEBitWriter* bw = &bwl;
+    int du[64];  // Data unit in zig-zag order
+    int i;
+    int diff, last_non_zero_i;
+    uint16_t vli[2];
+
+#if TJE_USE_FAST_DCT
+    int flat;
+    if(state->enc->dct_method == TJE_DCT_ISLOW) {
+        flat = tjei_islow_quant(mcu, qt, du);
+    } else {
+        flat = tjei_flat_block_quant(mcu, qt->aan, du);
+        if(!flat) {
+            tjei_fdct_quant(mcu, qt->aan, du);
+        }
+    }
+#else
+    const int flat = 0;
+    int u, v, val;
+    FLOAT_INT32_T dct_mcu[64];
+    for(v = 0; v < 8; ++v) {
+        for(u = 0; u < 8; ++u) {
+            dct_mcu[v * 8 + u] = slow_fdct(u, v, mcu);
         }
     }
+    for(i = 0; i < 64; ++i) {
+        FLOAT_INT32_T fval = dct_mcu[i] / (qt[i]);
+        val = (int)((fval > 0) ? floorf(FLOAT_2_INT32_SCALE_BACK(fval + FLOAT_2_INT32(0.5f)) : ceilf(FLOAT_2_INT32_SCALE_BACK(fval - FLOAT_2_INT32(0.5f)));
+                                        du[tjei_zig_zag[i]] = val;
+                                    }
 #endif
+
+
+
+    // Encode DC coefficient.
+    diff = du[0] - *pred;
+    *pred = du[0];
+    if(diff != 0) {
+        tjei_calculate_variable_length_int(diff, vli);
+        // Write number of bits with Huffman coding
+        tjei_write_bits(state, bw, huff_dc_len[vli[1]], huff_dc_code[vli[1]]);
+        // Write the bits.
+        tjei_write_bits(state, bw, vli[1], vli[0]);
+        if(dc_freq) {
+            dc_freq[vli[1]]++;
+        }
+    } else {
+        tjei_write_bits(state, bw, huff_dc_len[0], huff_dc_code[0]);
+        if(dc_freq) {
+            dc_freq[0]++;
+        }
+    }
+
+    // ==== Encode AC coefficients ====
+
+    last_non_zero_i = 0;
+    // Find the last non-zero element.
+    for(i = flat ? 0 : 63; i > 0; --i) {
+        if(du[i] != 0) {
+            last_non_zero_i = i;
+            break;
+        }
+    }
+
+    for(i = 1; i <= last_non_zero_i; ++i) {
+        // If zero, increase count. If >=15, encode (FF,00)
+        int zero_count = 0;
+        while(du[i] == 0) {
+            ++zero_count;
+            ++i;
+            if(zero_count == 16) {
+                // encode (ff,00) == 0xf0
+                tjei_write_bits(state, bw, huff_ac_len[0xf0], huff_ac_code[0xf0]);
+                if(ac_freq) {
+                    ac_freq[0xf0]++;
+                }
+                zero_count = 0;
+            }
+        }
+        tjei_calculate_variable_length_int(du[i], vli);
+
+        assert(zero_count < 0x10);
+        assert(vli[1] <= 10);
+
+        uint16_t sym1 = (uint16_t)((uint16_t)zero_count << 4) | vli[1];
+
+        assert(huff_ac_len[sym1] != 0);
+
+        // Write symbol 1  --- (RUNLENGTH, SIZE)
+        tjei_write_bits(state, bw, huff_ac_len[sym1], huff_ac_code[sym1]);
+        // Write symbol 2  --- (AMPLITUDE)
+        tjei_write_bits(state, bw, vli[1], vli[0]);
+        if(ac_freq) {
+            ac_freq[sym1]++;
+        }
+    }
+
+    if(last_non_zero_i != 63) {
+        // write EOB HUFF(00,00)
+        tjei_write_bits(state, bw, huff_ac_len[0], huff_ac_code[0]);
+        if(ac_freq) {
+            ac_freq[0]++;
+        }
+    }
+    state->bw = bwl;
+}
+
+// Set up huffman tables in the encoder from BITS/HUFFVAL specs. The Annex K
+// tables are set in tje_encoder_create().
+static OPTIMIZE_ATTR void tjei_huff_expand(struct TJEEncoder* enc,
+                                           uint8_t const * const bits[4], uint8_t const * const vals[4])
+{
+    uint8_t huffsize[4][257];
+    uint16_t huffcode[4][256];
+    int i, k;
+    assert(enc);
+
+    // How many codes in total for each of LUMA_(DC|AC) and CHROMA_(DC|AC)
+    int32_t spec_tables_len[4] = { 0 };
+
+    for(i = 0; i < 4; ++i) {
+        for(k = 0; k < 16; ++k) {
+            spec_tables_len[i] += bits[i][k];
+        }
+    }
+
+    // Fill out the extended tables..
+    for(i = 0; i < 4; ++i) {
+        assert(256 >= spec_tables_len[i]);
+        tjei_huff_get_code_lengths(huffsize[i], bits[i]);
+        tjei_huff_get_codes(huffcode[i], huffsize[i], spec_tables_len[i]);
+    }
+    memset(enc->ehuffsize, 0, sizeof(enc->ehuffsize));
+    memset(enc->ehuffcode, 0, sizeof(enc->ehuffcode));
+    for(i = 0; i < 4; ++i) {
+        int64_t count = spec_tables_len[i];
+        tjei_huff_get_extended(enc->ehuffsize[i],
+                               enc->ehuffcode[i],
+                               vals[i],
+                               &huffsize[i][0],
+                               &huffcode[i][0], count);
+    }
+}
+
+// Builds the optimal BITS/HUFFVAL spec for the symbol counts in freq, code
+// lengths limited to 16 bits (JPEG K.2). Every symbol in `symbols` gets a code
+// even if it was not seen, since the table is used for the next frame.
+static void tjei_huff_optimal(const uint32_t freq_in[256], const uint8_t* symbols, int num_symbols,
+                              uint8_t bits[16], uint8_t vals[256])
+{
+    uint32_t freq[257];
+    uint32_t total = 0;
+    int shift = 0;
+    int codesize[257];
+    int others[257];
+    int count[33];
+    int i, j, k;
+
+    // Scaled down to under 2^16 in total, which keeps the tree depth under 32.
+    for(i = 0; i < num_symbols; ++i) {
+        total += freq_in[symbols[i]] + 1;
+    }
+    while((total >> shift) >= 0x8000) {
+        ++shift;
+    }
+    memset(freq, 0, sizeof(freq));
+    for(i = 0; i < num_symbols; ++i) {
+        freq[symbols[i]] = (freq_in[symbols[i]] >> shift) + 1;
+    }
+    // Reserved symbol, so that no code is all ones (K.2).
+    freq[256] = 1;
+    for(i = 0; i < 257; ++i) {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+
+    for(;;) {
+        // The two least frequent symbols still in play; ties go to the larger value.
+        int c1 = -1, c2 = -1;
+        uint32_t v1 = 0xffffffff, v2 = 0xffffffff;
+        for(i = 0; i < 257; ++i) {
+            if(freq[i] && freq[i] <= v1) {
+                v2 = v1;
+                c2 = c1;
+                v1 = freq[i];
+                c1 = i;
+            } else if(freq[i] && freq[i] <= v2) {
+                v2 = freq[i];
+                c2 = i;
+            }
+        }
+        if(c2 < 0) {
+            break;
+        }
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        ++codesize[c1];
+        while(others[c1] >= 0) {
+            c1 = others[c1];
+            ++codesize[c1];
+        }
+        others[c1] = c2;
+        ++codesize[c2];
+        while(others[c2] >= 0) {
+            c2 = others[c2];
+            ++codesize[c2];
+        }
+    }
+
+    memset(count, 0, sizeof(count));
+    for(i = 0; i < 257; ++i) {
+        if(codesize[i]) {
+            assert(codesize[i] <= 32);
+            ++count[codesize[i]];
+        }
+    }
+    // Move codes longer than 16 bits up the tree (K.3).
+    for(i = 32; i > 16; --i) {
+        while(count[i] > 0) {
+            j = i - 2;
+            while(count[j] == 0) {
+                --j;
+            }
+            count[i] -= 2;
+            ++count[i - 1];
+            count[j + 1] += 2;
+            --count[j];
+        }
+    }
+    // Drop the reserved symbol, which has the longest code.
+    for(i = 16; count[i] == 0; --i) {
+    }
+    --count[i];
+
+    for(i = 0; i < 16; ++i) {
+        bits[i] = (uint8_t)count[i + 1];
+    }
+    // Symbols by code length. Equal lengths keep ascending symbol order.
+    k = 0;
+    for(i = 1; i <= 32; ++i) {
+        for(j = 0; j < 256; ++j) {
+            if(codesize[j] == i) {
+                vals[k++] = (uint8_t)j;
+            }
+        }
+    }
+}
+
+// Turns the symbol counts gathered since the last call into the tables and
+// DHT for the frames that follow. Called at the start of a frame, or when the
+// tables are written on their own in abbreviated mode.
+static void tjei_huff_adopt(struct TJEEncoder* enc)
+{
+    uint8_t dc_symbols[12];
+    uint8_t ac_symbols[162];
+    uint8_t bits[4][16];
+    uint8_t vals[4][256];
+    const uint8_t* pbits[4];
+    const uint8_t* pvals[4];
+    uint32_t seen = 0;
+    int i, n;
+
+    // Every block codes a DC symbol, so these show if anything was counted.
+    for(i = 0; i < 12; ++i) {
+        seen |= enc->freq[TJEI_LUMA_DC][i];
+    }
+    if(!enc->optimize_huffman || !seen) {
+        return;
+    }
+
+    // Legal symbols: DC categories 0-11; AC EOB, ZRL and run/size with size 1-10.
+    for(i = 0; i < 12; ++i) {
+        dc_symbols[i] = (uint8_t)i;
+    }
+    ac_symbols[0] = 0x00;
+    ac_symbols[1] = 0xf0;
+    n = 2;
+    for(i = 0; i < 256; ++i) {
+        if((i & 0x0f) >= 1 && (i & 0x0f) <= 10) {
+            ac_symbols[n++] = (uint8_t)i;
+        }
+    }
+
+    for(i = 0; i < 4; ++i) {
+        const int ac = (i == TJEI_LUMA_AC || i == TJEI_CHROMA_AC);
+        tjei_huff_optimal(enc->freq[i], ac ? ac_symbols : dc_symbols, ac ? 162 : 12, bits[i], vals[i]);
+        pbits[i] = bits[i];
+        pvals[i] = vals[i];
+    }
+    memset(enc->freq, 0, sizeof(enc->freq));
+    tjei_huff_expand(enc, pbits, pvals);
+
+    {
+        TJEState hstate;
+        stream_mgr_t m = { enc->dht, TJEI_DHT_MAX + 1, 0 };
+        tjei_init_output(&hstate, tjei_stdlib_func, &m);
+        tjei_write_DHTs(&hstate, pbits, pvals);
+        tjei_flush(&hstate);
+        enc->dht_len = m.dp;
+    }
+}
+
+static void tjei_header_func(void* context, void* data, int size)
+{
+    TJEQualityCache* qc = (TJEQualityCache*)context;
+    if(qc->header_len + size <= TJEI_HEADER_MAX) {
+        memcpy(qc->header + qc->header_len, data, size);
+        qc->header_len += size;
+    } else
+        LOGW("%s over max %d %d\n", __FUNCTION__, qc->header_len, size);
+}
+
+// Writes SOI, DQT, SOF, DHT and SOS. The SOF carries a zero frame size and
+// 1x1 sampling; tjei_encode_main() patches both.
+static void tjei_write_header(TJEState* state, TJEQualityCache* qc)
+{
+    int i;
+
 #if 0
 
     {
@@ -947,69 +2103,274 @@ static OPTIMIZE_ATTR int tjei_encode_main(TJEState* state,
         tjei_write(state, &com, sizeof(TJEJPEGComment), 1);
     }
 #endif
-    // Write quantization tables.
-    tjei_write_DQT(state, state->qt_luma, 0x00);
-    tjei_write_DQT(state, state->qt_chroma, 0x01);
+    // Write quantization tables.
+    tjei_write_DQT(state, qc->qt_luma, 0x00);
+    tjei_write_DQT(state, qc->qt_chroma, 0x01);
+
+    // Everything buffered so far is ahead of the SOF.
+    qc->sof_offset = qc->header_len + (int)(state->bw.out - state->output_buffer);
+
+    {
+        // Write the frame marker.
+        TJEFrameHeader header;
+        header.SOF = tjei_be_word(0xffc0);
+        header.len = tjei_be_word(8 + 3 * 3);
+        header.precision = 8;
+        // Size and luma sampling are filled in by tjei_encode_main().
+        header.width = 0;
+        header.height = 0;
+        header.num_components = 3;
+        uint8_t tables[3] = {
+            0,  // Luma component gets luma table (see tjei_write_DQT call above.)
+            1,  // Chroma component gets chroma table
+            1,  // Chroma component gets chroma table
+        };
+        for(i = 0; i < 3; ++i) {
+            TJEComponentSpec spec;
+            spec.component_id = (uint8_t)(i + 1);  // No particular reason. Just 1, 2, 3.
+            spec.sampling_factors = (uint8_t)0x11;
+            spec.qt = tables[i];
+
+            header.component_spec[i] = spec;
+        }
+        // Write to file.
+        tjei_write(state, &header, sizeof(TJEFrameHeader), 1);
+    }
+
+    qc->dht_offset = qc->header_len + (int)(state->bw.out - state->output_buffer);
+    tjei_write_DHTs(state, tjei_ht_bits, tjei_ht_vals);
+
+    qc->sos_offset = qc->header_len + (int)(state->bw.out - state->output_buffer);
+
+    // Write start of scan
+    {
+        TJEScanHeader header;
+        header.SOS = tjei_be_word(0xffda);
+        header.len = tjei_be_word((uint16_t)(6 + (sizeof(TJEFrameComponentSpec) * 3)));
+        header.num_components = 3;
+
+        uint8_t tables[3] = {
+            0x00,
+            0x11,
+            0x11,
+        };
+        for(i = 0; i < 3; ++i) {
+            TJEFrameComponentSpec cs;
+            // Must be equal to component_id from frame header above.
+            cs.component_id = (uint8_t)(i + 1);
+            cs.dc_ac = (uint8_t)tables[i];
+
+            header.component_spec[i] = cs;
+        }
+        header.first = 0;
+        header.last  = 63;
+        header.ah_al = 0;
+        tjei_write(state, &header, sizeof(TJEScanHeader), 1);
+
+    }
+}
+
+// One quantizer scaled to a percentage, clamped to the 8-bit baseline range.
+static uint8_t tjei_scale_qt(uint8_t q, int scale)
+{
+    int v = (q * scale + 50) / 100;
+    if(v < 1) {
+        v = 1;
+    } else if(v > 255) {
+        v = 255;
+    }
+    return (uint8_t)v;
+}
+
+// Returns the tables and header template for a quality level, building them
+// on first use.
+static OPTIMIZE_ATTR TJEQualityCache* tjei_quality_cache(struct TJEEncoder* enc, int quality)
+{
+    TJEQualityCache* qc = &enc->quality[quality - enc->quality_first];
+    int scale;
+    int i, x, y;
+
+    if(qc->ready) {
+        return qc;
+    }
+
+    // Same scale as libjpeg: 50 gives the tables as listed, 100 all ones, and
+    // each step changes the quantizers by a few percent.
+    scale = (quality < 50) ? 5000 / quality : 200 - quality * 2;
+    for(i = 0; i < 64; ++i) {
+        qc->qt_luma[i]   = tjei_scale_qt(tjei_default_qt_luma_from_spec[i], scale);
+        qc->qt_chroma[i] = tjei_scale_qt(tjei_default_qt_chroma_from_paper[i], scale);
+    }
+
+#if TJE_USE_FAST_DCT
+    // Again, taken from classic japanese implementation.
+    //
+    /* For float AA&N IDCT method, divisors are equal to quantization
+     * coefficients scaled by scalefactor[row]*scalefactor[col], where
+     *   scalefactor[0] = 1
+     *   scalefactor[k] = cos(k*PI/16) * sqrt(2)    for k=1..7
+     * We apply a further scale factor of 8.
+     * What's actually stored is 1/divisor so that the inner loop can
+     * use a multiplication rather than a division.
+     */
+    static const FLOAT_INT32_T aan_scales[] = {
+        FLOAT_2_INT32(1.0f), FLOAT_2_INT32(1.387039845f), FLOAT_2_INT32(1.306562965f), FLOAT_2_INT32(1.175875602f),
+        FLOAT_2_INT32(1.0f), FLOAT_2_INT32(0.785694958f), FLOAT_2_INT32(0.541196100f), FLOAT_2_INT32(0.275899379f)
+    };
+
+    // build (de)quantization tables
+    for(y = 0; y < 8; y++) {
+        for(x = 0; x < 8; x++) {
+            FLOAT_INT32_T tmp = 0;
+            i = y * 8 + x;
+            tmp = FLOAT_2_INT32(1.0f) / 8;
+            tmp = FLOAT_2_INT32(tmp) / aan_scales[x];
+            tmp = FLOAT_2_INT32(tmp) / aan_scales[y];
+            tmp =  FLOAT_2_INT32(tmp) / INT8_2_INT32(qc->qt_luma[tjei_zig_zag[i]]);
+            // Quantizers past the fixed point range (low qualities) saturate
+            // at the coarsest step instead of zeroing the coefficient.
+            qc->div_luma.aan[y*8+x] = (tmp > 0) ? tmp : 1;
+            //pqt.luma[y*8+x] = FLOAT_2_INT32(1.0f) / (8 * aan_scales[x] * aan_scales[y] * INT8_2_INT32(qc->qt_luma[tjei_zig_zag[i]]));
+            tmp = FLOAT_2_INT32(1.0f) / 8;
+            tmp = FLOAT_2_INT32(tmp) / aan_scales[x];
+            tmp = FLOAT_2_INT32(tmp) / aan_scales[y];
+            tmp = FLOAT_2_INT32(tmp) / INT8_2_INT32(qc->qt_chroma[tjei_zig_zag[i]]);
+            qc->div_chroma.aan[y*8+x] = (tmp > 0) ? tmp : 1;
+        }
+    }
+
+    for(i = 0; i < 64; ++i) {
+        qc->div_luma.div[i] = 8u * qc->qt_luma[tjei_zig_zag[i]];
+        qc->div_luma.rcp[i] = (uint32_t)((0xffffffffull + qc->div_luma.div[i]) / qc->div_luma.div[i]);
+        qc->div_chroma.div[i] = 8u * qc->qt_chroma[tjei_zig_zag[i]];
+        qc->div_chroma.rcp[i] = (uint32_t)((0xffffffffull + qc->div_chroma.div[i]) / qc->div_chroma.div[i]);
+    }
+#endif
 
+    // Serialize the headers into the cache.
     {
-        // Write the frame marker.
-        TJEFrameHeader header;
-        header.SOF = tjei_be_word(0xffc0);
-        header.len = tjei_be_word(8 + 3 * 3);
-        header.precision = 8;
-        assert(width <= 0xffff);
-        assert(height <= 0xffff);
-        header.width = tjei_be_word((uint16_t)width);
-        header.height = tjei_be_word((uint16_t)height);
-        header.num_components = 3;
-        uint8_t tables[3] = {
-            0,  // Luma component gets luma table (see tjei_write_DQT call above.)
-            1,  // Chroma component gets chroma table
-            1,  // Chroma component gets chroma table
-        };
-        for(i = 0; i < 3; ++i) {
-            TJEComponentSpec spec;
-            spec.component_id = (uint8_t)(i + 1);  // No particular reason. Just 1, 2, 3.
-            spec.sampling_factors = (uint8_t)0x11;
-            spec.qt = tables[i];
+        TJEState hstate;
+        tjei_init_output(&hstate, tjei_header_func, qc);
+        qc->header_len = 0;
+        tjei_write_header(&hstate, qc);
+        tjei_flush(&hstate);
+    }
 
-            header.component_spec[i] = spec;
+    qc->ready = 1;
+    return qc;
+}
+
+// Averages hs x vs full resolution chroma blocks (raster order) into one 8x8 block.
+// Each source block lands in an (8/hs) x (8/vs) corner of the output.
+static void tjei_downsample_chroma(FLOAT_INT32_T full[4][64], int hs, int vs, FLOAT_INT32_T* out)
+{
+    const int shift = (hs * vs == 4) ? 2 : 1;
+    const int round = 1 << (shift - 1);
+    int bx, by, cx, cy;
+
+    for(by = 0; by < vs; ++by) {
+        for(bx = 0; bx < hs; ++bx) {
+            const FLOAT_INT32_T* src = full[by * hs + bx];
+            FLOAT_INT32_T* dst = out + (by * 8 / vs) * 8 + (bx * 8 / hs);
+            for(cy = 0; cy < 8 / vs; ++cy) {
+                const FLOAT_INT32_T* row = src + cy * vs * 8;
+                for(cx = 0; cx < 8 / hs; ++cx) {
+                    FLOAT_INT32_T sum = row[cx * hs];
+                    if(hs == 2) sum += row[cx * hs + 1];
+                    if(vs == 2) {
+                        sum += row[8 + cx * hs];
+                        if(hs == 2) sum += row[8 + cx * hs + 1];
+                    }
+                    dst[cy * 8 + cx] = (sum + round) >> shift;
+                }
+            }
         }
-        // Write to file.
-        tjei_write(state, &header, sizeof(TJEFrameHeader), 1);
     }
+}
 
-    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_DC],   state->ht_vals[TJEI_LUMA_DC], TJEI_DC, 0);
-    tjei_write_DHT(state, state->ht_bits[TJEI_LUMA_AC],   state->ht_vals[TJEI_LUMA_AC], TJEI_AC, 0);
-    tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_DC], state->ht_vals[TJEI_CHROMA_DC], TJEI_DC, 1);
-    tjei_write_DHT(state, state->ht_bits[TJEI_CHROMA_AC], state->ht_vals[TJEI_CHROMA_AC], TJEI_AC, 1);
+// MCU size in pixels: 8x8 for 4:4:4, 16x8 for 4:2:2, 16x16 for 4:2:0.
+#define TJEI_MCU_W(subsampling) ((subsampling) == TJE_SUBSAMPLING_444 ? 8 : 16)
+#define TJEI_MCU_H(subsampling) ((subsampling) == TJE_SUBSAMPLING_420 ? 16 : 8)
 
-    // Write start of scan
-    {
-        TJEScanHeader header;
-        header.SOS = tjei_be_word(0xffda);
-        header.len = tjei_be_word((uint16_t)(6 + (sizeof(TJEFrameComponentSpec) * 3)));
-        header.num_components = 3;
+// Writes the DHTs in use: the optimized ones, else the defaults from the
+// cached header.
+static void tjei_write_current_DHTs(TJEState* state)
+{
+    const TJEQualityCache* qc = state->qc;
+    if(state->enc->dht_len) {
+        tjei_write(state, state->enc->dht, (size_t)state->enc->dht_len, 1);
+    } else {
+        tjei_write(state, qc->header + qc->dht_offset, (size_t)(qc->sos_offset - qc->dht_offset), 1);
+    }
+}
 
-        uint8_t tables[3] = {
-            0x00,
-            0x11,
-            0x11,
-        };
-        for(i = 0; i < 3; ++i) {
-            TJEFrameComponentSpec cs;
-            // Must be equal to component_id from frame header above.
-            cs.component_id = (uint8_t)(i + 1);
-            cs.dc_ac = (uint8_t)tables[i];
+static void tjei_write_frame_header(TJEState* state)
+{
+    const int mcu_w = TJEI_MCU_W(state->subsampling);
+    const int mcu_h = TJEI_MCU_H(state->subsampling);
+    TJEQualityCache* qc = state->qc;
+    uint8_t* sof = qc->header + qc->sof_offset;
+
+    // Frame size and luma sampling are the only per-frame parts of the header.
+    uint16_t be_height = tjei_be_word((uint16_t)state->height);
+    uint16_t be_width = tjei_be_word((uint16_t)state->width);
+    memcpy(sof + offsetof(TJEFrameHeader, height), &be_height, sizeof(uint16_t));
+    memcpy(sof + offsetof(TJEFrameHeader, width), &be_width, sizeof(uint16_t));
+    sof[offsetof(TJEFrameHeader, component_spec) + offsetof(TJEComponentSpec, sampling_factors)] =
+        (uint8_t)(((mcu_w / 8) << 4) | (mcu_h / 8));
+
+    if(state->enc->abbreviated) {
+        // SOI and SOF; no tables.
+        tjei_write(state, qc->header, sizeof(uint16_t), 1);
+        tjei_write(state, sof, (size_t)(qc->dht_offset - qc->sof_offset), 1);
+    } else {
+        tjei_huff_adopt(state->enc);
+        tjei_write(state, qc->header, (size_t)qc->dht_offset, 1);
+        tjei_write_current_DHTs(state);
+    }
+    if(state->enc->restart_interval) {
+        tjei_write_DRI(state, (uint16_t)state->enc->restart_interval);
+    }
+    tjei_write(state, qc->header + qc->sos_offset, (size_t)(qc->header_len - qc->sos_offset), 1);
+}
 
-            header.component_spec[i] = cs;
+// Adds the symbol counts of this call to the encoder. Slices of one frame may
+// finish at the same time, hence the atomic adds.
+static void tjei_add_freq(TJEState* state)
+{
+    int i, k;
+    if(!state->enc->optimize_huffman) {
+        return;
+    }
+    for(i = 0; i < 4; ++i) {
+        for(k = 0; k < 256; ++k) {
+            if(state->freq[i][k]) {
+                TJEI_ATOMIC_ADD(&state->enc->freq[i][k], state->freq[i][k]);
+            }
         }
-        header.first = 0;
-        header.last  = 63;
-        header.ah_al = 0;
-        tjei_write(state, &header, sizeof(TJEScanHeader), 1);
+    }
+}
+
+// Entropy codes MCUs [mcu_begin, mcu_end) in raster order. mcu_begin must start
+// a restart segment. Ends with RSTn if more MCUs follow, with EOI otherwise, so
+// the output of consecutive ranges can simply be concatenated.
+static OPTIMIZE_ATTR void tjei_encode_mcus(TJEState* state, int mcu_begin, int mcu_end)
+{
+    const int mcu_w = TJEI_MCU_W(state->subsampling);
+    const int mcu_h = TJEI_MCU_H(state->subsampling);
+    const int mcus_x = (state->width + mcu_w - 1) / mcu_w;
+    const int mcus_y = (state->height + mcu_h - 1) / mcu_h;
+    const int restart_interval = state->enc->restart_interval;
+    uint32_t* freq[4] = { NULL, NULL, NULL, NULL };
+    int i;
 
+    if(state->enc->optimize_huffman) {
+        memset(state->freq, 0, sizeof(state->freq));
+        for(i = 0; i < 4; ++i) {
+            freq[i] = state->freq[i];
+        }
     }
+
     // Write compressed data.
 
     FLOAT_INT32_T du_y[64];
@@ -1021,93 +2382,80 @@ static OPTIMIZE_ATTR int tjei_encode_main(TJEState* state,
     int pred_b = 0;
     int pred_r = 0;
 
-    // Bit stack
-    uint32_t bitbuffer = 0;
-    uint32_t location = 0;
-
-
-    for(y = 0; y < height; y += 8) {
-        for(x = 0; x < width; x += 8) {
-            // Block loop: ====
-            for(off_y = 0; off_y < 8; ++off_y) {
-                for(off_x = 0; off_x < 8; ++off_x) {
-                    int block_index = (off_y * 8 + off_x);
-
-                    int src_index = (((y + off_y) * width) + (x + off_x)) * src_num_components;
-
-                    int col = x + off_x;
-                    int row = y + off_y;
-
-                    if(row >= height) {
-                        src_index -= (width * (row - height + 1)) * src_num_components;
-                    }
-                    if(col >= width) {
-                        src_index -= (col - width + 1) * src_num_components;
-                    }
-                    assert(src_index < width * height * src_num_components);
-
-                    uint8_t r = src_data[src_index + 0];
-                    uint8_t g = src_data[src_index + 1];
-                    uint8_t b = src_data[src_index + 2];
-
-                    FLOAT_INT32_T luma = FLOAT_2_INT32(0.299f)   * r + FLOAT_2_INT32(0.587f)    * g + FLOAT_2_INT32(0.114f)    * b - FLOAT_2_INT32(128);
-                    FLOAT_INT32_T cb   = FLOAT_2_INT32(-0.1687f) * r - FLOAT_2_INT32(0.3313f)   * g + FLOAT_2_INT32(0.5f)      * b;
-                    FLOAT_INT32_T cr   = FLOAT_2_INT32(0.5f)     * r - FLOAT_2_INT32(0.4187f)   * g - FLOAT_2_INT32(0.0813f)   * b;
 
-                    du_y[block_index] = luma;
-                    du_b[block_index] = cb;
-                    du_r[block_index] = cr;
-                }
-            }
-
-            tjei_encode_and_write_MCU(state, du_y,
-#if TJE_USE_FAST_DCT
-                                      pqt.luma,
-#else
-                                      state->qt_luma,
-#endif
-                                      state->ehuffsize[TJEI_LUMA_DC], state->ehuffcode[TJEI_LUMA_DC],
-                                      state->ehuffsize[TJEI_LUMA_AC], state->ehuffcode[TJEI_LUMA_AC],
-                                      &pred_y, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_b,
-#if TJE_USE_FAST_DCT
-                                      pqt.chroma,
-#else
-                                      state->qt_chroma,
-#endif
-                                      state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                      state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                      &pred_b, &bitbuffer, &location);
-            tjei_encode_and_write_MCU(state, du_r,
 #if TJE_USE_FAST_DCT
-                                      pqt.chroma,
+    const TJEDivisors* qt_luma = &state->qc->div_luma;
+    const TJEDivisors* qt_chroma = &state->qc->div_chroma;
 #else
-                                      state->qt_chroma,
+    uint8_t* qt_luma = state->qc->qt_luma;
+    uint8_t* qt_chroma = state->qc->qt_chroma;
 #endif
-                                      state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
-                                      state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                      &pred_r, &bitbuffer, &location);
-
 
+    for(i = mcu_begin; i < mcu_end; ++i) {
+        const int x = (i % mcus_x) * mcu_w;
+        const int y = (i / mcus_x) * mcu_h;
+        if(restart_interval && i != mcu_begin && i % restart_interval == 0) {
+            tjei_write_restart(state, (i / restart_interval - 1) & 7);
+            pred_y = 0;
+            pred_b = 0;
+            pred_r = 0;
+        }
+        if(mcu_w == 8) {
+            tjei_load_block(state, x, y, du_y, du_b, du_r);
+            tjei_encode_and_write_MCU(state, du_y, qt_luma,
+                                      state->enc->ehuffsize[TJEI_LUMA_DC], state->enc->ehuffcode[TJEI_LUMA_DC],
+                                      state->enc->ehuffsize[TJEI_LUMA_AC], state->enc->ehuffcode[TJEI_LUMA_AC],
+                                      freq[TJEI_LUMA_DC], freq[TJEI_LUMA_AC], &pred_y);
+        } else {
+            // Full resolution chroma of each luma block, averaged down below.
+            FLOAT_INT32_T full_b[4][64];
+            FLOAT_INT32_T full_r[4][64];
+            int off_x, off_y, n = 0;
+            for(off_y = 0; off_y < mcu_h; off_y += 8) {
+                for(off_x = 0; off_x < mcu_w; off_x += 8, ++n) {
+                    tjei_load_block(state, x + off_x, y + off_y, du_y, full_b[n], full_r[n]);
+                    tjei_encode_and_write_MCU(state, du_y, qt_luma,
+                                              state->enc->ehuffsize[TJEI_LUMA_DC], state->enc->ehuffcode[TJEI_LUMA_DC],
+                                              state->enc->ehuffsize[TJEI_LUMA_AC], state->enc->ehuffcode[TJEI_LUMA_AC],
+                                              freq[TJEI_LUMA_DC], freq[TJEI_LUMA_AC], &pred_y);
+                }
+            }
+            tjei_downsample_chroma(full_b, mcu_w / 8, mcu_h / 8, du_b);
+            tjei_downsample_chroma(full_r, mcu_w / 8, mcu_h / 8, du_r);
         }
+        tjei_encode_and_write_MCU(state, du_b, qt_chroma,
+                                  state->enc->ehuffsize[TJEI_CHROMA_DC], state->enc->ehuffcode[TJEI_CHROMA_DC],
+                                  state->enc->ehuffsize[TJEI_CHROMA_AC], state->enc->ehuffcode[TJEI_CHROMA_AC],
+                                  freq[TJEI_CHROMA_DC], freq[TJEI_CHROMA_AC], &pred_b);
+        tjei_encode_and_write_MCU(state, du_r, qt_chroma,
+                                  state->enc->ehuffsize[TJEI_CHROMA_DC], state->enc->ehuffcode[TJEI_CHROMA_DC],
+                                  state->enc->ehuffsize[TJEI_CHROMA_AC], state->enc->ehuffcode[TJEI_CHROMA_AC],
+                                  freq[TJEI_CHROMA_DC], freq[TJEI_CHROMA_AC], &pred_r);
     }
 
-    // Finish the image.
-    {
-        // Flush
-        if(location > 0 && location < 8) {
-            tjei_write_bits(state, &bitbuffer, &location, (uint16_t)(8 - location), 0);
-        }
+    if(mcu_end < mcus_x * mcus_y) {
+        tjei_write_restart(state, (mcu_end / restart_interval - 1) & 7);
+        return;
     }
+
+    // Finish the image.
+    tjei_flush_bits(state, &state->bw, 0);
     uint16_t EOI = tjei_be_word(0xffd9);
     tjei_write(state, &EOI, sizeof(uint16_t), 1);
+}
 
-    if(state->output_buffer_count) {
-        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
-        state->output_buffer_count = 0;
-    }
+static OPTIMIZE_ATTR int tjei_encode_main(TJEState* state)
+{
+    const int mcu_w = TJEI_MCU_W(state->subsampling);
+    const int mcu_h = TJEI_MCU_H(state->subsampling);
+    const int mcus_x = (state->width + mcu_w - 1) / mcu_w;
+    const int mcus_y = (state->height + mcu_h - 1) / mcu_h;
 
-    return 1;
+    tjei_write_frame_header(state);
+    tjei_encode_mcus(state, 0, mcus_x * mcus_y);
+    tjei_add_freq(state);
+
+    return tjei_flush(state);
 }
 
 
@@ -1116,9 +2464,11 @@ int tje_encode_to_ctx(void * ctx,
                       const int height,
                       const int num_components,
                       const unsigned char* src_data,
-                      const int quality)
+                      const int pitch,
+                      const int quality,
+                      const int subsampling)
 {
-    int res = tje_encode_to_ctx_at_quality(ctx, quality, width, height, num_components, src_data);
+    int res = tje_encode_to_ctx_at_quality(ctx, quality, width, height, num_components, src_data, pitch, subsampling);
     return res;
 }
 
@@ -1139,101 +2489,521 @@ int tje_encode_to_ctx_at_quality(void * ctx,
                                  const int width,
                                  const int height,
                                  const int num_components,
-                                 const unsigned char* src_data)
+                                 const unsigned char* src_data,
+                                 const int pitch,
+                                 const int subsampling)
 {
 
 
     int result = tje_encode_with_func(tjei_stdlib_func, ctx,
-                                      quality, width, height, num_components, src_data);
+                                      quality, width, height, num_components, src_data, pitch, subsampling);
 
 
 
     return result;
 }
 
-int tje_encode_with_func(tje_write_func* func,
-                         void* context,
-                         const int iquality,
-                         const int width,
-                         const int height,
-                         const int num_components,
-                         const unsigned char* src_data)
+// One allocation holds the encoder, the quality levels it caches and, with
+// rate_control, the blocks tje_encoder_choose_quality() samples.
+static tje_encoder_t* tjei_encoder_alloc(int quality_first, int quality_levels, int rate_control)
+{
+    size_t size = sizeof(tje_encoder_t) + quality_levels * sizeof(TJEQualityCache);
+    if(rate_control) {
+        size += TJEI_RATE_BLOCKS * 63 * sizeof(uint32_t) + TJEI_RATE_BLOCKS * sizeof(TJERateBlock);
+    }
+    tje_encoder_t* enc = (tje_encoder_t*)malloc(size);
+    if(!enc) {
+        LOGW("encoder malloc NG\n");
+        return NULL;
+    }
+    memset(enc, 0, size);
+    enc->quality = (TJEQualityCache*)(enc + 1);
+    enc->quality_first = quality_first;
+    if(rate_control) {
+        enc->rate_coef = (uint32_t*)(enc->quality + quality_levels);
+        enc->rate_block = (TJERateBlock*)(enc->rate_coef + TJEI_RATE_BLOCKS * 63);
+    }
+    enc->rate_gain = 1024;
+    tjei_init_kernels();
+    tjei_huff_expand(enc, tjei_ht_bits, tjei_ht_vals);
+    return enc;
+}
+
+tje_encoder_t* tje_encoder_create(void)
+{
+    return tjei_encoder_alloc(1, MAX_JPG_QUAILITY, 1);
+}
+
+void tje_encoder_destroy(tje_encoder_t* enc)
+{
+    free(enc);
+}
+
+void tje_encoder_set_restart_interval(tje_encoder_t* enc, int mcus)
+{
+    if(mcus < 0) {
+        mcus = 0;
+    } else if(mcus > 0xffff) {
+        mcus = 0xffff;
+    }
+    enc->restart_interval = mcus;
+}
+
+void tje_encoder_set_optimize_huffman(tje_encoder_t* enc, int enable)
+{
+    enc->optimize_huffman = enable ? 1 : 0;
+    memset(enc->freq, 0, sizeof(enc->freq));
+    if(!enable && enc->dht_len) {
+        tjei_huff_expand(enc, tjei_ht_bits, tjei_ht_vals);
+        enc->dht_len = 0;
+    }
+}
+
+void tje_encoder_set_abbreviated(tje_encoder_t* enc, int enable)
+{
+    enc->abbreviated = enable ? 1 : 0;
+}
+
+void tje_encoder_set_dct(tje_encoder_t* enc, int method)
+{
+    enc->dct_method = (method == TJE_DCT_ISLOW) ? TJE_DCT_ISLOW : TJE_DCT_FAST;
+}
+
+static int tjei_init_state(TJEState* state,
+                           tje_encoder_t* enc,
+                           tje_write_func* func,
+                           void* context,
+                           const int iquality,
+                           const int width,
+                           const int height,
+                           const int num_components,
+                           const unsigned char* src_data,
+                           const int pitch,
+                           const int subsampling)
 {
-#define MAX_JPG_QUAILITY 10
-    TJEState mstate;
-    TJEState *pstate ;
-    uint8_t qt_factor = 1;
     int quality = iquality;
-    int i;
     if(quality < 1 || quality > MAX_JPG_QUAILITY) {
-        tje_log("[ERROR] -- Valid 'quality'%d values are 1 (lowest), 2,3,4,5,(highest)\n", quality);
+        tje_log("[ERROR] -- Valid 'quality'%d values are 1 (lowest) to 100 (highest)\n", quality);
         if(quality < 1)
             quality = 1;
         else
             quality = MAX_JPG_QUAILITY;
     }
-#if 0
-    pstate = xmalloc(sizeof(TJEState));
-    if(!pstate) {
-        LOGW("state malloc NG\n");
-        return -1;
+
+    if(num_components != TJE_RGB && num_components != TJE_RGBA && num_components != TJE_BGRX) {
+        return 0;
     }
-#else
-    pstate = &mstate;
-#endif
-    memset(pstate, 0, sizeof(TJEState));
-    //LOGI("%s w:%d h:%d c:%d quality:%d\n",__FUNCTION__,width,height,num_components,quality);
-    switch(quality) {
-    case MAX_JPG_QUAILITY:
+
+    if(width <= 0 || height <= 0 || width > 0xffff || height > 0xffff) {
+        return 0;
+    }
+
+    // Not memset: the 1K output buffer does not need clearing.
+    state->enc = enc;
+    state->qc = tjei_quality_cache(enc, quality);
+    if(!state->qc) {
+        return 0;
+    }
+
+    tjei_init_output(state, func, context);
+
+    state->src_data = src_data;
+    state->src_format = num_components;
+    state->src_pitch = pitch ? pitch : width * (num_components == TJE_RGB ? 3 : 4);
+    state->width = width;
+    state->height = height;
+    state->subsampling = subsampling;
+    if(subsampling != TJE_SUBSAMPLING_422 && subsampling != TJE_SUBSAMPLING_420) {
+        state->subsampling = TJE_SUBSAMPLING_444;
+    }
+    return 1;
+}
+
+static int tjei_encoder_encode(tje_encoder_t* enc,
+                               tje_write_func* func,
+                               void* context,
+                               const int quality,
+                               const int width,
+                               const int height,
+                               const int num_components,
+                               const unsigned char* src_data,
+                               const int pitch,
+                               const int subsampling)
+{
+    TJEState state;
+    if(!tjei_init_state(&state, enc, func, context,
+                        quality, width, height, num_components, src_data, pitch, subsampling)) {
+        return 0;
+    }
+    return tjei_encode_main(&state);
+}
+
+int tje_encoder_encode_to_ctx(tje_encoder_t* enc,
+                              void * ctx,
+                              const int width,
+                              const int height,
+                              const int num_components,
+                              const unsigned char* src_data,
+                              const int pitch,
+                              const int quality,
+                              const int subsampling)
+{
+    return tjei_encoder_encode(enc, tjei_stdlib_func, ctx,
+                               quality, width, height, num_components, src_data, pitch, subsampling);
+}
+
+void tje_mcu_grid(const int width, const int height, const int subsampling, int* cols, int* rows)
+{
+    // Unknown modes encode as 4:4:4, same as tjei_init_state().
+    const int mode = (subsampling == TJE_SUBSAMPLING_422 || subsampling == TJE_SUBSAMPLING_420) ?
+                     subsampling : TJE_SUBSAMPLING_444;
+    const int mcu_w = TJEI_MCU_W(mode);
+    const int mcu_h = TJEI_MCU_H(mode);
+    *cols = (width + mcu_w - 1) / mcu_w;
+    *rows = (height + mcu_h - 1) / mcu_h;
+}
+
+int tje_encoder_encode_header_to_ctx(tje_encoder_t* enc,
+                                     void * ctx,
+                                     const int width,
+                                     const int height,
+                                     const int quality,
+                                     const int subsampling)
+{
+    TJEState state;
+    if(!tjei_init_state(&state, enc, tjei_stdlib_func, ctx,
+                        quality, width, height, TJE_BGRX, NULL, 0, subsampling)) {
+        return 0;
+    }
+    tjei_write_frame_header(&state);
+    return tjei_flush(&state);
+}
+
+int tje_encoder_encode_tables_to_ctx(tje_encoder_t* enc,
+                                     void * ctx,
+                                     const int quality)
+{
+    TJEState state;
+    uint16_t EOI = tjei_be_word(0xffd9);
+    if(!tjei_init_state(&state, enc, tjei_stdlib_func, ctx,
+                        quality, 1, 1, TJE_BGRX, NULL, 0, TJE_SUBSAMPLING_444)) {
+        return 0;
+    }
+    // SOI, DQTs, DHTs, EOI: an abbreviated table-specification stream (B.5).
+    tjei_huff_adopt(enc);
+    tjei_write(&state, state.qc->header, (size_t)state.qc->sof_offset, 1);
+    tjei_write_current_DHTs(&state);
+    tjei_write(&state, &EOI, sizeof(uint16_t), 1);
+    return tjei_flush(&state);
+}
+
+int tje_encoder_encode_rows_to_ctx(tje_encoder_t* enc,
+                                   void * ctx,
+                                   const int width,
+                                   const int height,
+                                   const int num_components,
+                                   const unsigned char* src_data,
+                                   const int pitch,
+                                   const int quality,
+                                   const int subsampling,
+                                   const int first_row,
+                                   const int num_rows)
+{
+    TJEState state;
+    int cols, rows, begin, end;
+    const int restart_interval = enc->restart_interval;
+
+    if(!tjei_init_state(&state, enc, tjei_stdlib_func, ctx,
+                        quality, width, height, num_components, src_data, pitch, subsampling)) {
+        return 0;
+    }
+    tje_mcu_grid(width, height, state.subsampling, &cols, &rows);
+    if(first_row < 0 || num_rows <= 0 || first_row + num_rows > rows) {
+        return 0;
+    }
+    begin = first_row * cols;
+    end = (first_row + num_rows) * cols;
+    // Inner slice edges must be restart boundaries.
+    if(begin != 0 && (restart_interval == 0 || begin % restart_interval)) {
+        return 0;
+    }
+    if(end != rows * cols && (restart_interval == 0 || end % restart_interval)) {
+        return 0;
+    }
+
+    tjei_encode_mcus(&state, begin, end);
+    tjei_add_freq(&state);
+    return tjei_flush(&state);
+}
+
+// ============================================================
+// Rate control.
+//
+// tje_encoder_choose_quality() transforms TJEI_RATE_MCUS MCUs, in pairs of
+// neighbours spread evenly over the frame, and keeps their AC terms. For a
+// candidate quality it quantizes them with that quality's divisors and adds up
+// the code lengths the current Huffman tables give them, runs and EOB
+// included; DC is costed on the second MCU of each pair, whose predictor is
+// known. Scaled to the whole frame that is the size estimate, without coding
+// anything. rate_gain follows the ratio of coded to estimated size over
+// recent frames for what the sample does not see.
+// ============================================================
+
+static void tjei_discard_func(void* context, void* data, int size)
+{
+    (void)context;
+    (void)data;
+    (void)size;
+}
+
+static int tjei_bit_length(uint64_t v)
+{
+    int n = 0;
+    while(v) {
+        ++n;
+        v >>= 1;
+    }
+    return n;
+}
+
+static void tjei_rate_add_block(struct TJEEncoder* enc, const FLOAT_INT32_T* block, int chroma, int* pred)
+{
+    TJERateBlock* rb = &enc->rate_block[enc->rate_blocks];
+    uint32_t n = enc->rate_blocks ? enc->rate_block[enc->rate_blocks - 1].end : 0;
+    FLOAT_INT32_T dct[64];
+    FLOAT_INT32_T zz[64];
+    int i;
+
+    rb->chroma = (uint8_t)chroma;
+    rb->pred = (int16_t)*pred;
+    *pred = enc->rate_blocks;
+    if(tjei_block_is_flat(block)) {
+        rb->dc = block[0] * 64;
+    } else {
+        memcpy(dct, block, sizeof(dct));
+        tjei_fdct(dct);
+        rb->dc = dct[0];
         for(i = 0; i < 64; ++i) {
-            pstate->qt_luma[i]   = 1;
-            pstate->qt_chroma[i] = 1;
+            zz[tjei_zig_zag[i]] = dct[i];
         }
-        break;
-    case 9:
-    case 8:
-    case 7:
-    case 6:
-    case 5:
-    case 4:
-    case 3:
-    case 2:
-
-        //qt_factor = 5;
-        qt_factor = quality;//less size but less quality 13.xfps
-        //qt_factor = 2;//13.xfps
-        //qt_factor = 4;//13.xfps
-        // don't break. fall through.
-    case 1:
-        for(i = 0; i < 64; ++i) {
-            pstate->qt_luma[i]   = tjei_default_qt_luma_from_spec[i] / qt_factor;
-            if(pstate->qt_luma[i] == 0) {
-                pstate->qt_luma[i] = 1;
+        // Below 2^8 nothing quantizes to non-zero at any quality.
+        for(i = 1; i < 64; ++i) {
+            uint32_t mag = (uint32_t)(zz[i] < 0 ? -zz[i] : zz[i]);
+            if(mag >= 256) {
+                enc->rate_coef[n++] = ((uint32_t)i << 24) | (mag < 0xffffff ? mag : 0xffffff);
+            }
+        }
+    }
+    rb->end = n;
+    ++enc->rate_blocks;
+}
+
+static void tjei_rate_sample(TJEState* state)
+{
+    struct TJEEncoder* enc = state->enc;
+    const int mcu_w = TJEI_MCU_W(state->subsampling);
+    const int mcu_h = TJEI_MCU_H(state->subsampling);
+    const int mcus_x = (state->width + mcu_w - 1) / mcu_w;
+    const int mcus_y = (state->height + mcu_h - 1) / mcu_h;
+    const int mcus = mcus_x * mcus_y;
+    const int pairs = (mcus / 2 < TJEI_RATE_MCUS / 2) ? mcus / 2 : TJEI_RATE_MCUS / 2;
+    FLOAT_INT32_T du_y[64];
+    FLOAT_INT32_T du_b[64];
+    FLOAT_INT32_T du_r[64];
+    FLOAT_INT32_T full_b[4][64];
+    FLOAT_INT32_T full_r[4][64];
+    int p, k;
+
+    enc->rate_blocks = 0;
+    enc->rate_sampled = 0;
+    enc->rate_mcus = mcus;
+
+    for(p = 0; p < pairs; ++p) {
+        int pred[3] = { -1, -1, -1 };
+        for(k = 0; k < 2; ++k) {
+            const int i = (int)((int64_t)mcus * p / pairs) + k;
+            const int x = (i % mcus_x) * mcu_w;
+            const int y = (i / mcus_x) * mcu_h;
+            int off_x, off_y, n = 0;
+            for(off_y = 0; off_y < mcu_h; off_y += 8) {
+                for(off_x = 0; off_x < mcu_w; off_x += 8, ++n) {
+                    tjei_load_block(state, x + off_x, y + off_y, du_y, full_b[n], full_r[n]);
+                    tjei_rate_add_block(enc, du_y, 0, &pred[0]);
+                }
             }
-            pstate->qt_chroma[i] = tjei_default_qt_chroma_from_paper[i] / qt_factor;
-            if(pstate->qt_chroma[i] == 0) {
-                pstate->qt_chroma[i] = 1;
+            if(n == 1) {
+                tjei_rate_add_block(enc, full_b[0], 1, &pred[1]);
+                tjei_rate_add_block(enc, full_r[0], 1, &pred[2]);
+            } else {
+                tjei_downsample_chroma(full_b, mcu_w / 8, mcu_h / 8, du_b);
+                tjei_downsample_chroma(full_r, mcu_w / 8, mcu_h / 8, du_r);
+                tjei_rate_add_block(enc, du_b, 1, &pred[1]);
+                tjei_rate_add_block(enc, du_r, 1, &pred[2]);
             }
+            ++enc->rate_sampled;
+        }
+    }
+}
+
+// Estimated size of the whole frame at `quality` in bytes, before rate_gain.
+static uint64_t tjei_rate_estimate(struct TJEEncoder* enc, int quality)
+{
+    TJEQualityCache* qc = tjei_quality_cache(enc, quality);
+    // Quantized as the coder does: truncated, or rounded for islow.
+    const uint64_t round = (enc->dct_method == TJE_DCT_ISLOW) ? (1u << 19) : 0;
+    uint32_t pqt[2][64];
+    int dcq[TJEI_RATE_BLOCKS];
+    uint64_t ac_bits = 0;
+    uint64_t dc_bits = 0;
+    uint64_t bytes;
+    int dc_blocks = 0;
+    uint32_t j = 0;
+    int b, i;
+
+    for(i = 0; i < 64; ++i) {
+        pqt[0][tjei_zig_zag[i]] = (uint32_t)qc->div_luma.aan[i];
+        pqt[1][tjei_zig_zag[i]] = (uint32_t)qc->div_chroma.aan[i];
+    }
+    for(b = 0; b < enc->rate_blocks; ++b) {
+        const TJERateBlock* rb = &enc->rate_block[b];
+        const uint8_t* dc_len = enc->ehuffsize[rb->chroma ? TJEI_CHROMA_DC : TJEI_LUMA_DC];
+        const uint8_t* ac_len = enc->ehuffsize[rb->chroma ? TJEI_CHROMA_AC : TJEI_LUMA_AC];
+        const uint64_t dc_mag = (uint64_t)(rb->dc < 0 ? -(int64_t)rb->dc : rb->dc);
+        const int dc = (int)((dc_mag * pqt[rb->chroma][0] + round) >> 20);
+        int last = 0;
+
+        dcq[b] = (rb->dc < 0) ? -dc : dc;
+        if(rb->pred >= 0) {
+            const int diff = dcq[b] - dcq[rb->pred];
+            const int size = tjei_bit_length((uint64_t)(diff < 0 ? -diff : diff));
+            dc_bits += dc_len[size] + size;
+            ++dc_blocks;
+        }
+        for(; j < rb->end; ++j) {
+            const int pos = (int)(enc->rate_coef[j] >> 24);
+            const uint64_t v = ((enc->rate_coef[j] & 0xffffff) * (uint64_t)pqt[rb->chroma][pos] + round) >> 20;
+            int run = pos - last - 1;
+            int size;
+            if(!v) {
+                continue;
+            }
+            for(; run >= 16; run -= 16) {
+                ac_bits += ac_len[0xf0];
+            }
+            size = tjei_bit_length(v);
+            if(size > 10) {
+                size = 10;
+            }
+            ac_bits += ac_len[(run << 4) | size] + size;
+            last = pos;
+        }
+        if(last != 63) {
+            ac_bits += ac_len[0x00];
         }
-        break;
-    default:
-        assert(!"invalid code path");
-        break;
+    }
+    if(dc_blocks) {
+        dc_bits = dc_bits * (uint64_t)enc->rate_blocks / (uint64_t)dc_blocks;
     }
 
-    TJEWriteContext wc = { 0 };
+    bytes = (ac_bits + dc_bits) * (uint64_t)enc->rate_mcus / (uint64_t)enc->rate_sampled / 8;
+    // Headers, restart markers and EOI.
+    bytes += enc->abbreviated ? (uint64_t)(qc->dht_offset - qc->sof_offset + 2) : (uint64_t)qc->header_len;
+    if(enc->restart_interval) {
+        bytes += (uint64_t)(enc->rate_mcus - 1) / (uint64_t)enc->restart_interval * 2;
+    }
+    return bytes + 2;
+}
 
-    wc.context = context;
-    wc.func = func;
+int tje_encoder_choose_quality(tje_encoder_t* enc,
+                               const int width,
+                               const int height,
+                               const int num_components,
+                               const unsigned char* src_data,
+                               const int pitch,
+                               const int subsampling,
+                               const int target_bytes,
+                               int min_quality,
+                               int max_quality)
+{
+    TJEState state;
+    int lo, hi;
 
-    pstate->write_context = wc;
+    if(max_quality > MAX_JPG_QUAILITY) {
+        max_quality = MAX_JPG_QUAILITY;
+    }
+    if(min_quality < 1) {
+        min_quality = 1;
+    }
+    if(min_quality > max_quality) {
+        min_quality = max_quality;
+    }
+    enc->rate_predicted = 0;
+    if(!tjei_init_state(&state, enc, tjei_discard_func, NULL,
+                        max_quality, width, height, num_components, src_data, pitch, subsampling)) {
+        return max_quality;
+    }
+    tjei_rate_sample(&state);
+    if(!enc->rate_sampled) {
+        return max_quality;
+    }
 
+    // Highest quality that is estimated to fit; the estimate grows with quality.
+    lo = min_quality;
+    hi = max_quality;
+    while(lo < hi) {
+        const int mid = (lo + hi + 1) / 2;
+        if(((tjei_rate_estimate(enc, mid) * (uint64_t)enc->rate_gain) >> 10) <= (uint64_t)target_bytes) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    enc->rate_quality = lo;
+    enc->rate_predicted = tjei_rate_estimate(enc, lo);
+    return lo;
+}
 
-    tjei_huff_expand(pstate);
+int tje_encoder_predicted_size(tje_encoder_t* enc)
+{
+    return (int)((enc->rate_predicted * (uint64_t)enc->rate_gain) >> 10);
+}
 
-    int result = tjei_encode_main(pstate, src_data, width, height, num_components);
+void tje_encoder_report_size(tje_encoder_t* enc, const int quality, const int bytes)
+{
+    // Only the frame the estimate was made for, coded at the chosen quality,
+    // says anything about the model.
+    if(enc->rate_predicted && quality == enc->rate_quality && bytes > 0) {
+        uint64_t ratio = (uint64_t)bytes * 1024 / enc->rate_predicted;
+        if(ratio < 256) {
+            ratio = 256;
+        } else if(ratio > 4096) {
+            ratio = 4096;
+        }
+        enc->rate_gain = (enc->rate_gain * 3 + (int)ratio) / 4;
+    }
+    enc->rate_predicted = 0;
+}
 
-    //xfree(pstate);
+int tje_encode_with_func(tje_write_func* func,
+                         void* context,
+                         const int quality,
+                         const int width,
+                         const int height,
+                         const int num_components,
+                         const unsigned char* src_data,
+                         const int pitch,
+                         const int subsampling)
+{
+    // One-shot: an encoder with the tables of this quality only, built and
+    // dropped again on every call. tjei_init_state() clamps the same way.
+    const int level = (quality < 1) ? 1 : (quality > MAX_JPG_QUAILITY) ? MAX_JPG_QUAILITY : quality;
+    tje_encoder_t* enc = tjei_encoder_alloc(level, 1, 0);
+    if(!enc) {
+        return 0;
+    }
+    int result = tjei_encoder_encode(enc, func, context,
+                                     quality, width, height, num_components, src_data, pitch, subsampling);
+    tje_encoder_destroy(enc);
     return result;
 }
 // ============================================================
@@ -8,7 +8,8 @@
  *
  * Features
  *  - Implements Baseline DCT JPEG compression.
- *  - No dynamic allocations.
+ *  - No per-frame allocations through a tje_encoder_create() encoder; the
+ *    one-shot tje_encode_* calls allocate and free one on every call.
  *
  * This library is coded in the spirit of the stb libraries and mostly follows
  * the stb guidelines.
@@ -167,6 +168,17 @@ extern "C"
 
 
 
+// Pixel layouts accepted as num_components.
+#define TJE_RGB   3     // R, G, B bytes
+#define TJE_RGBA  4     // R, G, B, A bytes; alpha is ignored
+#define TJE_BGRX  0x14  // 32-bit desktop pixels, blue in the low byte (DXGI B8G8R8A8/X8)
+
+// Chroma subsampling modes. The MCU is 8x8, 16x8 or 16x16 pixels; Cb and Cr
+// are box-averaged down to one 8x8 block per MCU.
+#define TJE_SUBSAMPLING_444 0
+#define TJE_SUBSAMPLING_422 1
+#define TJE_SUBSAMPLING_420 2
+
 // - tje_encode_to_file -
 //
 // Usage:
@@ -175,8 +187,12 @@ extern "C"
 //  PARAMETERS
 //      dest_path:          filename to which we will write. e.g. "out.jpg"
 //      width, height:      image size in pixels
-//      num_components:     3 is RGB. 4 is RGBA. Those are the only supported values
-//      src_data:           pointer to the pixel data.
+//      num_components:     TJE_RGB, TJE_RGBA or TJE_BGRX
+//      src_data:           pointer to the first pixel of the image.
+//      pitch:              bytes from one row to the next. 0 means tightly packed.
+//      quality:            1 (smallest) to 100 (best), as in libjpeg. 50 uses
+//                          the Annex K tables; 100 quantizes by 1.
+//      subsampling:        TJE_SUBSAMPLING_444, _422 or _420
 //
 //  RETURN:
 //      0 on error. 1 on success.
@@ -187,7 +203,9 @@ extern "C"
         const int height,
         const int num_components,
         const unsigned char* src_data,
-        const int quality);
+        const int pitch,
+        const int quality,
+        const int subsampling);
 
 // - tje_encode_to_file_at_quality -
 //
@@ -196,12 +214,13 @@ extern "C"
 //
 //  PARAMETERS
 //      dest_path:          filename to which we will write. e.g. "out.jpg"
-//      quality:            3: Highest. Compression varies wildly (between 1/3 and 1/20).
-//                          2: Very good quality. About 1/2 the size of 3.
-//                          1: Noticeable. About 1/6 the size of 3, or 1/3 the size of 2.
+//      quality:            1 (smallest) to 100 (best). Around 90 one step changes
+//                          the size by a few percent.
 //      width, height:      image size in pixels
-//      num_components:     3 is RGB. 4 is RGBA. Those are the only supported values
+//      num_components:     TJE_RGB, TJE_RGBA or TJE_BGRX
 //      src_data:           pointer to the pixel data.
+//      pitch:              bytes from one row to the next. 0 means tightly packed.
+//      subsampling:        TJE_SUBSAMPLING_444, _422 or _420
 //
 //  RETURN:
 //      0 on error. 1 on success.
@@ -212,7 +231,9 @@ extern "C"
         const int width,
         const int height,
         const int num_components,
-        const unsigned char* src_data);
+        const unsigned char* src_data,
+        const int pitch,
+        const int subsampling);
 
 // - tje_encode_with_func -
 //
@@ -221,6 +242,10 @@ extern "C"
 //  how to handle (or ignore) `context`. The callback receives an array `data`
 //  of `size` bytes, which can be written directly to a file. There is no need
 //  to free the data.
+//
+//  These one-shot calls set up a small encoder with the tables of the one
+//  quality they code, about 10 KB, and free it again. To code a stream of
+//  frames, keep a tje_encoder_create() encoder instead.
 
     typedef void tje_write_func(void* context, void* data, int size);
 
@@ -230,7 +255,181 @@ extern "C"
                              const int width,
                              const int height,
                              const int num_components,
-                             const unsigned char* src_data);
+                             const unsigned char* src_data,
+                             const int pitch,
+                             const int subsampling);
+
+// - tje_encoder_create / tje_encoder_destroy / tje_encoder_encode_to_ctx -
+//
+// Usage:
+//  A reusable encoder. The Huffman tables are built once at creation; the
+//  quantization tables and the serialized headers for each quality level are
+//  built the first time that level is used. Encoding a frame then only does
+//  color conversion, DCT and entropy coding. Arguments are the same as for
+//  tje_encode_to_ctx. One encoder must not be used by two threads at once.
+//
+//  tje_encoder_create returns NULL if it cannot allocate.
+
+    typedef struct TJEEncoder tje_encoder_t;
+
+    tje_encoder_t* tje_encoder_create(void);
+    void tje_encoder_destroy(tje_encoder_t* enc);
+
+    int tje_encoder_encode_to_ctx(
+        tje_encoder_t* enc,
+        void * ctx,
+        const int width,
+        const int height,
+        const int num_components,
+        const unsigned char* src_data,
+        const int pitch,
+        const int quality,
+        const int subsampling);
+
+// - tje_encoder_set_restart_interval -
+//
+// Usage:
+//  Splits the scan into entropy-coded segments of `mcus` MCUs each, with a
+//  DRI marker in the header and RST0..RST7 between segments. DC prediction
+//  restarts at every marker, so a damaged byte only spoils its own segment
+//  and segments can be coded independently. 0 (the default) turns it off.
+//  An MCU is 8x8, 16x8 or 16x16 pixels depending on the subsampling mode.
+
+    void tje_encoder_set_restart_interval(tje_encoder_t* enc, int mcus);
+
+// - tje_encoder_set_optimize_huffman -
+//
+// Usage:
+//  With `enable` set, the encoder counts the Huffman symbols of each frame and
+//  codes the next frame with optimal tables built from those counts, sent in
+//  its DHT. Frames of a stream look alike, so this gets most of the gain of a
+//  two-pass encode at the cost of the counting. The first frame after enabling
+//  uses the default tables. 0 (the default) goes back to the default tables.
+//
+//  With sliced encoding the tables change in
+//  tje_encoder_encode_header_to_ctx(), so every frame must start with it.
+//  The rows calls add their counts atomically and may still run concurrently.
+
+    void tje_encoder_set_optimize_huffman(tje_encoder_t* enc, int enable);
+
+// - tje_encoder_set_abbreviated / tje_encoder_encode_tables_to_ctx -
+//
+// Usage:
+//  Abbreviated streams (JPEG B.4, B.5) for links where the ~600 byte header of
+//  every frame matters. With tje_encoder_set_abbreviated(enc, 1), frames carry
+//  SOI, SOF, DRI and SOS only. tje_encoder_encode_tables_to_ctx() writes the
+//  matching tables-only stream (SOI, DQT, DHT, EOI) for `quality`; the decoder
+//  must get it before the first frame and again whenever the quality changes.
+//
+//  With optimize_huffman on, the Huffman tables only change when the tables
+//  are written, so the caller decides how often to refresh them. The symbol
+//  counts of all frames since the last refresh are used.
+
+    void tje_encoder_set_abbreviated(tje_encoder_t* enc, int enable);
+
+    int tje_encoder_encode_tables_to_ctx(
+        tje_encoder_t* enc,
+        void * ctx,
+        const int quality);
+
+// - tje_encoder_set_dct -
+//
+// Usage:
+//  Picks the forward DCT and quantizer. TJE_DCT_FAST (the default) is the AAN
+//  DCT in x1024 fixed point with the SIMD kernels below; it truncates when
+//  quantizing. TJE_DCT_ISLOW is libjpeg's accurate integer DCT with
+//  round-to-nearest quantization: more quality per byte for more CPU time,
+//  scalar code only. The stream format is the same either way.
+
+#define TJE_DCT_FAST  0
+#define TJE_DCT_ISLOW 1
+
+    void tje_encoder_set_dct(tje_encoder_t* enc, int method);
+
+// - tje_encoder_choose_quality / tje_encoder_report_size -
+//
+// Usage:
+//  Single-pass rate control. tje_encoder_choose_quality() analyzes a fixed
+//  sample of 128 MCUs, estimates the coded size at each quality from it and
+//  returns the highest quality in [min_quality, max_quality] estimated to fit
+//  in target_bytes, or min_quality. tje_encoder_predicted_size() returns the
+//  estimate for the quality chosen.
+//
+//  After coding the frame at that quality, pass the bytes it took to
+//  tje_encoder_report_size(). The encoder scales its estimates by how far off
+//  they were on recent frames, which covers sampling bias and transport
+//  overhead the estimate does not see.
+
+    int tje_encoder_choose_quality(
+        tje_encoder_t* enc,
+        const int width,
+        const int height,
+        const int num_components,
+        const unsigned char* src_data,
+        const int pitch,
+        const int subsampling,
+        const int target_bytes,
+        int min_quality,
+        int max_quality);
+
+    int tje_encoder_predicted_size(tje_encoder_t* enc);
+
+    void tje_encoder_report_size(tje_encoder_t* enc, const int quality, const int bytes);
+
+// - tje_mcu_grid / tje_encoder_encode_header_to_ctx / tje_encoder_encode_rows_to_ctx -
+//
+// Usage:
+//  Encodes one frame as independent slices of MCU rows, e.g. on several
+//  threads. tje_mcu_grid() gives the frame size in MCUs.
+//
+//  Write the header first with tje_encoder_encode_header_to_ctx(). Then encode
+//  each slice into its own ctx with tje_encoder_encode_rows_to_ctx(); these
+//  calls may run concurrently. The header followed
+//  by the slices in order is a complete JPEG, byte-identical to
+//  tje_encoder_encode_to_ctx() with the same restart interval.
+//
+//  Slice edges inside the frame must fall on restart boundaries, so the
+//  restart interval has to divide first_row * cols. Returns 0 otherwise.
+
+    void tje_mcu_grid(const int width, const int height, const int subsampling, int* cols, int* rows);
+
+    int tje_encoder_encode_header_to_ctx(
+        tje_encoder_t* enc,
+        void * ctx,
+        const int width,
+        const int height,
+        const int quality,
+        const int subsampling);
+
+    int tje_encoder_encode_rows_to_ctx(
+        tje_encoder_t* enc,
+        void * ctx,
+        const int width,
+        const int height,
+        const int num_components,
+        const unsigned char* src_data,
+        const int pitch,
+        const int quality,
+        const int subsampling,
+        const int first_row,
+        const int num_rows);
+
+// - tje_set_simd_level / tje_get_simd_level -
+//
+// Usage:
+//  The CPU is checked once, and the forward DCT + quantization kernel for
+//  its level picked when the first encoder is created. tje_set_simd_level()
+//  caps the level that may be used (TJE_SIMD_NONE forces the scalar path) and
+//  picks the kernel again; it must not be called while any encode runs.
+//  tje_get_simd_level() returns the level actually in use. All levels produce
+//  identical output.
+
+#define TJE_SIMD_NONE 0
+#define TJE_SIMD_SSE2 1
+#define TJE_SIMD_AVX2 2
+
+    void tje_set_simd_level(int max_level);
+    int tje_get_simd_level(void);
 
 #endif // TJE_HEADER_GUARD
 
@@ -240,10 +439,17 @@ extern "C"
 // define TJE_IMPLEMENTATION and include tiny_jpeg.h
 
 
+    // Output span for tje_encode_to_ctx(). If packet_size is non-zero the span
+    // is cut into packets of that many bytes and the encoder stores
+    // packet_header as the first byte of every packet after the first, so the
+    // output can go to a packetized transport as is. dp then counts those
+    // header bytes too.
     typedef struct {
         uint8_t * data;
         int max;
         int   dp;
+        int packet_size;
+        uint8_t packet_header;
     } stream_mgr_t;
 
 